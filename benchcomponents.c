@@ -4,43 +4,64 @@ int get_nb_workers(void) {
    return 1;
 }
 
+/* Simulate the IO engine: a page that is not cached is read from disk, and then contains data */
+static int access_page(struct pagecache *p, uint64_t hash, int one_shot) {
+   void *page;
+   struct lru *lru = NULL;
+   int cached = get_page(p, hash, one_shot, &page, &lru);
+   lru->contains_data = 1;
+   return cached;
+}
+
 #define NB_PAGECACHE_ACCESSES 10000000LU
 static struct pagecache *p;
-void bench_pagecache(void) {
+void bench_pagecache(struct pagecache_policy *policy) {
    declare_timer;
    p = malloc(sizeof(*p));
-   page_cache_init(p);
+   page_cache_set_policy(policy);
+   page_cache_init(p, PAGE_SIZE, PAGE_CACHE_SIZE);
+   printf("#Page cache policy: %s\n", policy->name);
 
    start_timer {
-      void *page;
-      struct lru *lru;
       for(size_t i = 0; i < PAGE_CACHE_SIZE/PAGE_SIZE; i++) {
          uint64_t hash = i;
-         get_page(p, hash, &page, &lru);
+         access_page(p, hash, 0);
       }
    } stop_timer("Filling the page cache: %lu ops, %lu ops/s\n", PAGE_CACHE_SIZE/PAGE_SIZE, PAGE_CACHE_SIZE/PAGE_SIZE*1000000LU/elapsed);
 
    start_timer {
-      void *page;
-      struct lru *lru;
       for(size_t i = 0; i < NB_PAGECACHE_ACCESSES; i++) {
          uint64_t hash = xorshf96() % (PAGE_CACHE_SIZE/PAGE_SIZE);
-         get_page(p, hash, &page, &lru);
+         access_page(p, hash, 0);
       }
    } stop_timer("Accessing existing pages %lu ops, %lu ops/s\n", NB_PAGECACHE_ACCESSES, NB_PAGECACHE_ACCESSES*1000000LU/elapsed);
 
    start_timer {
-      void *page;
-      struct lru *lru;
       for(size_t i = 0; i < NB_PAGECACHE_ACCESSES; i++) {
          uint64_t hash = xorshf96() + PAGE_CACHE_SIZE/PAGE_SIZE;
-         get_page(p, hash, &page, &lru);
+         access_page(p, hash, 0);
       }
    } stop_timer("Accessing non cached pages %lu ops, %lu ops/s\n", NB_PAGECACHE_ACCESSES, NB_PAGECACHE_ACCESSES*1000000LU/elapsed);
+
+   /* Scan resistance: point requests on a hot set of half the cache, interleaved with a scan over 4x the cache */
+   for(int one_shot = 0; one_shot <= 1; one_shot++) {
+      size_t nb_hot = PAGE_CACHE_SIZE/PAGE_SIZE/2, nb_hits = 0, nb_gets = 0;
+      uint64_t scan_start = (1LU<<50) + one_shot*(1LU<<40); // far from the pages used above
+      for(size_t i = 0; i < nb_hot; i++)
+         access_page(p, i, 0);
+      start_timer {
+         for(size_t i = 0; i < 4*PAGE_CACHE_SIZE/PAGE_SIZE; i++) {
+            access_page(p, scan_start + i, one_shot);
+            nb_hits += access_page(p, xorshf96() % nb_hot, 0);
+            nb_gets++;
+         }
+      } stop_timer("Point requests during a scan (scan pages marked as one shot: %s): %lu%% hit ratio\n", one_shot?"yes":"no", nb_hits*100/nb_gets);
+   }
 }
 
 int main(int argc, char **argv) {
-   bench_pagecache();
+   bench_pagecache(&LRU_POLICY);
+   bench_pagecache(&CLOCK_POLICY);
+   bench_pagecache(&S3FIFO_POLICY);
    return 0;
 }
-
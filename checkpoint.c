@@ -0,0 +1,540 @@
+#include "headers.h"
+#include <libgen.h>
+#include <time.h>
+
+/*
+ * Checkpoints of the index.
+ *
+ * Every CHECKPOINT_INTERVAL seconds, a worker copies its index (fingerprint -> slab, idx, rdt, expiration time), the aliases of its keys and the bitmaps of free spots of its slabs
+ * (see freelist.c) in memory, and a helper thread writes the copy in a checkpoint file (PATH_CHECKPOINT) while the worker keeps processing requests. The copy is taken when
+ * the worker has no IO in flight, so all the locations of the index are on disk. The spots of the old versions that wait for the GC are saved as free spots, because
+ * snapshots do not survive restarts.
+ *
+ * After the copy, the worker logs the pages it writes (PATH_CHECKPOINT_LOG): the first time a page is written after the copy, its number is appended to the log.
+ * The log is written through the IO engine, one page at a time, and the IO engine holds the writes of a page until the page is in the log on disk (see
+ * checkpoint_page_logged). Checkpoint number n logs in log n % 2, so the log of checkpoint n - 1 is kept until checkpoint n is on disk.
+ *
+ * On restart, the index is loaded from the checkpoint, except the entries and free spots located in the pages of the two logs, and only these pages are scanned
+ * (items that exist twice are handled by the recovery callback, as in a full rebuild). A new checkpoint is then written, as after a full rebuild.
+ *
+ * Like a full rebuild, a checkpoint does not contain the old versions of items (snapshots), and the transaction log slab is always scanned.
+ */
+#define CHECKPOINT_MAGIC 0x34544E494F504B43LU // "CKPOINT4"
+
+struct checkpoint_header {
+   uint64_t magic;
+   uint64_t number;        // The pages written after the copy of the index are logged in log number % 2
+   uint64_t nb_slabs;
+   uint64_t rdt;           // Latest timestamp of the worker or of its items
+   uint64_t nb_entries;
+   uint64_t nb_aliases;
+   uint64_t nb_free;       // Number of free spots, in the bitmaps of the slabs
+};
+
+struct checkpoint_slab {
+   uint64_t item_size;
+   uint64_t last_item;
+   uint64_t nb_free_words; // Size of the bitmap of free spots, written after the aliases
+};
+
+struct checkpoint_entry {
+   uint64_t hash;
+   uint64_t location;      // [position of the slab + 1 (16 bits) | slab_idx (48 bits)]
+   uint64_t rdt;           // with the deleted flag of tombstones
+   uint64_t expires;       // see slab_set_expiry
+};
+
+struct checkpoint_alias {
+   uint64_t base_hash;
+   uint64_t hash;
+   uint64_t key_size;      // followed by the key
+};
+
+#define LOG_ENTRIES_PER_PAGE (PAGE_SIZE/sizeof(uint64_t))
+
+struct checkpoint {
+   int worker_id;
+   struct slab **slabs;
+   size_t nb_slabs;
+   char path[512], log_paths[2][512];
+   time_t last_checkpoint;
+   uint64_t number;        // Of the latest checkpoint, on disk or being written
+
+   /* Copy of the index, written by the helper thread */
+   char *image;
+   size_t image_size, image_capacity;
+   struct checkpoint_header header;
+   uint64_t **free_bitmaps; // Per slab, free spots and spots waiting for the GC
+   size_t *nb_free_words;
+   pthread_t writer;
+   int writing;
+   volatile int written;
+
+   /* Log of the pages written since the copy */
+   int log_fds[2];
+   struct slab log_file;   // log number % 2, written like a slab of PAGE_SIZE items
+   struct slab_callback io; // write in flight
+   struct lru log_lru;
+   char *io_page;          // copy of the page of the log being written, entries keep being appended to the page
+   int log_writing;
+   uint64_t **log;         // Pages written since the copy [position of the slab + 1 | page number], by pages of PAGE_SIZE
+   size_t nb_log_pages, max_log_pages;
+   size_t log_size, log_flushed, log_writing_upto; // in entries, the writes of the pages logged before log_flushed can be submitted
+
+   uint64_t **dirty;       // Per slab, bitmap of the pages written since the copy
+   size_t *dirty_capacity; // in pages
+};
+
+static uint64_t encode_location(size_t slab_pos, uint64_t idx) {
+   return ((slab_pos + 1) << PACKED_SLAB_IDX_BITS) | idx;
+}
+
+static size_t decode_slab(struct checkpoint *c, uint64_t location) {
+   size_t slab_pos = (location >> PACKED_SLAB_IDX_BITS) - 1;
+   if(slab_pos >= c->nb_slabs)
+      die("Corrupted checkpoint %s, delete it and the logs (%s) to rebuild the index from the slabs\n", c->path, c->log_paths[0]);
+   return slab_pos;
+}
+
+static uint64_t decode_idx(uint64_t location) {
+   return location & PACKED_SLAB_IDX_MASK;
+}
+
+/*
+ * Pages written since the copy
+ */
+static int is_dirty(struct checkpoint *c, size_t slab_pos, uint64_t page_num) {
+   return page_num < c->dirty_capacity[slab_pos] && (c->dirty[slab_pos][page_num/64] & (1LU << (page_num%64)));
+}
+
+/* Returns 1 if the page was not dirty yet */
+static int set_dirty(struct checkpoint *c, size_t slab_pos, uint64_t page_num) {
+   if(page_num >= c->dirty_capacity[slab_pos]) {
+      size_t old_capacity = c->dirty_capacity[slab_pos], new_capacity = old_capacity?old_capacity:4096;
+      while(new_capacity <= page_num)
+         new_capacity *= 2;
+      c->dirty[slab_pos] = realloc(c->dirty[slab_pos], new_capacity/8);
+      memset((char*)c->dirty[slab_pos] + old_capacity/8, 0, (new_capacity - old_capacity)/8);
+      c->dirty_capacity[slab_pos] = new_capacity;
+   }
+   if(is_dirty(c, slab_pos, page_num))
+      return 0;
+   c->dirty[slab_pos][page_num/64] |= 1LU << (page_num%64);
+   return 1;
+}
+
+static void log_append(struct checkpoint *c, uint64_t entry) {
+   size_t page = c->log_size / LOG_ENTRIES_PER_PAGE;
+   if(page == c->nb_log_pages) {
+      if(c->nb_log_pages == c->max_log_pages) {
+         c->max_log_pages = c->max_log_pages?2*c->max_log_pages:16;
+         c->log = realloc(c->log, c->max_log_pages*sizeof(*c->log));
+      }
+      c->log[c->nb_log_pages++] = calloc(LOG_ENTRIES_PER_PAGE, sizeof(**c->log));
+   }
+   c->log[page][c->log_size % LOG_ENTRIES_PER_PAGE] = entry;
+   c->log_size++;
+}
+
+void checkpoint_page_dirtied(struct slab *s, uint64_t page_num) {
+   struct checkpoint *c = s->checkpoint;
+   if(set_dirty(c, s->checkpoint_idx, page_num))
+      log_append(c, encode_location(s->checkpoint_idx, page_num));
+}
+
+/* Only the last entries of the log are not on disk, usually the pages dirtied by the latest batch of requests */
+int checkpoint_page_logged(struct slab *s, uint64_t page_num) {
+   struct checkpoint *c = s->checkpoint;
+   uint64_t entry = encode_location(s->checkpoint_idx, page_num);
+   for(size_t i = c->log_flushed; i < c->log_size; i++)
+      if(c->log[i / LOG_ENTRIES_PER_PAGE][i % LOG_ENTRIES_PER_PAGE] == entry)
+         return 0;
+   return 1;
+}
+
+static void write_log_page(struct checkpoint *c);
+
+/* The page of the log is on disk, and synced */
+static void log_page_written_cb(struct slab_callback *cb) {
+   struct checkpoint *c = cb->payload;
+   c->log_writing = 0;
+   c->log_flushed = c->log_writing_upto;
+   write_log_page(c);
+}
+
+static void log_page_submitted_cb(struct slab_callback *cb) {
+   cb->io_cb = log_page_written_cb;
+   sync_page_async(cb);
+}
+
+/* Write the first page of the log that contains entries that are not on disk, the last page of the log is rewritten when it grows */
+static void write_log_page(struct checkpoint *c) {
+   if(c->log_writing || c->log_flushed == c->log_size)
+      return;
+   size_t page = c->log_flushed / LOG_ENTRIES_PER_PAGE;
+   c->log_writing = 1;
+   c->log_writing_upto = (page + 1)*LOG_ENTRIES_PER_PAGE;
+   if(c->log_writing_upto > c->log_size)
+      c->log_writing_upto = c->log_size;
+   memcpy(c->io_page, c->log[page], PAGE_SIZE);
+   c->io.slab_idx = page;
+   c->log_lru.hash = get_hash_for_page(c->log_file.fd, page);
+   c->io.lru_entry = &c->log_lru;
+   c->io.io_cb = log_page_submitted_cb;
+   write_page_async(&c->io);
+}
+
+void checkpoint_flush_log(struct checkpoint *c) {
+   if(!c)
+      return;
+   write_log_page(c); // if a page is being written, the new entries wait for it to complete
+}
+
+/* Start logging in log number % 2, the log of checkpoint number - 2 is not needed anymore */
+static void reset_log(struct checkpoint *c) {
+   c->log_file.fd = c->log_fds[c->number % 2];
+   if(ftruncate(c->log_file.fd, 0))
+      perr("Cannot truncate the checkpoint log %s\n", c->log_paths[c->number % 2]);
+   for(size_t i = 0; i < c->nb_log_pages; i++)
+      memset(c->log[i], 0, PAGE_SIZE);
+   c->log_size = 0;
+   c->log_flushed = 0;
+   for(size_t i = 0; i < c->nb_slabs; i++)
+      if(c->dirty[i])
+         memset(c->dirty[i], 0, c->dirty_capacity[i]/8);
+}
+
+/* After a restart, the pages written since the checkpoint are in its log, and in the log of the next checkpoint if it was not complete */
+static void read_log(struct checkpoint *c, int log) {
+   struct stat sb;
+   fstat(c->log_fds[log], &sb);
+   size_t size = sb.st_size - sb.st_size % PAGE_SIZE;
+   if(!size)
+      return;
+   uint64_t *entries = aligned_alloc(PAGE_SIZE, size);
+   if(pread(c->log_fds[log], entries, size, 0) != size)
+      perr("Cannot read the checkpoint log %s\n", c->log_paths[log]);
+   for(size_t i = 0; i < size/sizeof(*entries) && entries[i]; i++)
+      set_dirty(c, decode_slab(c, entries[i]), decode_idx(entries[i]));
+   free(entries);
+}
+
+
+/*
+ * Write a checkpoint
+ */
+static void image_append(struct checkpoint *c, void *data, size_t size) {
+   if(c->image_size + size > c->image_capacity) {
+      c->image_capacity = c->image_capacity?2*c->image_capacity:(1LU<<20);
+      while(c->image_size + size > c->image_capacity)
+         c->image_capacity *= 2;
+      c->image = realloc(c->image, c->image_capacity);
+   }
+   memcpy(c->image + c->image_size, data, size);
+   c->image_size += size;
+}
+
+static void copy_entry(uint64_t hash, index_entry_t *e, void *data) {
+   struct checkpoint *c = data;
+   if(!e->slab || !e->slab->checkpoint) // spot reserved by a transaction, or item of the transaction log
+      return;
+   struct checkpoint_entry entry = { .hash = hash, .location = encode_location(e->slab->checkpoint_idx, e->slab_idx), .rdt = get_rdt_value(e) | get_deleted_bit(e) | get_key_is_fingerprint_bit(e), .expires = slab_get_expiry(e->slab, e->slab_idx) };
+   image_append(c, &entry, sizeof(entry));
+   c->header.nb_entries++;
+   if(get_rdt_value(&entry) > c->header.rdt) // items written by transactions can be more recent than the timestamp of the worker
+      c->header.rdt = get_rdt_value(&entry);
+}
+
+static void copy_alias(uint64_t base_hash, uint64_t hash, char *key, size_t key_size, void *data) {
+   struct checkpoint *c = data;
+   struct checkpoint_alias alias = { .base_hash = base_hash, .hash = hash, .key_size = key_size };
+   image_append(c, &alias, sizeof(alias));
+   image_append(c, key, key_size);
+   c->header.nb_aliases++;
+}
+
+/* Spot of an old version that waits for the GC, free after a restart */
+static void copy_pending_spot(struct slab *s, size_t idx, void *data) {
+   struct checkpoint *c = data;
+   if(!s->checkpoint)
+      return;
+   size_t i = s->checkpoint_idx, word = idx/64;
+   if(word >= c->nb_free_words[i]) {
+      size_t nb_words = c->nb_free_words[i]?c->nb_free_words[i]:64;
+      while(nb_words <= word)
+         nb_words *= 2;
+      c->free_bitmaps[i] = realloc(c->free_bitmaps[i], nb_words*sizeof(**c->free_bitmaps));
+      memset(&c->free_bitmaps[i][c->nb_free_words[i]], 0, (nb_words - c->nb_free_words[i])*sizeof(**c->free_bitmaps));
+      c->nb_free_words[i] = nb_words;
+   }
+   if(!(c->free_bitmaps[i][word] & (1LU << (idx%64)))) {
+      c->free_bitmaps[i][word] |= 1LU << (idx%64);
+      c->header.nb_free++;
+   }
+}
+
+static void copy_old_version(uint64_t hash, index_entry_t *e, void *data) {
+   copy_pending_spot(e->slab, e->slab_idx, data);
+}
+
+/* Must be called when the worker has no IO in flight */
+static void copy_index(struct checkpoint *c) {
+   declare_timer;
+   start_timer {
+      c->header = (struct checkpoint_header) {
+         .magic = CHECKPOINT_MAGIC,
+         .number = c->number + 1,
+         .nb_slabs = c->nb_slabs,
+         .rdt = get_rdt(c->slabs[0]->ctx),
+      };
+      for(size_t i = 0; i < c->nb_slabs; i++) {
+         size_t nb_words;
+         uint64_t *bitmap = freelist_bitmap(c->slabs[i], &nb_words);
+         c->free_bitmaps[i] = realloc(c->free_bitmaps[i], nb_words*sizeof(*bitmap));
+         memcpy(c->free_bitmaps[i], bitmap, nb_words*sizeof(*bitmap));
+         c->nb_free_words[i] = nb_words;
+         c->header.nb_free += c->slabs[i]->nb_partially_freed_items;
+      }
+      gc_forall_pending_locations(get_gc(c->worker_id), copy_pending_spot, c);
+      memory_index_forall_old_versions(c->worker_id, copy_old_version, c);
+
+      c->image_size = 0;
+      image_append(c, &c->header, sizeof(c->header)); // rewritten at the end, once the number of entries is known
+      for(size_t i = 0; i < c->nb_slabs; i++) {
+         struct checkpoint_slab slab = { .item_size = c->slabs[i]->item_size, .last_item = c->slabs[i]->last_item, .nb_free_words = c->nb_free_words[i] };
+         image_append(c, &slab, sizeof(slab));
+      }
+      memory_index_forall(c->worker_id, copy_entry, c);
+      memory_index_forall_aliases(c->worker_id, copy_alias, c);
+      for(size_t i = 0; i < c->nb_slabs; i++)
+         image_append(c, c->free_bitmaps[i], c->nb_free_words[i]*sizeof(**c->free_bitmaps));
+      memcpy(c->image, &c->header, sizeof(c->header));
+
+      c->number++;
+      reset_log(c); // the pages written from now on are not in the copy
+      c->last_checkpoint = time(NULL);
+   } stop_timer("[SLAB WORKER %d] Copy of the index for checkpoint %lu", c->worker_id, c->number);
+}
+
+static void sync_directory(const char *path) {
+   char dir[512];
+   strcpy(dir, path);
+   int fd = open(dirname(dir), O_RDONLY);
+   if(fd == -1 || fsync(fd))
+      perr("Cannot sync the directory of %s\n", path);
+   close(fd);
+}
+
+/* Helper thread, the worker does not modify the copy until written is set */
+static void *write_image(void *data) {
+   struct checkpoint *c = data;
+   char tmp_path[520];
+   declare_timer;
+
+   start_timer {
+      sprintf(tmp_path, "%s.tmp", c->path);
+      int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+      if(fd == -1)
+         perr("Cannot create checkpoint %s\n", tmp_path);
+      for(size_t done = 0; done < c->image_size;) {
+         ssize_t ret = write(fd, c->image + done, c->image_size - done);
+         if(ret <= 0)
+            perr("Cannot write checkpoint %s\n", tmp_path);
+         done += ret;
+      }
+      if(fsync(fd))
+         perr("Cannot write checkpoint %s\n", tmp_path);
+      close(fd);
+      if(rename(tmp_path, c->path))
+         perr("Cannot rename checkpoint %s\n", tmp_path);
+      sync_directory(c->path);
+
+      // The checkpoint is on disk, the pages written before its copy do not need to be replayed anymore
+      if(ftruncate(c->log_fds[(c->header.number + 1) % 2], 0))
+         perr("Cannot truncate the checkpoint log %s\n", c->log_paths[(c->header.number + 1) % 2]);
+   } stop_timer("[SLAB WORKER %d] Checkpoint %lu of %lu items, %lu aliases, %lu free spots", c->worker_id, c->header.number, c->header.nb_entries, c->header.nb_aliases, c->header.nb_free);
+
+   __atomic_store_n(&c->written, 1, __ATOMIC_RELEASE);
+   return NULL;
+}
+
+void checkpoint_write(struct checkpoint *c) {
+   copy_index(c);
+   write_image(c);
+   c->written = 0;
+}
+
+void checkpoint_step(struct checkpoint *c) {
+   if(!c)
+      return;
+   if(c->writing) {
+      if(!__atomic_load_n(&c->written, __ATOMIC_ACQUIRE))
+         return;
+      pthread_join(c->writer, NULL);
+      c->writing = 0;
+      c->written = 0;
+   }
+   if(time(NULL) - c->last_checkpoint < CHECKPOINT_INTERVAL || c->log_writing)
+      return;
+   copy_index(c);
+   c->writing = 1;
+   if(pthread_create(&c->writer, NULL, write_image, c))
+      die("Cannot create the thread writing checkpoint %s\n", c->path);
+}
+
+
+/*
+ * Load a checkpoint and replay the pages written after it
+ */
+static void read_or_die(struct checkpoint *c, void *data, size_t size, FILE *f) {
+   if(size && fread(data, size, 1, f) != 1)
+      die("Truncated checkpoint %s, delete it and the logs (%s) to rebuild the index from the slabs\n", c->path, c->log_paths[0]);
+}
+
+int checkpoint_recover(struct checkpoint *c, struct slab_callback *callback) {
+   declare_timer;
+   struct checkpoint_header header;
+   struct checkpoint_slab *slabs = calloc(c->nb_slabs, sizeof(*slabs));
+   size_t nb_replayed_pages = 0;
+
+   FILE *f = fopen(c->path, "r");
+   if(!f)
+      return 0;
+   if(fread(&header, sizeof(header), 1, f) != 1 || header.magic != CHECKPOINT_MAGIC || header.nb_slabs != c->nb_slabs
+         || fread(slabs, sizeof(*slabs), c->nb_slabs, f) != c->nb_slabs) {
+      printf("#WARNING: invalid checkpoint %s, rebuilding the index from the slabs\n", c->path);
+      goto invalid;
+   }
+   for(size_t i = 0; i < c->nb_slabs; i++) {
+      if(slabs[i].item_size != c->slabs[i]->item_size) {
+         printf("#WARNING: checkpoint %s was written with other slab sizes, rebuilding the index from the slabs\n", c->path);
+         goto invalid;
+      }
+   }
+
+   start_timer {
+      c->number = header.number;
+      read_log(c, header.number % 2);
+      read_log(c, (header.number + 1) % 2);
+
+      for(size_t i = 0; i < header.nb_entries; i++) {
+         struct checkpoint_entry entry;
+         read_or_die(c, &entry, sizeof(entry), f);
+         size_t slab_pos = decode_slab(c, entry.location);
+         struct slab *s = c->slabs[slab_pos];
+         index_entry_t e = { .slab = s, .slab_idx = decode_idx(entry.location), .rdt = entry.rdt };
+         if(is_dirty(c, slab_pos, item_page_num(s, e.slab_idx))) // replayed below
+            continue;
+         memory_index_restore(c->worker_id, entry.hash, &e);
+         slab_set_expiry(s, e.slab_idx, entry.expires);
+         s->nb_items++;
+      }
+
+      for(size_t i = 0; i < header.nb_aliases; i++) {
+         struct checkpoint_alias alias;
+         read_or_die(c, &alias, sizeof(alias), f);
+         char *key = malloc(alias.key_size);
+         read_or_die(c, key, alias.key_size, f);
+         memory_index_restore_alias(c->worker_id, alias.base_hash, alias.hash, key, alias.key_size);
+         free(key);
+      }
+
+      for(size_t i = 0; i < c->nb_slabs; i++) {
+         struct slab *s = c->slabs[i];
+         uint64_t *bitmap = malloc(slabs[i].nb_free_words*sizeof(*bitmap));
+         read_or_die(c, bitmap, slabs[i].nb_free_words*sizeof(*bitmap), f);
+         for(size_t w = 0; w < slabs[i].nb_free_words; w++) {
+            for(uint64_t bits = bitmap[w]; bits; bits &= bits - 1) {
+               size_t idx = w*64 + __builtin_ctzl(bits);
+               if(!is_dirty(c, i, item_page_num(s, idx))) // snapshots do not survive restarts, there is no old version to clean when the spot is reused
+                  add_item_in_partially_freed_list(s, idx, 0);
+            }
+         }
+         free(bitmap);
+      }
+
+      for(size_t i = 0; i < c->nb_slabs; i++)
+         c->slabs[i]->last_item = slabs[i].last_item;
+      if(header.rdt > get_rdt(c->slabs[0]->ctx))
+         set_rdt(c->slabs[0]->ctx, header.rdt);
+
+      /* Scan the pages written after the checkpoint */
+      uint64_t **pages = calloc(c->nb_slabs, sizeof(*pages));
+      size_t *nb_pages = calloc(c->nb_slabs, sizeof(*nb_pages));
+      for(size_t i = 0; i < c->nb_slabs; i++) {
+         pages[i] = malloc(c->dirty_capacity[i]*sizeof(**pages));
+         for(size_t p = 0; p < c->dirty_capacity[i]; p++)
+            if(is_dirty(c, i, p))
+               pages[i][nb_pages[i]++] = p;
+         nb_replayed_pages += nb_pages[i];
+      }
+      rebuild_slab_pages(c->worker_id, c->slabs, c->nb_slabs, pages, nb_pages, callback);
+      for(size_t i = 0; i < c->nb_slabs; i++)
+         free(pages[i]);
+      free(pages);
+      free(nb_pages);
+   } stop_timer("[SLAB WORKER %d] Loaded checkpoint of %lu items, replayed %lu pages written after the checkpoint", c->worker_id, header.nb_entries, nb_replayed_pages);
+
+   fclose(f);
+   free(slabs);
+   return 1;
+
+invalid:
+   fclose(f);
+   free(slabs);
+   return 0;
+}
+
+
+/*
+ * Init
+ */
+struct checkpoint *checkpoint_init(int worker_id, struct slab **slabs, size_t nb_slabs) {
+   char path[512], log_paths[2][512];
+   size_t disk = worker_id / (get_nb_workers()/get_nb_disks());
+   sprintf(path, PATH_CHECKPOINT, disk, worker_id);
+   for(int i = 0; i < 2; i++)
+      sprintf(log_paths[i], PATH_CHECKPOINT_LOG, disk, worker_id, i);
+   if(!CHECKPOINT_INTERVAL) { // pages are going to be written without being logged, existing checkpoints become useless
+      unlink(path);
+      unlink(log_paths[0]);
+      unlink(log_paths[1]);
+      return NULL;
+   }
+
+   struct checkpoint *c = calloc(1, sizeof(*c));
+   c->worker_id = worker_id;
+   c->slabs = slabs;
+   c->nb_slabs = nb_slabs;
+   strcpy(c->path, path);
+   c->last_checkpoint = time(NULL);
+   c->free_bitmaps = calloc(nb_slabs, sizeof(*c->free_bitmaps));
+   c->nb_free_words = calloc(nb_slabs, sizeof(*c->nb_free_words));
+
+   struct slab_context *ctx = slabs[0]->ctx;
+   for(int i = 0; i < 2; i++) {
+      strcpy(c->log_paths[i], log_paths[i]);
+      c->log_fds[i] = open(log_paths[i], O_RDWR | O_CREAT | O_DIRECT, 0777);
+      if(c->log_fds[i] == -1)
+         perr("Cannot open checkpoint log %s\n", log_paths[i]);
+      ioengine_register_file(get_io_context(ctx), c->log_fds[i]);
+   }
+   c->log_file.ctx = ctx;
+   c->log_file.fd = c->log_fds[0];
+   c->log_file.item_size = PAGE_SIZE;
+   c->log_file.page_size = PAGE_SIZE;
+   c->io.slab = &c->log_file;
+   c->io.payload = c;
+   c->io_page = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+   c->log_lru.page = c->io_page;
+   c->log_lru.contains_data = 1;
+   c->log_lru.buf_index = -1;
+
+   c->dirty = calloc(nb_slabs, sizeof(*c->dirty));
+   c->dirty_capacity = calloc(nb_slabs, sizeof(*c->dirty_capacity));
+   for(size_t i = 0; i < nb_slabs; i++) {
+      slabs[i]->checkpoint = c;
+      slabs[i]->checkpoint_idx = i;
+   }
+   return c;
+}
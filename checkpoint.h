@@ -0,0 +1,16 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H 1
+
+struct checkpoint;
+
+struct checkpoint *checkpoint_init(int worker_id, struct slab **slabs, size_t nb_slabs); // NULL if checkpoints are disabled
+int checkpoint_recover(struct checkpoint *c, struct slab_callback *callback);             // 1 if the index has been loaded from a checkpoint
+void checkpoint_write(struct checkpoint *c);                                              // waits for the checkpoint to be on disk (init), must be called when the worker has no IO in flight
+void checkpoint_step(struct checkpoint *c);                                               // starts a checkpoint if it is due, idem
+
+/* Log of the pages written since the last checkpoint */
+void checkpoint_page_dirtied(struct slab *s, uint64_t page_num);
+int checkpoint_page_logged(struct slab *s, uint64_t page_num);                           // the writes of a page cannot be submitted before
+void checkpoint_flush_log(struct checkpoint *c);                                          // called before submitting the IOs
+
+#endif
@@ -0,0 +1,369 @@
+#include "headers.h"
+
+/*
+ * Commit log: markers of transaction commits, packed in shared pages.
+ *
+ * A transaction writes a START_TRANSACTION_COMMIT marker before writing its items, and an END_TRANSACTION_COMMIT marker once they are all on
+ * disk. Without the log, each START marker is an item of the transactions slab (a random page write per commit). With COMMIT_LOG, a worker
+ * appends the markers it receives to a page, and writes the page at the end of the batch of requests (group commit): the callbacks of all
+ * the markers of the page are called after a single write. Every write uses a new page, pages are never rewritten.
+ * Pages are written through the IO engine of the worker, like the pages of a slab, and only one page is written at a time, so pages reach
+ * the disk in order. The markers received while a page is being written go to the next page, which is written once the previous one is
+ * on disk (and synced, see DURABILITY_MODE).
+ *
+ * The log is a circular file of COMMIT_LOG_PAGES pages, page number lsn is written at lsn % COMMIT_LOG_PAGES. Before a page overwrites the
+ * START marker of a transaction that has not ended, the marker is copied in the new page. Each page records the oldest page that still
+ * contains the START marker of a running transaction (start_lsn). On restart, the pages from the start_lsn of the last page to the last page
+ * are replayed: transactions that started but did not end are passed to the recovery callback (see worker_slab_init_trans_cb), so that their
+ * items are ignored. Recovery erases these items from the slabs, and once all the workers are done, an END marker retires the transaction
+ * (see commit_log_retire_recovered), so the log does not carry it forever.
+ */
+#define COMMIT_LOG_MAGIC 0x474F4C54494D4D43LU // "CMMITLOG"
+
+struct commit_log_header {
+   uint64_t magic;
+   uint64_t lsn;           // Number of the page, written at lsn % COMMIT_LOG_PAGES
+   uint64_t start_lsn;     // Oldest page containing the START marker of a transaction that had not ended
+   uint64_t nb_markers;
+};
+
+enum commit_marker_type { MARKER_START = 1, MARKER_END = 2 };
+
+struct commit_marker {
+   uint64_t transaction_id; // rdt of the items of the transaction (see get_transaction_id_on_disk)
+   uint64_t type;
+};
+
+#define MARKERS_PER_PAGE ((PAGE_SIZE - sizeof(struct commit_log_header)) / sizeof(struct commit_marker))
+
+struct open_transaction {
+   uint64_t transaction_id;
+   uint64_t lsn;           // Page of its latest START marker
+};
+
+struct log_page {
+   char *data;
+   struct lru lru;                   // the IO engine writes the page like a page of the page cache (see write_page_async)
+   struct slab_callback **waiting;   // called once the page is on disk
+   size_t nb_waiting, max_waiting;
+};
+
+struct commit_log {
+   int worker_id;
+   char path[512];
+   struct slab file;                 // the log, written like a slab of PAGE_SIZE items
+   struct slab_callback io;          // write in flight
+   int writing;
+
+   /* pages[0] is the next page to write, pages[nb_pages - 1] is being filled, the pages after it are free */
+   struct log_page **pages;
+   size_t nb_pages, max_pages;
+   struct commit_log_header *header; // of the page being filled
+   struct commit_marker *markers;
+
+   /* Transactions that started but did not end, few per worker */
+   struct open_transaction *open;
+   size_t nb_open, max_open;
+   uint64_t *recovered;              // ... before the restart, retired once their items have been erased
+   size_t nb_recovered;
+
+   /* Stats */
+   size_t nb_markers, nb_writes;
+};
+
+static struct log_page *current_page(struct commit_log *l) {
+   return l->pages[l->nb_pages - 1];
+}
+
+static void add_marker(struct commit_log *l, uint64_t transaction_id, uint64_t type) {
+   struct commit_marker *m = &l->markers[l->header->nb_markers++];
+   m->transaction_id = transaction_id;
+   m->type = type;
+}
+
+static void add_open_transaction(struct commit_log *l, uint64_t transaction_id, uint64_t lsn) {
+   if(l->nb_open == (COMMIT_LOG_PAGES - 1)*MARKERS_PER_PAGE) // the copies of the START markers would overwrite each other
+      die("Too many transactions are committing at the same time for the commit log %s, increase COMMIT_LOG_PAGES\n", l->path);
+   if(l->nb_open == l->max_open) {
+      l->max_open = l->max_open?2*l->max_open:64;
+      l->open = realloc(l->open, l->max_open*sizeof(*l->open));
+   }
+   l->open[l->nb_open].transaction_id = transaction_id;
+   l->open[l->nb_open].lsn = lsn;
+   l->nb_open++;
+}
+
+static void remove_open_transaction(struct commit_log *l, uint64_t transaction_id) {
+   for(size_t i = 0; i < l->nb_open; i++) {
+      if(l->open[i].transaction_id == transaction_id) {
+         l->open[i] = l->open[--l->nb_open];
+         return;
+      }
+   }
+   die("Transaction %lu ends its commit but did not start it in the commit log %s\n", transaction_id, l->path);
+}
+
+static void seal_page(struct commit_log *l);
+
+static void start_page(struct commit_log *l, uint64_t lsn) {
+   if(l->nb_pages == l->max_pages) {
+      l->max_pages = l->max_pages?2*l->max_pages:4;
+      l->pages = realloc(l->pages, l->max_pages*sizeof(*l->pages));
+      for(size_t i = l->nb_pages; i < l->max_pages; i++) {
+         struct log_page *p = calloc(1, sizeof(*p));
+         p->data = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+         p->lru.page = p->data;
+         p->lru.contains_data = 1;
+         p->lru.buf_index = -1;
+         l->pages[i] = p;
+      }
+   }
+   struct log_page *p = l->pages[l->nb_pages++];
+   memset(p->data, 0, PAGE_SIZE);
+   l->header = (void*)p->data;
+   l->markers = (void*)(l->header + 1);
+   l->header->magic = COMMIT_LOG_MAGIC;
+   l->header->lsn = lsn;
+
+   // The page overwrites page lsn - COMMIT_LOG_PAGES, copy the START markers of the transactions that are still running
+   for(size_t i = 0; i < l->nb_open && lsn >= COMMIT_LOG_PAGES; i++) {
+      if(l->open[i].lsn <= lsn - COMMIT_LOG_PAGES) {
+         if(l->header->nb_markers == MARKERS_PER_PAGE) { // the copies do not fit in a page
+            seal_page(l); // starts page lsn + 1, which copies the remaining markers
+            return;
+         }
+         add_marker(l, l->open[i].transaction_id, MARKER_START);
+         l->open[i].lsn = lsn;
+      }
+   }
+}
+
+static void write_next_page(struct commit_log *l);
+
+/* The page is on disk, and synced */
+static void page_written_cb(struct slab_callback *cb) {
+   static __thread declare_periodic_count;
+   struct commit_log *l = cb->payload;
+   struct log_page *p = l->pages[0];
+
+   l->writing = 0;
+   l->nb_writes++;
+   memmove(&l->pages[0], &l->pages[1], (l->nb_pages - 1)*sizeof(*l->pages));
+   l->pages[--l->nb_pages] = p; // reused by start_page
+   for(size_t i = 0; i < p->nb_waiting; i++)
+      call_callback(p->waiting[i], NULL);
+   p->nb_waiting = 0;
+
+   write_next_page(l);
+   periodic_count(1000, "[SLAB WORKER %d] Commit log - %lu markers in %lu writes", l->worker_id, l->nb_markers, l->nb_writes);
+}
+
+static void page_submitted_cb(struct slab_callback *cb) {
+   cb->io_cb = page_written_cb;
+   sync_page_async(cb);
+}
+
+/* Write the oldest page that is full or waited for, one page at a time */
+static void write_next_page(struct commit_log *l) {
+   if(l->writing)
+      return;
+   if(l->nb_pages == 1 && current_page(l)->nb_waiting) // nothing else is waiting for the disk, do not wait for the next batch
+      seal_page(l);
+   if(l->nb_pages == 1)
+      return;
+
+   struct log_page *p = l->pages[0];
+   struct commit_log_header *h = (void*)p->data;
+   l->writing = 1;
+   l->io.slab_idx = h->lsn % COMMIT_LOG_PAGES;
+   p->lru.hash = get_hash_for_page(l->file.fd, l->io.slab_idx);
+   l->io.lru_entry = &p->lru;
+   l->io.io_cb = page_submitted_cb;
+   write_page_async(&l->io);
+}
+
+/* The page being filled will not receive markers anymore */
+static void seal_page(struct commit_log *l) {
+   uint64_t lsn = l->header->lsn;
+   l->header->start_lsn = lsn;
+   for(size_t i = 0; i < l->nb_open; i++)
+      if(l->open[i].lsn < l->header->start_lsn)
+         l->header->start_lsn = l->open[i].lsn;
+   start_page(l, lsn + 1);
+}
+
+void commit_log_append(struct commit_log *l, struct slab_callback *callback) {
+   uint64_t transaction_id = get_transaction_id_on_disk(callback->transaction);
+   while(l->header->nb_markers == MARKERS_PER_PAGE) // the batch does not fit in a page
+      seal_page(l);
+
+   if(callback->action == START_TRANSACTION_COMMIT) {
+      add_marker(l, transaction_id, MARKER_START);
+      add_open_transaction(l, transaction_id, l->header->lsn);
+   } else {
+      add_marker(l, transaction_id, MARKER_END);
+      remove_open_transaction(l, transaction_id);
+   }
+   l->nb_markers++;
+
+   struct log_page *p = current_page(l);
+   if(p->nb_waiting == p->max_waiting) {
+      p->max_waiting = p->max_waiting?2*p->max_waiting:MAX_NB_PENDING_CALLBACKS_PER_WORKER;
+      p->waiting = realloc(p->waiting, p->max_waiting*sizeof(*p->waiting));
+   }
+   p->waiting[p->nb_waiting++] = callback;
+}
+
+void commit_log_flush(struct commit_log *l) {
+   if(!l)
+      return;
+   write_next_page(l); // if a page is being written, the markers of the batch wait for it to complete
+}
+
+/*
+ * Recovery
+ */
+static int cmp_transaction_ids(const void *a, const void *b) {
+   uint64_t x = *(uint64_t*)a, y = *(uint64_t*)b;
+   return (x > y) - (x < y);
+}
+
+static int find_transaction_id(uint64_t *ids, size_t nb, uint64_t transaction_id) {
+   return bsearch(&transaction_id, ids, nb, sizeof(*ids), cmp_transaction_ids) != NULL;
+}
+
+/* Returns the lsn of the next page to write */
+static uint64_t commit_log_recover(struct commit_log *l, struct slab_callback *callback) {
+   struct commit_log_header *last = NULL;
+   char *log = aligned_alloc(PAGE_SIZE, COMMIT_LOG_PAGES*PAGE_SIZE);
+   if(pread(l->file.fd, log, COMMIT_LOG_PAGES*PAGE_SIZE, 0) != COMMIT_LOG_PAGES*PAGE_SIZE)
+      perr("Cannot read the commit log %s\n", l->path);
+
+   for(size_t i = 0; i < COMMIT_LOG_PAGES; i++) {
+      struct commit_log_header *h = (void*)&log[i*PAGE_SIZE];
+      if(h->magic == COMMIT_LOG_MAGIC && h->lsn % COMMIT_LOG_PAGES == i && (!last || h->lsn > last->lsn))
+         last = h;
+   }
+   if(!last) {
+      free(log);
+      return 0;
+   }
+   if(last->start_lsn > last->lsn || last->lsn - last->start_lsn >= COMMIT_LOG_PAGES)
+      die("Corrupted commit log %s\n", l->path);
+
+   // Replay the pages that can contain the START marker of a running transaction
+   uint64_t *started = NULL, *ended = NULL, max_transaction_id = 0;
+   size_t nb_started = 0, nb_ended = 0;
+   for(uint64_t lsn = last->start_lsn; lsn <= last->lsn; lsn++) {
+      struct commit_log_header *h = (void*)&log[(lsn % COMMIT_LOG_PAGES)*PAGE_SIZE];
+      struct commit_marker *markers = (void*)(h + 1);
+      if(h->magic != COMMIT_LOG_MAGIC || h->lsn != lsn || h->nb_markers > MARKERS_PER_PAGE)
+         die("Corrupted commit log %s, page %lu is missing\n", l->path, lsn);
+      started = realloc(started, (nb_started + h->nb_markers)*sizeof(*started));
+      ended = realloc(ended, (nb_ended + h->nb_markers)*sizeof(*ended));
+      for(size_t i = 0; i < h->nb_markers; i++) {
+         if(markers[i].type == MARKER_START)
+            started[nb_started++] = markers[i].transaction_id;
+         else
+            ended[nb_ended++] = markers[i].transaction_id;
+         if(markers[i].transaction_id > max_transaction_id)
+            max_transaction_id = markers[i].transaction_id;
+      }
+   }
+
+   qsort(started, nb_started, sizeof(*started), cmp_transaction_ids);
+   qsort(ended, nb_ended, sizeof(*ended), cmp_transaction_ids);
+   for(size_t i = 0; i < nb_started; i++) {
+      if((i && started[i] == started[i-1]) || find_transaction_id(ended, nb_ended, started[i]))
+         continue; // START copied in a newer page, or committed
+      struct item_metadata meta = { .rdt = started[i] };
+      callback->cb(callback, &meta);
+      add_open_transaction(l, started[i], last->start_lsn); // keep the marker until the transaction is retired
+      l->recovered = realloc(l->recovered, (l->nb_recovered + 1)*sizeof(*l->recovered));
+      l->recovered[l->nb_recovered++] = started[i];
+   }
+   timestamp_recovered(max_transaction_id); // the ID of a transaction that did not end must not be reused
+
+   uint64_t next_lsn = last->lsn + 1;
+   free(started);
+   free(ended);
+   free(log);
+   return next_lsn;
+}
+
+static void commit_log_free(struct commit_log *l) {
+   close(l->file.fd);
+   if(!COMMIT_LOG)
+      unlink(l->path);
+   for(size_t i = 0; i < l->max_pages; i++) {
+      free(l->pages[i]->data);
+      free(l->pages[i]->waiting);
+      free(l->pages[i]);
+   }
+   free(l->pages);
+   free(l->open);
+   free(l->recovered);
+   free(l);
+}
+
+struct commit_log *commit_log_init(struct slab_context *ctx, int worker_id, struct slab_callback *recovery_callback) {
+   char path[512];
+   struct stat sb;
+   size_t disk = worker_id / (get_nb_workers()/get_nb_disks());
+   sprintf(path, PATH_COMMIT_LOG, disk, worker_id);
+
+   int fd = open(path, O_RDWR | O_CREAT | O_DIRECT, 0777);
+   if(fd == -1)
+      perr("Cannot open commit log %s\n", path);
+   fstat(fd, &sb);
+   if(!COMMIT_LOG && !sb.st_size) {
+      close(fd);
+      unlink(path);
+      return NULL;
+   }
+   if(sb.st_size < COMMIT_LOG_PAGES*PAGE_SIZE && fallocate(fd, 0, 0, COMMIT_LOG_PAGES*PAGE_SIZE))
+      perr("Cannot allocate commit log %s\n", path);
+
+   struct commit_log *l = calloc(1, sizeof(*l));
+   l->worker_id = worker_id;
+   strcpy(l->path, path);
+   l->file.ctx = ctx;
+   l->file.fd = fd;
+   l->file.item_size = PAGE_SIZE;
+   l->file.page_size = PAGE_SIZE;
+   l->file.size_on_disk = COMMIT_LOG_PAGES*PAGE_SIZE;
+   l->io.slab = &l->file;
+   l->io.payload = l;
+
+   uint64_t lsn = commit_log_recover(l, recovery_callback);
+   start_page(l, lsn);
+   if(!COMMIT_LOG && !l->nb_recovered) { // markers go to the transactions slab
+      commit_log_free(l);
+      return NULL;
+   }
+   ioengine_register_file(get_io_context(ctx), fd);
+   return l;
+}
+
+struct commit_log *commit_log_retire_recovered(struct commit_log *l) {
+   if(!l)
+      return NULL;
+   if(!COMMIT_LOG) { // the log was only kept for the transactions that did not end
+      commit_log_free(l);
+      return NULL;
+   }
+   for(size_t i = 0; i < l->nb_recovered; i++) {
+      while(l->header->nb_markers == MARKERS_PER_PAGE)
+         seal_page(l);
+      add_marker(l, l->recovered[i], MARKER_END);
+      remove_open_transaction(l, l->recovered[i]);
+   }
+   if(l->nb_recovered) {
+      seal_page(l);
+      write_next_page(l); // submitted by the first loop of the worker
+   }
+   free(l->recovered);
+   l->recovered = NULL;
+   l->nb_recovered = 0;
+   return l;
+}
@@ -0,0 +1,11 @@
+#ifndef COMMITLOG_H
+#define COMMITLOG_H 1
+
+struct commit_log;
+
+struct commit_log *commit_log_init(struct slab_context *ctx, int worker_id, struct slab_callback *recovery_callback); // NULL if COMMIT_LOG is disabled (and all transactions ended), calls recovery_callback on the transactions that did not end
+void commit_log_append(struct commit_log *l, struct slab_callback *callback);               // START_TRANSACTION_COMMIT or END_TRANSACTION_COMMIT, the callback is called once the marker is on disk
+void commit_log_flush(struct commit_log *l);                                                 // called once per batch of requests
+struct commit_log *commit_log_retire_recovered(struct commit_log *l);                       // once recovery has erased the items of the transactions that did not end, NULL if COMMIT_LOG is disabled
+
+#endif
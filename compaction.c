@@ -0,0 +1,289 @@
+#include "headers.h"
+#include <time.h>
+
+/*
+ * Online compaction of the slabs.
+ * Slabs only grow, and free spots are only reused by items of the same size. When a slab has many free spots, the worker moves the live
+ * items stored at the end of the slab into free spots at the beginning of the slab, and then punches the end of the file.
+ *
+ * The end of a slab is processed by windows of COMPACTION_BATCH spots [from, end[ with end == last_item:
+ * - The free spots of the window are removed from the freelist, and spots of the window freed during the compaction are not added to it
+ *   (add_item_in_partially_freed_list calls compaction_spot_freed), so the spots of the window are never reused.
+ * - All the other spots of the window are read. A spot that contains the current version of an item (the index points to it) is copied in a
+ *   free spot, with the same timestamp, and the index is updated once the copy is on disk, if the item has not been modified in the meantime.
+ *   A spot that contains an old version of an item (it is still referenced by the snapshots, see in-memory-index.c) is kept.
+ * - Once all the spots are processed, last_item goes back to the first kept spot of the window, and the pages after last_item are punched.
+ *
+ * Moved items exist twice on disk until their old spot is punched or reused, which recovery handles like any duplicate (see worker_slab_init_cb).
+ * Compaction runs between two batches of requests, when the worker has less than COMPACTION_MAX_PENDING_REQUESTS queued requests, and never
+ * examines more than COMPACTION_MAX_SPOTS_PER_SEC spots per second.
+ */
+enum spot_state { SPOT_PENDING, SPOT_MOVING, SPOT_KEPT, SPOT_RECLAIMABLE };
+
+struct compaction_spot {
+   enum spot_state state;
+   int freed;           // spot was in the freelist, or has been freed during the compaction
+   uint64_t next_rdt;   // see add_item_in_partially_freed_list
+   char *item;          // copy of the content of the spot
+};
+
+struct compaction {
+   int worker_id;
+   struct slab **slabs;
+   size_t nb_slabs;
+   size_t next_slab;
+   time_t *retry_at;    // Per slab, do not retry slabs whose end cannot be compacted for a while
+
+   /* Current window */
+   struct slab *slab;
+   size_t from, end;
+   size_t nb_pending;
+   struct compaction_spot *spots;
+
+   /* Rate limiting */
+   time_t second;
+   size_t budget;
+
+   /* Stats */
+   size_t nb_moved, nb_punched_bytes;
+};
+
+static void finish_window(struct compaction *c);
+
+/*
+ * A spot of the window has been freed (e.g., by the GC) while it was being compacted.
+ * If the spot contains an old version that is still referenced by long running transactions, propagate it before forgetting it (see generic_add_or_update_with_location_cb1).
+ */
+static void release_spot(struct compaction_spot *spot) {
+   if(spot->next_rdt && TRANSACTION_TYPE == TRANS_LONG) {
+      transaction_propagate(spot->item, spot->next_rdt);
+      memory_index_clean_specific_version(spot->item);
+   }
+   spot->state = SPOT_RECLAIMABLE;
+}
+
+void compaction_spot_freed(struct slab *s, size_t idx, size_t next_rdt) {
+   struct compaction *c = s->compaction;
+   struct compaction_spot *spot = &c->spots[idx - c->from];
+   spot->freed = 1;
+   spot->next_rdt = next_rdt;
+   if(spot->state == SPOT_KEPT) // already read, otherwise the spot is released when the read or the move completes
+      release_spot(spot);
+}
+
+static void resolve_spot(struct compaction *c, struct slab_callback *cb) {
+   free_slab_callback(cb);
+   c->nb_pending--;
+   if(!c->nb_pending)
+      finish_window(c);
+}
+
+/*
+ * Move of a live item: 1/ read the free spot, 2/ write the item in the free spot, 3/ update the index.
+ */
+static void move_item_written_cb(struct slab_callback *cb) {
+   struct compaction *c = cb->slab->compaction;
+   struct compaction_spot *spot = cb->payload;
+   struct slab *s = cb->slab;
+   size_t idx = c->from + (spot - c->spots);
+
+   if(memory_index_relocate(c->worker_id, spot->item, s, idx, s, cb->slab_idx)) {
+      s->nb_items--; // the item was counted twice during the move
+      spot->state = SPOT_RECLAIMABLE;
+      c->nb_moved++;
+   } else { // the item has been updated during the move, our copy is garbage
+      s->nb_items--;
+      add_item_in_partially_freed_list(s, cb->slab_idx, 0);
+      if(spot->freed)
+         release_spot(spot);
+      else
+         spot->state = SPOT_KEPT;
+   }
+   resolve_spot(c, cb);
+}
+
+static void move_item_write_cb(struct slab_callback *cb) {
+   struct compaction_spot *spot = cb->payload;
+   char *disk_page = cb->lru_entry->page;
+   char *old_item = &disk_page[item_in_page_offset(cb->slab, cb->slab_idx)];
+
+   if(cb->propagate_value_until && TRANSACTION_TYPE == TRANS_LONG) { // we are about to overwrite an old version
+      transaction_propagate(old_item, cb->propagate_value_until);
+      memory_index_clean_specific_version(old_item);
+   }
+   memcpy(old_item, spot->item, get_item_size(spot->item));
+   slab_set_expiry(cb->slab, cb->slab_idx, item_get_expires(spot->item));
+   cb->io_cb = move_item_written_cb;
+   write_page_async(cb);
+}
+
+static int move_item(struct compaction *c, struct slab_callback *cb, struct compaction_spot *spot) {
+   size_t free_idx, next_rdt;
+   struct slab *s = cb->slab;
+   if(!freelist_pop(s, &free_idx, &next_rdt))
+      return 0;
+   s->nb_items++;
+   spot->state = SPOT_MOVING;
+   cb->slab_idx = free_idx;
+   cb->propagate_value_until = next_rdt;
+   cb->lru_entry = NULL;
+   cb->io_cb = move_item_write_cb;
+   read_page_async(cb);
+   return 1;
+}
+
+/*
+ * A spot of the window has been read
+ */
+static void spot_read_cb(struct slab_callback *cb) {
+   struct compaction *c = cb->slab->compaction;
+   struct compaction_spot *spot = cb->payload;
+   struct slab *s = cb->slab;
+   char *disk_page = cb->lru_entry->page;
+   struct item_metadata *meta = (void*)&disk_page[item_in_page_offset(s, cb->slab_idx)];
+
+   spot->item = malloc(s->item_size);
+   memcpy(spot->item, meta, (meta->key_size == -1 || meta->key_size == 0)?sizeof(*meta):get_item_size((char*)meta));
+
+   if(spot->freed) {
+      release_spot(spot);
+   } else if(meta->key_size == -1 || meta->key_size == 0) { // deleted or never used
+      spot->state = SPOT_RECLAIMABLE;
+   } else {
+      index_entry_t *e = memory_index_lookup(c->worker_id, NULL, spot->item, -1, NULL);
+      if(e && e->slab == s && e->slab_idx == cb->slab_idx && (e->rdt & ~ITEM_KEY_IS_FINGERPRINT_BIT) == meta->rdt && move_item(c, cb, spot)) // current version, not locked by a transaction
+         return;
+      spot->state = SPOT_KEPT; // old version of an item, or no free spot
+   }
+   resolve_spot(c, cb);
+}
+
+/* Spots of the window that are in the freelist */
+static void take_free_spot(struct slab *s, size_t idx, size_t next_rdt, void *data) {
+   struct compaction *c = data;
+   struct compaction_spot *spot = &c->spots[idx - c->from];
+   spot->freed = 1;
+   spot->next_rdt = next_rdt;
+}
+
+static int needs_compaction(struct compaction *c, size_t i) {
+   struct slab *s = c->slabs[i];
+   return s->last_item >= COMPACTION_BATCH
+      && s->nb_partially_freed_items
+      && (s->last_item - s->nb_items) * 100 >= s->last_item * COMPACTION_MIN_FREE_PERCENT
+      && c->retry_at[i] <= c->second;
+}
+
+static void start_window(struct compaction *c, struct slab *s) {
+   c->slab = s;
+   c->end = s->last_item;
+   c->from = c->end - COMPACTION_BATCH;
+   memset(c->spots, 0, COMPACTION_BATCH*sizeof(*c->spots));
+
+   s->compaction = c;
+   s->compacting_from = c->from;
+   freelist_take_range(s, c->from, take_free_spot, c);
+
+   c->nb_pending = COMPACTION_BATCH + 1; // the window cannot finish before all the reads are enqueued
+   for(size_t i = 0; i < COMPACTION_BATCH; i++) {
+      struct compaction_spot *spot = &c->spots[i];
+      if(spot->freed && !spot->next_rdt) { // nothing to propagate, no need to read the spot
+         spot->state = SPOT_RECLAIMABLE;
+         c->nb_pending--;
+         continue;
+      }
+      struct slab_callback *cb = new_slab_callback();
+      memset(cb, 0, sizeof(*cb));
+      cb->action = READ_NO_LOOKUP;
+      cb->io_class = IO_CLASS_MAINTENANCE;
+      cb->slab = s;
+      cb->slab_idx = c->from + i;
+      cb->payload = spot;
+      cb->io_cb = spot_read_cb;
+      read_page_async(cb);
+   }
+   c->nb_pending--;
+   if(!c->nb_pending)
+      finish_window(c);
+}
+
+static void finish_window(struct compaction *c) {
+   static __thread declare_periodic_count;
+   struct slab *s = c->slab;
+   size_t new_last_item = c->end;
+   if(s->last_item == c->end) // no item has been appended during the compaction
+      while(new_last_item > c->from && c->spots[new_last_item - 1 - c->from].state == SPOT_RECLAIMABLE)
+         new_last_item--;
+
+   s->compaction = NULL;
+   s->compacting_from = -1;
+   s->last_item = new_last_item;
+   for(size_t i = 0; i < new_last_item - c->from; i++) // reclaimable spots that are not at the end of the slab go back to the freelist
+      if(c->spots[i].state == SPOT_RECLAIMABLE)
+         add_item_in_partially_freed_list(s, c->from + i, 0);
+
+   /* Punch the pages that no longer contain any spot */
+   size_t items_per_page = s->page_size / s->item_size;
+   size_t first_page = (new_last_item + items_per_page - 1) / items_per_page;
+   size_t last_page = (c->end + items_per_page - 1) / items_per_page;
+   if(first_page < last_page) {
+      if(s->checkpoint) { // the index of the checkpoint might still point to the punched pages
+         for(size_t p = first_page; p < last_page; p++)
+            checkpoint_page_dirtied(s, p);
+         checkpoint_flush_log(s->checkpoint);
+      }
+      if(fallocate(s->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, first_page*s->page_size, (last_page - first_page)*s->page_size))
+         perr("Cannot punch slab (item size %lu)\n", s->item_size);
+      c->nb_punched_bytes += (last_page - first_page)*s->page_size;
+   }
+
+   if(new_last_item == c->end) // nothing could be reclaimed at the end of the slab, wait before trying again
+      c->retry_at[c->next_slab] = time(NULL) + 1;
+   for(size_t i = 0; i < COMPACTION_BATCH; i++)
+      free(c->spots[i].item);
+   c->slab = NULL;
+   periodic_count(1000, "[SLAB WORKER %d] Compaction - moved %lu items, punched %lu MB", c->worker_id, c->nb_moved, c->nb_punched_bytes/1024/1024);
+}
+
+/* Returns 1 if a window is being compacted, or if a slab needs to be compacted but the compaction is throttled */
+int compaction_step(struct compaction *c, size_t nb_pending_requests) {
+   if(!c || c->slab || nb_pending_requests >= COMPACTION_MAX_PENDING_REQUESTS)
+      return 0;
+
+   time_t now = time(NULL);
+   if(now != c->second) {
+      c->second = now;
+      c->budget = COMPACTION_MAX_SPOTS_PER_SEC;
+   }
+
+   while(!c->slab) { // windows that do not need IOs (free spots, cached pages) complete synchronously
+      size_t slab;
+      for(slab = 0; slab < c->nb_slabs; slab++)
+         if(needs_compaction(c, (c->next_slab + slab) % c->nb_slabs))
+            break;
+      if(slab == c->nb_slabs)
+         return 0;
+      if(c->budget < COMPACTION_BATCH)
+         return 1;
+      c->next_slab = (c->next_slab + slab) % c->nb_slabs;
+      c->budget -= COMPACTION_BATCH;
+      start_window(c, c->slabs[c->next_slab]);
+   }
+   return 1;
+}
+
+size_t compaction_pending_spots(struct compaction *c) {
+   return (c && c->slab)?c->nb_pending:0;
+}
+
+struct compaction *compaction_init(int worker_id, struct slab **slabs, size_t nb_slabs) {
+   if(!COMPACTION_MAX_SPOTS_PER_SEC)
+      return NULL;
+   struct compaction *c = calloc(1, sizeof(*c));
+   c->worker_id = worker_id;
+   c->slabs = slabs;
+   c->nb_slabs = nb_slabs;
+   c->retry_at = calloc(nb_slabs, sizeof(*c->retry_at));
+   c->spots = calloc(COMPACTION_BATCH, sizeof(*c->spots));
+   return c;
+}
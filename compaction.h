@@ -0,0 +1,13 @@
+#ifndef COMPACTION_H
+#define COMPACTION_H 1
+
+struct compaction;
+
+struct compaction *compaction_init(int worker_id, struct slab **slabs, size_t nb_slabs); // NULL if compaction is disabled
+int compaction_step(struct compaction *c, size_t nb_pending_requests);                   // called between two batches of requests and when idle
+size_t compaction_pending_spots(struct compaction *c);                                  // the worker dequeues less requests while spots are being compacted
+
+/* A spot >= slab->compacting_from has been freed, called by the freelist */
+void compaction_spot_freed(struct slab *s, size_t idx, size_t next_rdt);
+
+#endif
@@ -3,42 +3,92 @@
 /*
  * Freelist implementation
  * Freelists are used to store free locations on disk.
+ *
+ * The free spots of a slab are kept in a stack (the last freed spot is reused first, no allocation per spot) and in a bitmap
+ * (1 bit per spot of the slab). The bitmap guarantees that a spot is never handed out twice, and is the compact form of the
+ * freelist saved in checkpoints (see checkpoint.c). Without checkpoints, free spots are rediscovered when the slabs are scanned
+ * on startup (deleted items, and old versions of items that exist twice, see worker_slab_init_cb).
  */
 struct freelist_entry {
    uint64_t slab_idx;
    uint64_t next_rdt;
-   struct freelist_entry *next;
 };
 
+struct freelist {
+   struct freelist_entry *entries;
+   size_t max_entries;
+   uint64_t *bitmap;
+   size_t bitmap_size; // in spots
+};
+
+void freelist_init(struct slab *s) {
+   s->freelist = calloc(1, sizeof(*s->freelist));
+   s->nb_partially_freed_items = 0;
+}
+
+static int is_free(struct freelist *f, size_t idx) {
+   return idx < f->bitmap_size && (f->bitmap[idx/64] & (1LU << (idx%64)));
+}
+
+static void set_free(struct freelist *f, size_t idx) {
+   if(idx >= f->bitmap_size) {
+      size_t old_size = f->bitmap_size, new_size = old_size?old_size:4096;
+      while(new_size <= idx)
+         new_size *= 2;
+      f->bitmap = realloc(f->bitmap, new_size/8);
+      memset((char*)f->bitmap + old_size/8, 0, (new_size - old_size)/8);
+      f->bitmap_size = new_size;
+   }
+   f->bitmap[idx/64] |= 1LU << (idx%64);
+}
+
+static void clear_free(struct freelist *f, size_t idx) {
+   f->bitmap[idx/64] &= ~(1LU << (idx%64));
+}
+
 /*
  * Add an item to the free list. Function for items which deletion has NOT yet been persisted to disk.
  * This function is used by "not in place" updates. Rationnal is that we do not want to persit deletion of these items to disk immediately: maybe the spot can be reused to write something else (saves 1 write).
  */
 void add_item_in_partially_freed_list(struct slab *s, size_t idx, size_t next_rdt) {
-   struct freelist_entry *new_entry;
-   new_entry = calloc(1, sizeof(*new_entry));
-   new_entry->next = s->partially_freed_items;
-   new_entry->slab_idx = idx;
-   new_entry->next_rdt = next_rdt;
-   s->partially_freed_items = new_entry;
+   struct freelist *f = s->freelist;
+   if(idx >= s->compacting_from) { // the end of the slab is being compacted, the spot must not be reused
+      compaction_spot_freed(s, idx, next_rdt);
+      return;
+   }
+   if(is_free(f, idx)) // e.g., a deleted item that was also the old version of another item during recovery
+      return;
+   set_free(f, idx);
+
+   if(s->nb_partially_freed_items == f->max_entries) {
+      f->max_entries = f->max_entries?2*f->max_entries:1024;
+      f->entries = realloc(f->entries, f->max_entries*sizeof(*f->entries));
+   }
+   f->entries[s->nb_partially_freed_items].slab_idx = idx;
+   f->entries[s->nb_partially_freed_items].next_rdt = next_rdt;
    s->nb_partially_freed_items++;
 }
 
 /*
  * Find a free spot. Reuse partially_freed_items first.
  */
-void get_free_item_idx(struct slab_callback *cb) {
-   struct slab *s = cb->slab;
-   struct freelist_entry *old_entry;
+int freelist_pop(struct slab *s, size_t *idx, size_t *next_rdt) {
+   struct freelist *f = s->freelist;
+   if(!s->nb_partially_freed_items)
+      return 0;
+   struct freelist_entry *old_entry = &f->entries[--s->nb_partially_freed_items];
+   *idx = old_entry->slab_idx;
+   *next_rdt = old_entry->next_rdt;
+   clear_free(f, old_entry->slab_idx);
+   return 1;
+}
 
-   if(s->nb_partially_freed_items) {
-      old_entry = s->partially_freed_items;
-      cb->slab_idx = old_entry->slab_idx;
+void get_free_item_idx(struct slab_callback *cb) {
+   size_t idx, next_rdt;
+   if(freelist_pop(cb->slab, &idx, &next_rdt)) {
+      cb->slab_idx = idx;
       cb->lru_entry = NULL;
-      cb->propagate_value_until = old_entry->next_rdt;
-      s->partially_freed_items = s->partially_freed_items->next;
-      s->nb_partially_freed_items--;
-      free(old_entry);
+      cb->propagate_value_until = next_rdt;
       cb->io_cb(cb);
    } else {
       cb->slab_idx = -1;
@@ -47,3 +97,33 @@ void get_free_item_idx(struct slab_callback *cb) {
       return;
    }
 }
+
+/*
+ * Remove the free spots >= from (compaction)
+ */
+void freelist_take_range(struct slab *s, size_t from, void (*cb)(struct slab *s, size_t idx, size_t next_rdt, void *data), void *data) {
+   struct freelist *f = s->freelist;
+   size_t kept = 0;
+   for(size_t i = 0; i < s->nb_partially_freed_items; i++) {
+      struct freelist_entry *e = &f->entries[i];
+      if(e->slab_idx >= from) {
+         clear_free(f, e->slab_idx);
+         cb(s, e->slab_idx, e->next_rdt, data);
+      } else {
+         f->entries[kept++] = *e;
+      }
+   }
+   s->nb_partially_freed_items = kept;
+}
+
+int freelist_is_free(struct slab *s, size_t idx) {
+   return is_free(s->freelist, idx);
+}
+
+/*
+ * Bitmap of the free spots of a slab (checkpoints)
+ */
+uint64_t *freelist_bitmap(struct slab *s, size_t *nb_words) {
+   *nb_words = s->freelist->bitmap_size/64;
+   return s->freelist->bitmap;
+}
@@ -1,10 +1,22 @@
 #ifndef FREELIST_H
 #define FREELIST_H
 
+void freelist_init(struct slab *s);
+
 /* Adding a free spot */
 void add_item_in_partially_freed_list(struct slab *s, size_t idx, size_t next_rdt);
 
 /* Reusing a free spot */
 void get_free_item_idx(struct slab_callback *cb);
+int freelist_pop(struct slab *s, size_t *idx, size_t *next_rdt); // 0 if the slab has no free spot
+
+/* Removing the free spots >= from (compaction) */
+void freelist_take_range(struct slab *s, size_t from, void (*cb)(struct slab *s, size_t idx, size_t next_rdt, void *data), void *data);
+
+/* Is the spot in the freelist? (sweeper) */
+int freelist_is_free(struct slab *s, size_t idx);
+
+/* Bitmap of the free spots, 1 bit per spot */
+uint64_t *freelist_bitmap(struct slab *s, size_t *nb_words);
 
 #endif
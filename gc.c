@@ -13,10 +13,15 @@
 #define MAXIMUM_GC_ELEMENTS 100000000
 
 struct element_to_be_freed;
+struct tombstone_to_be_dropped;
 struct to_be_freed_list {
    struct element_to_be_freed *elements;
    size_t head, tail;
    size_t max_avail;
+
+   /* Deleted items, handed to the sweeper once no snapshot can read their old versions and these versions are freed (see sweeper.c) */
+   struct tombstone_to_be_dropped *tombstones;
+   size_t tombstones_head, tombstones_tail;
 };
 
 #define tail(r) ((r).tail % (r).max_avail)
@@ -36,21 +41,31 @@ struct element_to_be_freed {
 };
 #endif
 
+struct tombstone_to_be_dropped {
+   uint64_t hash;
+   uint64_t rdt;
+   size_t gc_pos; // the old version of the item is freed once head >= gc_pos
+};
+
 size_t gc_size(struct to_be_freed_list *l) {
-   return l->tail - l->head;
+   return l->tail - l->head + l->tombstones_tail - l->tombstones_head;
 }
 
-static maybe_unused uint64_t get_prefix_for_item(char *item) {
-   struct item_metadata *meta = (struct item_metadata *)item;
-   char *item_key = &item[sizeof(*meta)];
-   return *(uint64_t*)item_key;
+static void sweep_tombstones(uint64_t worker_id, struct to_be_freed_list *l, uint64_t snapshot_id) {
+   for(size_t nb_drops = 0; l->tombstones_head != l->tombstones_tail && nb_drops <= MAX_CLEANING_OP_PER_ROUND; nb_drops++) {
+      struct tombstone_to_be_dropped *t = &l->tombstones[l->tombstones_head % l->max_avail];
+      if(t->rdt >= snapshot_id || t->gc_pos > l->head)
+         break;
+      sweeper_add_tombstone(get_sweeper(worker_id), t->hash, t->rdt);
+      l->tombstones_head++;
+   }
 }
 
 /* Delete all versions < snapshot_id */
 void do_deletions(uint64_t worker_id, struct to_be_freed_list *l) {
    assert(is_worker_context());
 
-   if(l->tail == l->head)
+   if(l->tail == l->head && l->tombstones_tail == l->tombstones_head)
       return;
 
    size_t nb_deletions = 0;
@@ -62,7 +77,7 @@ void do_deletions(uint64_t worker_id, struct to_be_freed_list *l) {
      snapshot_id = get_min_snapshot_id();
 
    //printf("Cleaning till %lu\n", snapshot_id);
-   do {
+   while(l->head != l->tail) {
       e = &l->elements[head(*l)];
       if(e->rdt >= snapshot_id) // The list is not fully ordered, but at some point this will become true, so stop there
          break;
@@ -73,19 +88,19 @@ void do_deletions(uint64_t worker_id, struct to_be_freed_list *l) {
       memory_index_clean_old_versions(worker_id, e->hash, snapshot_id);
 #endif
       l->head++;
-      if(l->head == l->tail)
-         break;
       nb_deletions++;
       if(nb_deletions > MAX_CLEANING_OP_PER_ROUND)
          break;
-   } while(1);
+   }
+
+   sweep_tombstones(worker_id, l, snapshot_id);
 }
 
 /* Enqueue an item in the list */
 static void put_element_in_wait_to_be_freed_list(struct to_be_freed_list *l, char *item, uint64_t index_rdt) {
 #if TRANSACTION_TYPE != TRANS_LONG
    struct element_to_be_freed *e = &l->elements[tail(*l)];
-   e->hash = get_prefix_for_item(item);
+   e->hash = memory_index_get_hash(get_worker_for_item(item), item);
    e->rdt = index_rdt;
    l->tail++;
    if(tail(*l) == head(*l))
@@ -123,9 +138,48 @@ void add_item_in_gc(struct to_be_freed_list *l, struct slab_callback *callback,
    }
 }
 
+static void _add_tombstone_in_gc(struct to_be_freed_list *l, int worker_id, uint64_t hash, uint64_t index_rdt) {
+   if(TRANSACTION_TYPE == TRANS_FAST || get_nb_running_transactions() == 0) { // no running transaction
+      sweeper_add_tombstone(get_sweeper(worker_id), hash, index_rdt);
+   } else {
+      struct tombstone_to_be_dropped *t = &l->tombstones[l->tombstones_tail % l->max_avail];
+      t->hash = hash;
+      t->rdt = index_rdt;
+      t->gc_pos = l->tail;
+      l->tombstones_tail++;
+      if(l->tombstones_tail % l->max_avail == l->tombstones_head % l->max_avail)
+         die("Maximum number of tombstones exceeded, increase MAXIMUM_GC_ELEMENTS\n");
+   }
+}
+
+/*
+ * An item has been deleted, its tombstone must stay in the index until no snapshot can read the versions older than the tombstone, and
+ * until no copy of these versions is left on disk (see sweeper.c). Called after add_item_in_gc.
+ */
+void add_tombstone_in_gc(struct to_be_freed_list *l, struct slab_callback *callback, uint64_t index_rdt) {
+   int worker_id = get_worker_for_item(callback->item);
+   _add_tombstone_in_gc(l, worker_id, memory_index_get_hash(worker_id, callback->item), index_rdt);
+}
+
+/* An item has expired, it is now a tombstone written at rdt (see memory_index_expire) */
+void add_expired_in_gc(struct to_be_freed_list *l, int worker_id, uint64_t hash, uint64_t rdt) {
+   _add_tombstone_in_gc(l, worker_id, hash, rdt);
+}
+
+/* Spots of the old versions waiting to be freed (checkpoints), with snapshots the old versions are in the index instead (see memory_index_forall_old_versions) */
+void gc_forall_pending_locations(struct to_be_freed_list *l, void (*cb)(struct slab *s, size_t idx, void *data), void *data) {
+#if TRANSACTION_TYPE == TRANS_LONG
+   for(size_t i = l->head; i != l->tail; i++) {
+      struct element_to_be_freed *e = &l->elements[i % l->max_avail];
+      cb(e->s, e->idx, data);
+   }
+#endif
+}
+
 struct to_be_freed_list *init_gc(void) {
    struct to_be_freed_list *l = calloc(1, sizeof(*l));
    l->elements = calloc(MAXIMUM_GC_ELEMENTS, sizeof(*l->elements));
+   l->tombstones = calloc(MAXIMUM_GC_ELEMENTS, sizeof(*l->tombstones));
    l->max_avail = MAXIMUM_GC_ELEMENTS;
    return l;
 }
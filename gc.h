@@ -6,8 +6,11 @@ struct to_be_freed_list;
 struct to_be_freed_list *init_gc(void);
 void do_deletions(uint64_t worker_id, struct to_be_freed_list *l);
 void add_item_in_gc(struct to_be_freed_list *l, struct slab_callback *cb, uint64_t index_rdt);
+void add_tombstone_in_gc(struct to_be_freed_list *l, struct slab_callback *cb, uint64_t index_rdt);
+void add_expired_in_gc(struct to_be_freed_list *l, int worker_id, uint64_t hash, uint64_t rdt);
 
 size_t gc_size(struct to_be_freed_list *l);
+void gc_forall_pending_locations(struct to_be_freed_list *l, void (*cb)(struct slab *s, size_t idx, void *data), void *data);
 
 #endif
 
@@ -13,21 +13,26 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <assert.h>
 #include <string.h>
 #include <sys/time.h>
 #include <pthread.h>
 #include <signal.h>
+#include <limits.h>
 #include <sys/syscall.h>
 #include <linux/aio_abi.h>
+#include <linux/ioprio.h>
 
 #include "options.h"
 
 #include "utils.h"
+#include "pool.h"
 #include "items.h"
 
 #include "pagecache.h"
 #include "in-memory-index.h"
+#include "uring.h"
 #include "ioengine.h"
 #include "slab.h"
 #include "slabworker.h"
@@ -37,6 +42,12 @@
 
 #include "stats.h"
 #include "freelist.h"
+#include "checkpoint.h"
+#include "commitlog.h"
+#include "compaction.h"
+#include "sweeper.h"
+#include "queuedepth.h"
+#include "timestamp.h"
 #include "gc.h"
 
 #include "workload-common.h"
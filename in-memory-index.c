@@ -1,15 +1,147 @@
 #include "headers.h"
 
-static uint64_t get_prefix_for_item(char *item) {
-   struct item_metadata *meta = (struct item_metadata *)item;
-   char *item_key = &item[sizeof(*meta)];
-   return *(uint64_t*)item_key;
-}
+/*
+ * The indexes map the fingerprint of a key (item_get_key_hash: the key itself for keys of 8 bytes or less, a hash otherwise) to the
+ * location of the item.
+ *
+ * Two different keys can have the same fingerprint. The first key keeps it, the following ones get an unused "alias" fingerprint,
+ * remembered in aliases[worker]: fingerprint -> chain of (full key, alias fingerprint). All the functions below index an item by its
+ * alias if it has one (get_hash_for_item), so that the main index, the snapshots and the GC never mix up the versions of 2 keys.
+ * In the common case a worker has no alias at all and looking up a key is a single B-tree probe.
+ *
+ * Collisions are detected when a key is added and its fingerprint is already in the index (slab.c reads the item that owns the
+ * fingerprint and compares the full keys), and reads compare the full key of the item they get from disk with the key they asked for.
+ * Aliases are never removed, a key keeps its alias even if it is deleted and added again.
+ */
+struct key_alias {
+   struct key_alias *next;
+   uint64_t hash;          // alias fingerprint of the key
+   size_t key_size;
+   char key[];
+};
 
 // TODO: do a per thread structure!
-static btree_t **items_locations;               // Main index
+static btree_t **items_locations;               // Main index, packed entries (see memory-item.h)
 static btree_t **old_items_locations;           // For snapshot isolation, old versions still stored on disk
+static btree_t **aliases;                       // Keys that do not use their fingerprint, see above
 static size_t *nb_snapshotted_items;
+static size_t *nb_aliases;
+
+/*
+ * Entries of the main index are unpacked in a per thread entry, the pointers returned by the lookup functions
+ * are only valid until the next lookup of the thread.
+ */
+static __thread index_entry_t unpacked_entry;
+
+static index_entry_t *unpack_entry(struct packed_index_entry *p) {
+   unpacked_entry.slab = get_slab_from_id(p->location >> PACKED_SLAB_IDX_BITS);
+   unpacked_entry.slab_idx = p->location & PACKED_SLAB_IDX_MASK;
+   unpacked_entry.rdt = p->rdt;
+   return &unpacked_entry;
+}
+
+static void pack_entry(struct packed_index_entry *p, index_entry_t *e) {
+   assert(!e->slab || e->slab_idx <= PACKED_SLAB_IDX_MASK);
+   p->location = e->slab?((e->slab->id << PACKED_SLAB_IDX_BITS) | e->slab_idx):0;
+   p->rdt = e->rdt;
+}
+
+static int alias_matches(struct key_alias *a, char *item) {
+   struct item_metadata *meta = (void*)item;
+   return a->key_size == meta->key_size && !memcmp(a->key, &item[sizeof(*meta)], a->key_size);
+}
+
+static struct key_alias *get_alias(int worker_id, char *item, index_entry_t **chain) {
+   uint64_t hash = item_get_key_hash(item);
+   if(!btree_find(aliases[worker_id], (unsigned char*)&hash, sizeof(hash), chain))
+      return NULL;
+   for(struct key_alias *a = (*chain)->aliases; a; a = a->next)
+      if(alias_matches(a, item))
+         return a;
+   return NULL;
+}
+
+static uint64_t get_hash_for_item(int worker_id, char *item) {
+   if(!nb_aliases[worker_id]) // common case, no collision in this worker
+      return item_get_key_hash(item);
+
+   index_entry_t *chain;
+   struct key_alias *a = get_alias(worker_id, item, &chain);
+   return a?a->hash:item_get_key_hash(item);
+}
+
+uint64_t memory_index_get_hash(int worker_id, void *item) {
+   return get_hash_for_item(worker_id, item);
+}
+
+/* Entries remember if the key that owns them is 8B long (ITEM_KEY_IS_FINGERPRINT_BIT) */
+static void set_key_bit(index_entry_t *e, void *item) {
+   if(item_key_is_fingerprint(item))
+      set_key_is_fingerprint_bit(e);
+}
+
+/*
+ * 1 if the entry e, found for the key of item, belongs to that key for sure, 0 if the item must be read from disk to know it (see
+ * lock_item_async in slab.c): an alias always belongs to its key, and an 8B key owns the entry of its fingerprint if the owner is also 8B long.
+ */
+int memory_index_key_is_owner(int worker_id, index_entry_t *e, void *item) {
+   if(get_key_is_fingerprint_bit(e) && item_key_is_fingerprint(item))
+      return 1;
+   return get_hash_for_item(worker_id, item) != item_get_key_hash(item);
+}
+
+/* Aliases of a fingerprint are only in the main index once their item has been written, so also check the chain of the fingerprint */
+static int hash_is_used(int worker_id, uint64_t hash, struct key_alias *chain) {
+   index_entry_t *e;
+   struct packed_index_entry *p;
+   for(struct key_alias *a = chain; a; a = a->next)
+      if(a->hash == hash)
+         return 1;
+   return !hash
+      || btree_packed_find(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &p)
+      || btree_find(old_items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &e)
+      || btree_find(aliases[worker_id], (unsigned char*)&hash, sizeof(hash), &e);
+}
+
+static void link_alias(int worker_id, uint64_t base_hash, uint64_t hash, char *key, size_t key_size) {
+   index_entry_t *chain, new_chain;
+   struct key_alias *a = malloc(sizeof(*a) + key_size);
+   a->hash = hash;
+   a->key_size = key_size;
+   memcpy(a->key, key, key_size);
+
+   if(btree_find(aliases[worker_id], (unsigned char*)&base_hash, sizeof(base_hash), &chain)) {
+      a->next = chain->aliases;
+      chain->aliases = a;
+   } else {
+      a->next = NULL;
+      new_chain.aliases = a;
+      btree_insert(aliases[worker_id], (unsigned char*)&base_hash, sizeof(base_hash), &new_chain);
+   }
+   nb_aliases[worker_id]++;
+}
+
+/* The fingerprint of the key of item is used by another key, give the key its own fingerprint */
+void memory_index_add_alias(int worker_id, void *item) {
+   assert(is_worker_context());
+
+   uint64_t base_hash = item_get_key_hash(item);
+   if(get_hash_for_item(worker_id, item) != base_hash) // already done by a concurrent ADD of the same key
+      return;
+
+   index_entry_t *chain;
+   int has_chain = btree_find(aliases[worker_id], (unsigned char*)&base_hash, sizeof(base_hash), &chain);
+
+   uint64_t hash, attempt = 0;
+   do {
+      hash = base_hash + (++attempt) * 0x9E3779B97F4A7C15LU; // the sequence cannot get stuck, even when base_hash is 0
+      hash = hash - hash % get_nb_workers() + base_hash % get_nb_workers(); // the alias still belongs to the worker of the key
+   } while(hash_is_used(worker_id, hash, has_chain?chain->aliases:NULL));
+
+   struct item_metadata *meta = item;
+   link_alias(worker_id, base_hash, hash, &((char*)item)[sizeof(*meta)], meta->key_size);
+}
+
 
 
 /*
@@ -48,6 +180,11 @@ index_entry_t *memory_index_lookup_old_version_for_read(int worker_id, uint64_t
    return NULL;
 }
 
+/* Requests do not see deleted and expired items, the other lookups also get their location */
+static int is_visible(index_entry_t *e) {
+   return !get_deleted_bit(e) && !slab_spot_expired(e->slab, e->slab_idx);
+}
+
 /*
  * Lookup an item in the main memory index
  */
@@ -55,15 +192,17 @@ index_entry_t *memory_index_lookup(int worker_id, struct slab_callback *cb, void
    assert(is_worker_context());
 
    index_entry_t *result = NULL;
-   uint64_t hash = get_prefix_for_item(item);
-   int res = btree_find(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &result);
+   struct packed_index_entry *p;
+   uint64_t hash = get_hash_for_item(worker_id, item);
+   int res = btree_packed_find(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &p);
    if(res) {
+      result = unpack_entry(p);
       if(cb && !action_allowed(result, cb)) {
          result = memory_index_lookup_old_version_for_read(worker_id, hash, snapshot_id);
          if(result) {
             if(allowed)
                *allowed = 1;
-            return result;
+            return is_visible(result)?result:NULL; // the item was deleted in the snapshot, or has expired since
          } else {
             if(allowed)
                *allowed = 0;
@@ -72,6 +211,8 @@ index_entry_t *memory_index_lookup(int worker_id, struct slab_callback *cb, void
       }
       if(allowed)
          *allowed = 1;
+      if(cb && !is_visible(result))
+         return NULL;
       return result;
    } else {
       if(allowed)
@@ -83,17 +224,21 @@ index_entry_t *memory_index_lookup(int worker_id, struct slab_callback *cb, void
 
 /*
  * Lookup next item.
+ * Scans walk the fingerprints in increasing order (the position of a scan is a fingerprint, see scan_next in transaction.c): keys of 8B or less
+ * come in the order of their value as a uint64_t, but keys longer than 8B and keys that use an alias come in the order of their hash.
  */
 index_entry_t *_memory_index_lookup_next(int worker_id, struct slab_callback *cb, uint64_t hash, uint64_t *found_hash, uint64_t snapshot_id) {
    assert(is_worker_context());
 
    int res;
    index_entry_t *result;
+   struct packed_index_entry *p;
 
    //printf("Asking me for %lu to %lu\n", hash, cb->max_next_key);
 again:
-   res = btree_find_next(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &result, found_hash);
+   res = btree_packed_find_next(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &p, found_hash);
    if(res && *found_hash < cb->max_next_key) {
+      result = unpack_entry(p);
       if(!action_allowed(result, cb)) {
          result = memory_index_lookup_old_version_for_read(worker_id, *found_hash, snapshot_id);
          if(!result) {
@@ -102,6 +247,10 @@ again:
             goto again;
          }
       }
+      if(!is_visible(result)) { // the item has been deleted or has expired
+         hash = *found_hash;
+         goto again;
+      }
       //printf("Trans %lu snap %lu will read %lu (rdt %lu)\n", get_transaction_id(cb->transaction), snapshot_id, *found_hash, get_rdt_value(result));
       return result;
    } else {
@@ -110,7 +259,7 @@ again:
 }
 
 index_entry_t *memory_index_lookup_next(int worker_id, struct slab_callback *cb, void *item, uint64_t *found_hash, uint64_t snapshot_id, int *allowed) {
-   uint64_t hash = get_prefix_for_item(item);
+   uint64_t hash = item_get_key_hash(item); // scans start from a position, not from an existing key
    *allowed = 1;
    return _memory_index_lookup_next(worker_id, cb, hash, found_hash, snapshot_id);
 }
@@ -126,7 +275,7 @@ index_entry_t *memory_index_read_next_batch(int worker_id, struct slab_callback
    *hashes = calloc(desired_size, sizeof(**hashes));
    *allowed = 1;
 
-   uint64_t last_hash = get_prefix_for_item(item), new_hash;
+   uint64_t last_hash = item_get_key_hash(item), new_hash;
    while(actual_size < desired_size) {
       index_entry_t *e = _memory_index_lookup_next(worker_id, cb, last_hash, &new_hash, snapshot_id);
       if(e) {
@@ -229,26 +378,27 @@ void memory_index_clean_old_versions(int worker_id, uint64_t hash, uint64_t snap
    _memory_index_clean_old_versions(worker_id, hash, snapshot_id, 0);
 }
 void memory_index_clean_specific_version(void *item) {
-   _memory_index_clean_old_versions(get_worker_for_item(item), get_prefix_for_item(item), item_get_rdt(item), 1);
+   int worker_id = get_worker_for_item(item);
+   _memory_index_clean_old_versions(worker_id, get_hash_for_item(worker_id, item), item_get_rdt(item), 1);
 }
 
 void memory_index_revert(int worker_id, void *item, struct slab_callback *cb, uint64_t transaction_id) {
    assert(is_worker_context());
 
-   index_entry_t *new;
-   uint64_t hash = get_prefix_for_item(item);
+   struct packed_index_entry *new;
+   uint64_t hash = get_hash_for_item(worker_id, item);
 
 
    /* Get the pointer to the item in the main index */
-   int exists = btree_find(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &new);
+   int exists = btree_packed_find(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &new);
    assert(exists);
 
    if(!get_locked_bit(new))
       die("Reverting an item that is not locked?? %lu\n", hash);
 
-   if(!new->slab) { // Item was reserved but not committed, so deleted it
+   if(!new->location) { // Item was reserved but not committed, so deleted it
       //printf("Deleting %lu\n", hash);
-      btree_delete(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash));
+      btree_packed_delete(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash));
    } else { // Reverting a commit simply means unlocking the item
       //printf("Unlocking %lu\n", hash);
       unset_locked_bit(new);
@@ -261,7 +411,7 @@ void memory_index_revert(int worker_id, void *item, struct slab_callback *cb, ui
  */
 
 /* Lock an item in the index */
-static void memory_index_lock(index_entry_t *e, uint64_t transaction_id) {
+static void memory_index_lock(struct packed_index_entry *e, uint64_t transaction_id) {
    assert(!get_locked_bit(e)); // Somebody else locked the item before, we shouldn't be able to lock it again!
    //e->rdt = transaction_id; // Do NOT modify the RDT of he item, we still want to be able to read the old value!
    set_locked_bit(e);
@@ -274,7 +424,7 @@ static void memory_index_snapshot(int worker_id, void *item, index_entry_t *e, u
    /* Remember the old location of the item in the "old_items_locations" tree */
    index_entry_t *mvcc;
    index_entry_t new_mvcc;
-   uint64_t hash = get_prefix_for_item(item);
+   uint64_t hash = get_hash_for_item(worker_id, item);
    int had_old_version_already = btree_find(old_items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &mvcc);
    if(!had_old_version_already) {
       //printf("Key %lu - %lu; creating snapshots newest %lu!!\n", hash, get_rdt_value(e), transaction_id);
@@ -304,16 +454,16 @@ static void memory_index_snapshot(int worker_id, void *item, index_entry_t *e, u
 index_entry_t *memory_index_lookup_and_lock(int worker_id, void *item, struct slab_callback *cb, uint64_t transaction_id, int *present, int *allowed) {
    assert(is_worker_context());
 
-   index_entry_t *result;
-   uint64_t hash = get_prefix_for_item(item);
-   int res = btree_find(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &result);
+   struct packed_index_entry *p;
+   uint64_t hash = get_hash_for_item(worker_id, item);
+   int res = btree_packed_find(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &p);
    if(res) {
       *present = 1;
-      if(action_allowed(result, cb)) {
+      if(action_allowed(unpack_entry(p), cb)) {
          *allowed = 1;
          //printf("Locking %lu by %lu\n", hash, transaction_id);
-         memory_index_lock(result, transaction_id);
-         return result;
+         memory_index_lock(p, transaction_id);
+         return unpack_entry(p);
       } else {
          *allowed = 0;
          return NULL;
@@ -330,11 +480,13 @@ uint64_t memory_item_update_remove_lock(struct slab_callback *cb, void *item) {
 
    uint64_t rdt;
    index_entry_t *e;
+   struct packed_index_entry *p;
    int worker_id = get_worker_for_item(item);
-   uint64_t hash = get_prefix_for_item(item);
+   uint64_t hash = get_hash_for_item(worker_id, item);
 
-   int res = btree_find(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &e);
+   int res = btree_packed_find(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &p);
    if(res) {
+      e = unpack_entry(p);
       if(!get_locked_bit(e) && cb->transaction) {
          die("Double unlock?! -- likely a bug\n");
       } else {
@@ -347,8 +499,16 @@ uint64_t memory_item_update_remove_lock(struct slab_callback *cb, void *item) {
          e->slab_idx = cb->slab_idx;
          e->rdt = item_get_rdt(item);
          rdt = e->rdt;
+         if(item_is_tombstone(item))
+            set_deleted_bit(e);
+         set_key_bit(e, item);
+         pack_entry(p, e);
          //printf("Unlocking %lu\n", hash);
       }
+   } else if(!cb->transaction) { // the tombstone of the item has been dropped while we were writing (see memory_index_drop_tombstone)
+      cb->old_slab = NULL;
+      memory_index_add(cb, item);
+      rdt = item_get_rdt(item);
    } else {
       die("Cannot unlock because it does not exist?!\n");
    }
@@ -359,19 +519,22 @@ uint64_t memory_item_update_remove_lock(struct slab_callback *cb, void *item) {
 static void memory_index_insert(int worker_id, void *item, index_entry_t *e) {
    assert(is_worker_context());
 
-   uint64_t hash = get_prefix_for_item(item);
+   uint64_t hash = get_hash_for_item(worker_id, item);
+
+   struct packed_index_entry p;
+   pack_entry(&p, e);
 
-   //printf("Inserting %lu version %lu\n", get_prefix_for_item(item), get_rdt_value(e));
-   btree_insert(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), e);
+   //printf("Inserting %lu version %lu\n", get_hash_for_item(worker_id, item), get_rdt_value(e));
+   btree_packed_insert(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &p);
 }
 
 void memory_index_delete(int worker_id, void *item) {
    assert(is_worker_context());
 
    index_entry_t *old_entry = NULL;
-   uint64_t hash = get_prefix_for_item(item);
+   uint64_t hash = get_hash_for_item(worker_id, item);
 
-   btree_delete(items_locations[worker_id], (unsigned char *)&(hash), sizeof(hash));
+   btree_packed_delete(items_locations[worker_id], (unsigned char *)&(hash), sizeof(hash));
 
    if(old_entry)
       free(old_entry);
@@ -386,9 +549,88 @@ void memory_index_add(struct slab_callback *cb, void *item) {
    new_entry.slab_idx = cb->slab_idx;
    new_entry.rdt = meta->rdt;
    assert(new_entry.rdt);
+   if(item_is_tombstone(item))
+      set_deleted_bit(&new_entry);
+   set_key_bit(&new_entry, item);
    memory_index_insert(get_worker(new_entry.slab), item, &new_entry);
 }
 
+/* 1 if the last version of the item is a tombstone or has expired */
+int memory_index_is_deleted(int worker_id, void *item) {
+   assert(is_worker_context());
+
+   struct packed_index_entry *p;
+   uint64_t hash = get_hash_for_item(worker_id, item);
+   return btree_packed_find(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &p) && !is_visible(unpack_entry(p));
+}
+
+/*
+ * Walk the index by batches of max_entries entries, starting after *cursor (or from the beginning if from_start), and mark the expired items
+ * as deleted: an expired item is handled like a tombstone written at its location (see sweeper.c). Locked items are skipped.
+ * Returns the number of entries visited, less than max_entries once the end of the index is reached.
+ */
+size_t memory_index_expire(int worker_id, uint64_t *cursor, int from_start, size_t max_entries, void (*cb)(uint64_t hash, uint64_t rdt, void *data), void *data) {
+   assert(is_worker_context());
+
+   struct packed_index_entry *p;
+   uint64_t hash = 0;
+   size_t nb_visited = 0;
+   int found = from_start && btree_packed_find(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &p); // find_next skips the fingerprint 0
+   if(!from_start)
+      hash = *cursor;
+   if(!found)
+      found = btree_packed_find_next(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &p, &hash);
+   while(found && nb_visited < max_entries) {
+      index_entry_t *e = unpack_entry(p);
+      if(!get_deleted_bit(e) && !get_locked_bit(e) && slab_spot_expired(e->slab, e->slab_idx)) {
+         set_deleted_bit(p);
+         cb(hash, get_rdt_value(e), data);
+      }
+      nb_visited++;
+      *cursor = hash;
+      found = btree_packed_find_next(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &p, &hash);
+   }
+   return nb_visited;
+}
+
+/*
+ * No snapshot can read the versions older than the tombstone written at rdt and no copy of them is left on disk (see sweeper.c), forget
+ * the key and free the spot of the tombstone.
+ * Nothing to do if the key has been written again since the deletion, the tombstone is then an old version handled by the GC.
+ */
+void memory_index_drop_tombstone(int worker_id, uint64_t hash, uint64_t rdt) {
+   assert(is_worker_context());
+
+   struct packed_index_entry *p;
+   if(!btree_packed_find(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &p))
+      return;
+   if(!get_deleted_bit(p) || get_locked_bit(p) || get_rdt_value(p) != rdt)
+      return;
+   index_entry_t *e = unpack_entry(p);
+   struct slab *s = e->slab;
+   size_t idx = e->slab_idx;
+   btree_packed_delete(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash));
+   s->nb_items--;
+   add_item_in_partially_freed_list(s, idx, 0);
+}
+
+/* Item has been copied to another spot (compaction), update its location if the index still points to the old spot and the item has not been locked or modified */
+int memory_index_relocate(int worker_id, void *item, struct slab *old_slab, size_t old_idx, struct slab *new_slab, size_t new_idx) {
+   assert(is_worker_context());
+
+   struct packed_index_entry *p;
+   uint64_t hash = get_hash_for_item(worker_id, item);
+   if(!btree_packed_find(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &p))
+      return 0;
+   index_entry_t *e = unpack_entry(p);
+   if(e->slab != old_slab || e->slab_idx != old_idx || (e->rdt & ~ITEM_KEY_IS_FINGERPRINT_BIT) != item_get_rdt(item))
+      return 0;
+   e->slab = new_slab;
+   e->slab_idx = new_idx;
+   pack_entry(p, e);
+   return 1;
+}
+
 /* Item has NOT been written to disk yet, but we want to say that we will in order to avoid write conflicts */
 void memory_index_reserve(int worker_id, void *item, uint64_t transaction_id) {
    index_entry_t new_entry;
@@ -396,9 +638,88 @@ void memory_index_reserve(int worker_id, void *item, uint64_t transaction_id) {
    new_entry.slab_idx = 0;
    new_entry.rdt = transaction_id;
    set_locked_bit(&new_entry);
+   set_key_bit(&new_entry, item);
    memory_index_insert(worker_id, item, &new_entry);
 }
 
+/* The entry of the fingerprint hash has been locked for a key that does not own it, see lock_colliding_item in slab.c */
+void memory_index_unlock(int worker_id, uint64_t hash) {
+   assert(is_worker_context());
+
+   struct packed_index_entry *p;
+   int exists = btree_packed_find(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &p);
+   assert(exists && get_locked_bit(p));
+   unset_locked_bit(p);
+}
+
+
+
+/*
+ * Checkpoints (see checkpoint.c): iterate on the main index and the aliases of a worker, and put them back in the index.
+ */
+struct forall_context {
+   int worker_id;
+   void *cb;
+   void *data;
+};
+
+static void forall_entries_cb(uint64_t hash, struct packed_index_entry *p, void *data) {
+   struct forall_context *c = data;
+   void (*cb)(uint64_t, index_entry_t *, void *) = c->cb;
+   cb(hash, unpack_entry(p), c->data);
+}
+
+void memory_index_forall(int worker_id, void (*cb)(uint64_t hash, index_entry_t *e, void *data), void *data) {
+   struct forall_context c = { .worker_id = worker_id, .cb = cb, .data = data };
+   btree_packed_forall(items_locations[worker_id], forall_entries_cb, &c);
+}
+
+static void forall_aliases_cb(uint64_t base_hash, void *data) {
+   struct forall_context *c = data;
+   void (*cb)(uint64_t, uint64_t, char *, size_t, void *) = c->cb;
+   index_entry_t *chain;
+   btree_find(aliases[c->worker_id], (unsigned char*)&base_hash, sizeof(base_hash), &chain);
+   for(struct key_alias *a = chain->aliases; a; a = a->next)
+      cb(base_hash, a->hash, a->key, a->key_size, c->data);
+}
+
+void memory_index_forall_aliases(int worker_id, void (*cb)(uint64_t base_hash, uint64_t hash, char *key, size_t key_size, void *data), void *data) {
+   struct forall_context c = { .worker_id = worker_id, .cb = cb, .data = data };
+   btree_forall_keys(aliases[worker_id], forall_aliases_cb, &c);
+}
+
+static void forall_old_versions_cb(uint64_t hash, void *data) {
+   struct forall_context *c = data;
+   void (*cb)(uint64_t, index_entry_t *, void *) = c->cb;
+   index_entry_t *mvcc;
+   struct packed_index_entry *current;
+   btree_find(old_items_locations[c->worker_id], (unsigned char*)&hash, sizeof(hash), &mvcc);
+   int has_current = btree_packed_find(items_locations[c->worker_id], (unsigned char*)&hash, sizeof(hash), &current);
+   for(size_t j = 0; j < mvcc->nb_versions; j++) {
+      index_entry_t *e = &mvcc->versions[j];
+      if(!e->slab) // fake old version, see _memory_index_clean_old_versions
+         continue;
+      if(has_current && current->location == ((e->slab->id << PACKED_SLAB_IDX_BITS) | e->slab_idx))
+         continue; // item locked by a transaction, its new version has not been written yet
+      cb(hash, e, c->data);
+   }
+}
+
+/* Old versions kept for snapshots, only the versions that are not also the current location of their item */
+void memory_index_forall_old_versions(int worker_id, void (*cb)(uint64_t hash, index_entry_t *e, void *data), void *data) {
+   struct forall_context c = { .worker_id = worker_id, .cb = cb, .data = data };
+   btree_forall_keys(old_items_locations[worker_id], forall_old_versions_cb, &c);
+}
+
+void memory_index_restore(int worker_id, uint64_t hash, index_entry_t *e) {
+   struct packed_index_entry p;
+   pack_entry(&p, e);
+   btree_packed_insert(items_locations[worker_id], (unsigned char*)&hash, sizeof(hash), &p);
+}
+
+void memory_index_restore_alias(int worker_id, uint64_t base_hash, uint64_t hash, char *key, size_t key_size) {
+   link_alias(worker_id, base_hash, hash, key, key_size);
+}
 
 
 size_t get_snapshot_size(void) {
@@ -411,10 +732,13 @@ size_t get_snapshot_size(void) {
 void memory_index_init(void) {
    items_locations = malloc(get_nb_workers() * sizeof(*items_locations));
    old_items_locations = malloc(get_nb_workers() * sizeof(*old_items_locations));
+   aliases = malloc(get_nb_workers() * sizeof(*aliases));
    nb_snapshotted_items = calloc(get_nb_workers(), sizeof(*nb_snapshotted_items));
+   nb_aliases = calloc(get_nb_workers(), sizeof(*nb_aliases));
    for(size_t w = 0; w < get_nb_workers() ; w++) {
-      items_locations[w] = btree_create();
+      items_locations[w] = btree_packed_create();
       old_items_locations[w] = btree_create();
+      aliases[w] = btree_create();
    }
 }
 
@@ -9,6 +9,9 @@ void memory_index_init(void);
 void memory_index_add(struct slab_callback *cb, void *item);                     // Add an item
 void memory_index_reserve(int worker_id, void *item, uint64_t transaction_id);   // Say the item will be added by a transaction
 void memory_index_delete(int worker_id, void *item);
+void memory_index_add_alias(int worker_id, void *item);                          // Fingerprint of the key is used by another key, give it another one
+uint64_t memory_index_get_hash(int worker_id, void *item);                       // Fingerprint of the key in the indexes (alias if any)
+int memory_index_key_is_owner(int worker_id, index_entry_t *e, void *item);      // 1 if e belongs to the key of item without reading the item
 
 
 index_entry_t *memory_index_lookup(int worker_id, struct slab_callback *cb, void *item, uint64_t transaction_id, int *action_allowed);
@@ -20,6 +23,18 @@ uint64_t memory_item_update_remove_lock(struct slab_callback *cb, void *item);
 void memory_index_clean_old_versions(int worker_id, uint64_t hash, uint64_t snapshot_id);
 void memory_index_clean_specific_version(void *item);
 void memory_index_revert(int worker_id, void *item, struct slab_callback *cb, uint64_t transaction_id);
+void memory_index_unlock(int worker_id, uint64_t hash);                          // lock taken for a key that does not own the fingerprint
+int memory_index_is_deleted(int worker_id, void *item);                          // 1 if the item has been deleted or has expired
+size_t memory_index_expire(int worker_id, uint64_t *cursor, int from_start, size_t max_entries, void (*cb)(uint64_t hash, uint64_t rdt, void *data), void *data); // expired items become tombstones
+void memory_index_drop_tombstone(int worker_id, uint64_t hash, uint64_t rdt);     // forget a deleted item once its old versions are gone (sweeper)
+int memory_index_relocate(int worker_id, void *item, struct slab *old_slab, size_t old_idx, struct slab *new_slab, size_t new_idx); // 0 if the item has been modified
+
+/* Checkpoints of the index */
+void memory_index_forall(int worker_id, void (*cb)(uint64_t hash, index_entry_t *e, void *data), void *data);
+void memory_index_forall_aliases(int worker_id, void (*cb)(uint64_t base_hash, uint64_t hash, char *key, size_t key_size, void *data), void *data);
+void memory_index_forall_old_versions(int worker_id, void (*cb)(uint64_t hash, index_entry_t *e, void *data), void *data);
+void memory_index_restore(int worker_id, uint64_t hash, index_entry_t *e);
+void memory_index_restore_alias(int worker_id, uint64_t base_hash, uint64_t hash, char *key, size_t key_size);
 
 size_t get_snapshot_size(void);
 #endif
@@ -77,4 +77,69 @@ redo:
       btree_map<uint64_t, struct index_entry> *b = static_cast< btree_map<uint64_t, struct index_entry> * >(t);
       delete b;
    }
+
+   /*
+    * Packed entries
+    */
+   btree_t *btree_packed_create() {
+      btree_map<uint64_t, struct packed_index_entry> *b = new btree_map<uint64_t, struct packed_index_entry>();
+      return b;
+   }
+
+   size_t btree_packed_size(btree_t *t) {
+      btree_map<uint64_t, struct packed_index_entry> *b = static_cast< btree_map<uint64_t, struct packed_index_entry> * >(t);
+      return b->size();
+   }
+
+   int btree_packed_find(btree_t *t, unsigned char* k, size_t len, struct packed_index_entry **e) {
+      uint64_t hash = *(uint64_t*)k;
+      btree_map<uint64_t, struct packed_index_entry> *b = static_cast< btree_map<uint64_t, struct packed_index_entry> * >(t);
+      auto i = b->find(hash);
+      if(i != b->end()) {
+         *e = &i->second;
+         return 1;
+      } else {
+         *e = NULL;
+         return 0;
+      }
+   }
+
+   int btree_packed_find_next(btree_t *t, unsigned char* k, size_t len, struct packed_index_entry **e, uint64_t *found_hash) {
+      uint64_t hash = *(uint64_t*)k;
+      btree_map<uint64_t, struct packed_index_entry> *b = static_cast< btree_map<uint64_t, struct packed_index_entry> * >(t);
+      auto i = b->find_closest(hash);
+      *e = NULL;
+      if(i != b->end() && i->first == hash) // find_closest returned an exact match, but we want the next element
+         i++;
+      if(i != b->end()) {
+         *e = &i->second;
+         *found_hash = i->first;
+         return 1;
+      } else {
+         return 0;
+      }
+   }
+
+   void btree_packed_delete(btree_t *t, unsigned char*k, size_t len) {
+      uint64_t hash = *(uint64_t*)k;
+      btree_map<uint64_t, struct packed_index_entry> *b = static_cast< btree_map<uint64_t, struct packed_index_entry> * >(t);
+      b->erase(hash);
+   }
+
+   void btree_packed_insert(btree_t *t, unsigned char*k, size_t len, struct packed_index_entry *e) {
+      uint64_t hash = *(uint64_t*)k;
+      btree_map<uint64_t, struct packed_index_entry> *b = static_cast< btree_map<uint64_t, struct packed_index_entry> * >(t);
+      b->insert(make_pair(hash, *e));
+   }
+
+   void btree_packed_forall(btree_t *t, void (*cb)(uint64_t h, struct packed_index_entry *e, void *data), void *data) {
+      btree_map<uint64_t, struct packed_index_entry> *b = static_cast< btree_map<uint64_t, struct packed_index_entry> * >(t);
+      for(auto i = b->begin(); i != b->end(); i++)
+         cb(i->first, &i->second, data);
+   }
+
+   void btree_packed_free(btree_t *t) {
+      btree_map<uint64_t, struct packed_index_entry> *b = static_cast< btree_map<uint64_t, struct packed_index_entry> * >(t);
+      delete b;
+   }
 }
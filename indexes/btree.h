@@ -21,6 +21,16 @@ void btree_insert(btree_t *t, unsigned char*k, size_t len, struct index_entry *e
 void btree_forall_keys(btree_t *t, void (*cb)(uint64_t h, void *data), void *data);
 void btree_free(btree_t *t);
 
+/* Same btree, but with packed values (used by the main index) */
+btree_t *btree_packed_create();
+size_t btree_packed_size(btree_t *t);
+int btree_packed_find(btree_t *t, unsigned char*k, size_t len, struct packed_index_entry **e);
+int btree_packed_find_next(btree_t *t, unsigned char* k, size_t len, struct packed_index_entry **e, uint64_t *found_hash);
+void btree_packed_delete(btree_t *t, unsigned char*k, size_t len);
+void btree_packed_insert(btree_t *t, unsigned char*k, size_t len, struct packed_index_entry *e);
+void btree_packed_forall(btree_t *t, void (*cb)(uint64_t h, struct packed_index_entry *e, void *data), void *data);
+void btree_packed_free(btree_t *t);
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,17 +5,19 @@ struct slab;
 
 /*
  * Because we are in C and have no template... We use  definition for multiple contexts.
- * Context1: memory index. prefix(key) -> slab, slab_idx
+ * Context1: memory index. prefix(key) -> slab, slab_idx (stored packed in the index, see struct packed_index_entry)
  * Context2: pagecache.  hash(page) -> page, lru
  * Context3: transaction. prefix(key) -> index in the cache of the transaction, flags
  * Context4: MVCC. prefix(key) -> MVCC block -> [ slab, slab_idx ]
+ * Context5: collisions. fingerprint(key) -> chain of keys that have another fingerprint
  */
-struct index_entry { // This index entry could be made much smaller by, e.g., have 64b for [slab_size, slab_idx] it is then easy to do size -> slab* given a slab context
+struct index_entry {
    union {
       struct slab *slab;
       void *page;
       size_t cached_data_idx;
       uint64_t current_rdt;
+      struct key_alias *aliases;
    };
    union {
       size_t slab_idx;
@@ -30,10 +32,26 @@ struct index_entry { // This index entry could be made much smaller by, e.g., ha
 };
 
 /*
- * Different flags on the rdt field.
+ * The main index has 1 entry per item in the DB, so it stores Context1 entries in 16B instead of 24B:
+ * [slab id (16 bits) | slab_idx (48 bits)] + rdt. The slab id is the position of the slab in the array of all slabs (get_slab_from_id),
+ * 0 means that the item has no slab (spot reserved by a transaction). The lock, new value and deleted flags stay in the rdt word.
+ */
+struct packed_index_entry {
+   uint64_t location;
+   uint64_t rdt;
+};
+
+#define PACKED_SLAB_IDX_BITS 48LU
+#define PACKED_SLAB_IDX_MASK ((1LU<<PACKED_SLAB_IDX_BITS)-1LU)
+#define MAX_NB_SLABS (1LU<<(64LU-PACKED_SLAB_IDX_BITS))
+
+/*
+ * Different flags on the rdt field (of both struct index_entry and struct packed_index_entry).
  */
 #define ITEM_IS_LOCKED_BIT (1LU<<61LU)
 #define ITEM_CONTAINS_NEW_IDX_BIT (1LU<<60LU)
+#define ITEM_IS_DELETED_BIT (1LU<<62LU)          // the location is a tombstone (see slab.c)
+#define ITEM_KEY_IS_FINGERPRINT_BIT (1LU<<63LU)  // the key of the item is 8B long, so it is its own fingerprint (see item_key_is_fingerprint)
 
 #define TRANSACTION_MASK ((1LU<<60LU)-1LU)
 
@@ -47,6 +65,12 @@ struct index_entry { // This index entry could be made much smaller by, e.g., ha
 #define set_locked_bit(item) ((item)->rdt |= ITEM_IS_LOCKED_BIT)
 #define unset_locked_bit(item) ((item)->rdt &= ~(ITEM_IS_LOCKED_BIT))
 
+#define get_deleted_bit(item) ((item)->rdt & ITEM_IS_DELETED_BIT)
+#define set_deleted_bit(item) ((item)->rdt |= ITEM_IS_DELETED_BIT)
+
+#define get_key_is_fingerprint_bit(item) ((item)->rdt & ITEM_KEY_IS_FINGERPRINT_BIT)
+#define set_key_is_fingerprint_bit(item) ((item)->rdt |= ITEM_KEY_IS_FINGERPRINT_BIT)
+
 struct index_scan {
    uint64_t *hashes;
    struct index_entry *entries;
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "openhash.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Open-addressing hash table with SIMD probed groups ("Swiss table" layout).
+ *
+ * ctrl[slot] = CTRL_EMPTY, CTRL_DELETED, or the low 7 bits of the hash of the key stored in the slot.
+ * The high bits of the hash choose the first group, then groups are probed with a triangular sequence (visits all groups because nb_groups is a power of 2).
+ * A lookup stops at the first group that contains an empty slot.
+ *
+ * Deleting a key in a group that still contains an empty slot can mark the slot as empty directly: a group that has an empty slot has never been full,
+ * so no probe sequence ever went past it. Otherwise the slot becomes a tombstone. Tombstones are reused by inserts and purged by rehashing the table
+ * (same size) when no empty slot can be consumed anymore. The table has at least 2x more slots than its capacity, so rehashes are rare.
+ */
+
+#define GROUP_SIZE 16
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xFE)
+
+static inline uint64_t mix(uint64_t key) { // murmur3 finalizer, page hashes are (fd << 40) + page_num so low bits alone are bad
+   key ^= key >> 33;
+   key *= 0xff51afd7ed558ccdLU;
+   key ^= key >> 33;
+   key *= 0xc4ceb9fe1a85ec53LU;
+   key ^= key >> 33;
+   return key;
+}
+
+/* Bitmask of the slots of the group whose tag is b */
+static inline uint32_t group_match(const uint8_t *ctrl, uint8_t b) {
+#ifdef __SSE2__
+   __m128i group = _mm_load_si128((const __m128i*)ctrl);
+   return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)b)));
+#else
+   uint32_t res = 0;
+   for(size_t i = 0; i < GROUP_SIZE; i++)
+      if(ctrl[i] == b)
+         res |= 1U << i;
+   return res;
+#endif
+}
+
+/* Bitmask of the slots of the group that are empty or deleted (high bit set) */
+static inline uint32_t group_match_free(const uint8_t *ctrl) {
+#ifdef __SSE2__
+   return _mm_movemask_epi8(_mm_load_si128((const __m128i*)ctrl));
+#else
+   uint32_t res = 0;
+   for(size_t i = 0; i < GROUP_SIZE; i++)
+      if(ctrl[i] & 0x80)
+         res |= 1U << i;
+   return res;
+#endif
+}
+
+static void openhash_alloc(struct openhash *h) {
+   size_t nb_slots = h->nb_groups * GROUP_SIZE;
+   h->ctrl = aligned_alloc(GROUP_SIZE, nb_slots);
+   h->keys = malloc(nb_slots * sizeof(*h->keys));
+   h->values = malloc(nb_slots * sizeof(*h->values));
+   assert(h->ctrl && h->keys && h->values);
+   memset(h->ctrl, CTRL_EMPTY, nb_slots);
+   h->size = 0;
+   h->growth_left = nb_slots * 7 / 8;
+}
+
+struct openhash *openhash_create(size_t capacity) {
+   struct openhash *h = calloc(1, sizeof(*h));
+   h->capacity = capacity;
+   h->nb_groups = 1;
+   while(h->nb_groups * GROUP_SIZE < 2 * capacity)
+      h->nb_groups *= 2;
+   openhash_alloc(h);
+   return h;
+}
+
+void openhash_free(struct openhash *h) {
+   free(h->ctrl);
+   free(h->keys);
+   free(h->values);
+   free(h);
+}
+
+/* First empty or deleted slot on the probe sequence of hash */
+static size_t find_free_slot(struct openhash *h, uint64_t hash) {
+   size_t mask = h->nb_groups - 1;
+   size_t group = (hash >> 7) & mask;
+   for(size_t i = 1; ; i++) {
+      uint32_t m = group_match_free(&h->ctrl[group * GROUP_SIZE]);
+      if(m)
+         return group * GROUP_SIZE + __builtin_ctz(m);
+      group = (group + i) & mask;
+   }
+}
+
+static void set_slot(struct openhash *h, size_t slot, uint64_t hash, uint64_t key, uint32_t value) {
+   if(h->ctrl[slot] == CTRL_EMPTY)
+      h->growth_left--;
+   h->ctrl[slot] = hash & 0x7F;
+   h->keys[slot] = key;
+   h->values[slot] = value;
+   h->size++;
+}
+
+/* Purge tombstones: reinsert all entries in a fresh table of the same size */
+static void openhash_rehash(struct openhash *h) {
+   uint8_t *old_ctrl = h->ctrl;
+   uint64_t *old_keys = h->keys;
+   uint32_t *old_values = h->values;
+   size_t nb_slots = h->nb_groups * GROUP_SIZE;
+
+   openhash_alloc(h);
+   for(size_t i = 0; i < nb_slots; i++) {
+      if(old_ctrl[i] & 0x80)
+         continue;
+      uint64_t hash = mix(old_keys[i]);
+      set_slot(h, find_free_slot(h, hash), hash, old_keys[i], old_values[i]);
+   }
+   h->nb_rehash++;
+
+   free(old_ctrl);
+   free(old_keys);
+   free(old_values);
+}
+
+static int find_slot(struct openhash *h, uint64_t key, size_t *slot) {
+   uint64_t hash = mix(key);
+   uint8_t tag = hash & 0x7F;
+   size_t mask = h->nb_groups - 1;
+   size_t group = (hash >> 7) & mask;
+   for(size_t i = 1; ; i++) {
+      uint8_t *ctrl = &h->ctrl[group * GROUP_SIZE];
+      uint32_t m = group_match(ctrl, tag);
+      while(m) {
+         size_t s = group * GROUP_SIZE + __builtin_ctz(m);
+         if(h->keys[s] == key) {
+            *slot = s;
+            return 1;
+         }
+         m &= m - 1;
+      }
+      if(group_match(ctrl, CTRL_EMPTY))
+         return 0;
+      group = (group + i) & mask;
+   }
+}
+
+int openhash_lookup(struct openhash *h, uint64_t key, uint32_t *value) {
+   size_t slot;
+   if(!find_slot(h, key, &slot))
+      return 0;
+   *value = h->values[slot];
+   return 1;
+}
+
+void openhash_insert(struct openhash *h, uint64_t key, uint32_t value) {
+   assert(h->size < h->capacity);
+   uint64_t hash = mix(key);
+   size_t slot = find_free_slot(h, hash);
+   if(h->ctrl[slot] == CTRL_EMPTY && h->growth_left == 0) {
+      openhash_rehash(h);
+      slot = find_free_slot(h, hash);
+   }
+   set_slot(h, slot, hash, key, value);
+}
+
+int openhash_delete(struct openhash *h, uint64_t key) {
+   size_t slot;
+   if(!find_slot(h, key, &slot))
+      return 0;
+   uint8_t *group = &h->ctrl[slot / GROUP_SIZE * GROUP_SIZE];
+   if(group_match(group, CTRL_EMPTY)) {
+      h->ctrl[slot] = CTRL_EMPTY;
+      h->growth_left++;
+   } else {
+      h->ctrl[slot] = CTRL_DELETED;
+   }
+   h->size--;
+   return 1;
+}
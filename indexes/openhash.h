@@ -0,0 +1,32 @@
+#ifndef OPENHASH_H
+#define OPENHASH_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Fixed capacity open-addressing hash table, uint64_t -> uint32_t.
+ * Used by the page cache (hash of a page -> frame number) where the number of entries is bounded by the number of frames.
+ *
+ * Slots are grouped by 16. Each slot has a 1 byte control tag (empty, deleted, or 7 bits of the hash) and a lookup compares
+ * the 16 tags of a group at once (SSE2), so most lookups touch one cache line of tags and one key.
+ */
+struct openhash {
+   uint8_t *ctrl;       // 1 tag per slot
+   uint64_t *keys;
+   uint32_t *values;
+   size_t nb_groups;    // power of 2
+   size_t capacity;     // maximum number of entries
+   size_t size;         // current number of entries
+   size_t growth_left;  // number of empty slots that can still be consumed before we have to purge the deleted slots
+   size_t nb_rehash;
+};
+
+struct openhash *openhash_create(size_t capacity);
+void openhash_free(struct openhash *h);
+
+int openhash_lookup(struct openhash *h, uint64_t key, uint32_t *value); // returns 1 if found
+void openhash_insert(struct openhash *h, uint64_t key, uint32_t value); // key must not be in the table already
+int openhash_delete(struct openhash *h, uint64_t key);                  // returns 1 if the key was in the table
+
+#endif
@@ -1,4 +1,5 @@
 #include "headers.h"
+#include <errno.h>
 
 /*
  * Asynchronous IO engine.
@@ -21,27 +22,54 @@
  *
  * ASSUMPTIONS:
  *   The page cache is big enough to hold as many pages as concurrent buffered IOs.
+ *
+ * Two kernel interfaces are supported (IO_ENGINE in options.h):
+ *   IO_ENGINE_AIO   - Linux AIO, one io_submit and one io_getevents syscall per loop of the worker.
+ *   IO_ENGINE_URING - io_uring, optionally with a polling kernel thread (URING_SQPOLL), registered files and registered buffers.
+ * Requests are always prepared as iocbs; with io_uring they are translated to sqes at submission time and completions are
+ * translated back to io_events, so the rest of the engine does not care about which interface is used.
+ *
+ * Coalescing: before being submitted, the IOs of a loop of the worker are sorted by file, direction and offset, and runs of contiguous
+ * pages are merged in a single vectored IO (PREADV/PWRITEV, READV/WRITEV with io_uring) of at most IO_MAX_COALESCED_PAGES pages.
+ * This mostly helps bulk loads and appends at the end of a slab, which write consecutive pages. A vectored IO completes all its pages
+ * at once. Vectored IOs do not use registered buffers.
+ *
+ * Priorities: callbacks belong to a class (callback->io_class): point requests, scans or maintenance (compaction, sweeper). IOs are tagged
+ * with the kernel priority of their class (IO_PRIORITIES). When more IOs are pending than the queue depth allows (adaptive queue depth or
+ * NEVER_EXCEED_QUEUE_DEPTH), each class first gets its share of the queue depth (IO_SHARE_*), then the rest goes to point requests first,
+ * so a big batch of scans does not delay the point requests behind it. The other IOs are submitted in the next round of the worker
+ * (they are moved after the submitted ones in the ring, in order).
+ *
+ * Durability: O_DIRECT writes may still sit in the volatile cache of the drive. With DURABILITY_BATCH or DURABILITY_PERIODIC, a write
+ * calls sync_page_async once its page is written, and its callback is only called after an fdatasync (IOCB_CMD_FDSYNC, IORING_OP_FSYNC)
+ * of its file has completed. The sync must be submitted after the write completed, so written callbacks wait until the next loop of the
+ * worker, where one sync per file covers all of them (group commit). A callback linked to a page that is not written yet (see
+ * write_page_async) also waits for that write.
  */
 
 /*
- * Non asynchronous calls to ease some things
+ * Non asynchronous calls to ease some things (size is the page size of the slab, PAGE_SIZE or the size of an extent)
  */
 static __thread char *disk_data;
-void *safe_pread(int fd, off_t offset) {
-   if(!disk_data)
-      disk_data = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
-   int r = pread(fd, disk_data, PAGE_SIZE, offset);
-   if(r != PAGE_SIZE)
-      perr("pread failed! Read %d instead of %lu (offset %lu)\n", r, PAGE_SIZE, offset);
+static __thread size_t disk_data_size;
+void *safe_pread(int fd, off_t offset, size_t size) {
+   if(disk_data_size < size) {
+      free(disk_data);
+      disk_data = aligned_alloc(PAGE_SIZE, size);
+      disk_data_size = size;
+   }
+   int r = pread(fd, disk_data, size, offset);
+   if(r != size)
+      perr("pread failed! Read %d instead of %lu (offset %lu)\n", r, size, offset);
    return disk_data;
 }
 
-void safe_pwrite(int fd, off_t offset, off_t offset_in_page, size_t size, void *data) {
-   char *disk_data = safe_pread(fd, offset);
+void safe_pwrite(int fd, off_t offset, size_t page_size, off_t offset_in_page, size_t size, void *data) {
+   char *disk_data = safe_pread(fd, offset, page_size);
    memcpy(&disk_data[offset_in_page], data, size);
-   int r = pwrite(fd, disk_data, PAGE_SIZE, offset);
-   if(r != PAGE_SIZE)
-      perr("pwrite failed! Wrote %d instead of %lu (offset %lu)\n", r, PAGE_SIZE, offset);
+   int r = pwrite(fd, disk_data, page_size, offset);
+   if(r != page_size)
+      perr("pwrite failed! Wrote %d instead of %lu (offset %lu)\n", r, page_size, offset);
 }
 
 /*
@@ -51,17 +79,51 @@ struct linked_callbacks {
    struct slab_callback *callback;
    struct linked_callbacks *next;
 };
+struct coalesced_io {
+   struct iocb iocb;                                     // The vectored IO, aio_buf points to the iovecs of the pages and aio_data to this structure
+   struct iocb **pages;                                  // The iocbs of the pages, in the order of the iovecs
+   size_t nb_pages;
+   size_t nb_bytes;
+};
+struct synced_callback {
+   struct slab_callback *callback;
+   size_t written_before;                                // The sync can be submitted once sent_io < written_before have completed
+};
+#define MAX_SYNCS MAX_REGISTERED_FILES                   // fdatasyncs per loop of the worker, one per file
 struct io_context {
    int worker_id;
+   int engine;                                           // IO_ENGINE_AIO or IO_ENGINE_URING
    aio_context_t ctx __attribute__((aligned(64)));
+   struct uring ring;
    volatile size_t sent_io;
    volatile size_t processed_io;
    size_t max_pending_io;
-   size_t ios_sent_to_disk;
+   size_t ios_sent_to_disk;                              // Submitted IOs, a coalesced IO counts as one...
+   size_t pages_sent_to_disk;                            // ... but completes all its pages
+   uint64_t submitted_at;
+   struct queue_depth *queue_depth;                      // Shared by the workers of the disk, NULL if the queue depth is not adaptive
    struct iocb *iocb;
    struct iocb **iocbs;
+   struct iocb *scheduled;                               // Pending iocbs reordered by class when they do not all fit in the queue depth
+   char *chosen;                                         // chosen[i] is set if the i-th pending iocb is submitted in this round
+   struct iocb **sorted;                                 // Pending iocbs sorted by file, direction and offset
+   struct iovec *iovecs;                                 // iovecs of the coalesced IOs, iovecs[i] is the buffer of sorted[i]
+   struct coalesced_io *coalesced;
+
+   struct synced_callback *waiting_sync;                 // Written callbacks waiting for the sync of their file
+   size_t nb_waiting_sync, max_waiting_sync;
+   struct slab_callback **syncing;                       // Written callbacks completed by the syncs in flight
+   size_t nb_syncing, max_syncing;
+   struct iocb sync_iocb[MAX_SYNCS];
+   size_t nb_syncs_in_flight;
+   uint64_t last_sync;
    struct io_event *events;
    struct linked_callbacks *linked_callbacks;
+   struct linked_callbacks *free_linked_callbacks;       // Recycled linked_callbacks structures (only used by the worker, no need for a pool)
+
+   int registered_fds[MAX_REGISTERED_FILES];             // io_uring only: registered_fds[i] = fd of fixed file i
+   size_t nb_registered_fds;
+   size_t nb_registered_buffers;                         // io_uring only: page cache buffers pinned once by the kernel
 };
 
 /*
@@ -71,12 +133,103 @@ static int io_setup(unsigned nr, aio_context_t *ctxp) {
 	return syscall(__NR_io_setup, nr, ctxp);
 }
 
+/*
+ * io_uring translation layer
+ */
+static int get_registered_file(struct io_context *ctx, int fd) {
+   for(size_t i = 0; i < ctx->nb_registered_fds; i++)
+      if(ctx->registered_fds[i] == fd)
+         return i;
+   return -1;
+}
+
+/* All IOs are done from/to the page cache, so the registered buffer of an IO is the one of its page */
+static int get_registered_buffer(struct io_context *ctx, struct iocb *cb) {
+   struct slab_callback *callback = (void*)cb->aio_data;
+   if(!ctx->nb_registered_buffers)
+      return -1;
+   return callback->lru_entry->buf_index;
+}
+
+static int is_coalesced_io(struct iocb *cb) {
+   return cb->aio_lio_opcode == IOCB_CMD_PREADV || cb->aio_lio_opcode == IOCB_CMD_PWRITEV;
+}
+
+static void iocb_to_sqe(struct io_context *ctx, struct iocb *cb, struct io_uring_sqe *sqe) {
+   int fixed_file = get_registered_file(ctx, cb->aio_fildes);
+   int fixed_buffer = -1; // vectored IOs and syncs do not use registered buffers
+   if(cb->aio_lio_opcode == IOCB_CMD_PREAD || cb->aio_lio_opcode == IOCB_CMD_PWRITE)
+      fixed_buffer = get_registered_buffer(ctx, cb);
+
+   if(cb->aio_lio_opcode == IOCB_CMD_PREAD)
+      sqe->opcode = (fixed_buffer >= 0)?IORING_OP_READ_FIXED:IORING_OP_READ;
+   else if(cb->aio_lio_opcode == IOCB_CMD_PWRITE)
+      sqe->opcode = (fixed_buffer >= 0)?IORING_OP_WRITE_FIXED:IORING_OP_WRITE;
+   else if(cb->aio_lio_opcode == IOCB_CMD_PREADV)
+      sqe->opcode = IORING_OP_READV; // addr and len are the iovecs and their number, like in the iocb
+   else if(cb->aio_lio_opcode == IOCB_CMD_PWRITEV)
+      sqe->opcode = IORING_OP_WRITEV;
+   else if(cb->aio_lio_opcode == IOCB_CMD_FDSYNC)
+      sqe->opcode = IORING_OP_FSYNC;
+   else
+      die("Unsupported iocb opcode %d\n", cb->aio_lio_opcode);
+
+   if(fixed_file >= 0) {
+      sqe->fd = fixed_file;
+      sqe->flags |= IOSQE_FIXED_FILE;
+   } else {
+      sqe->fd = cb->aio_fildes;
+   }
+   if(fixed_buffer >= 0)
+      sqe->buf_index = fixed_buffer;
+   if(cb->aio_lio_opcode == IOCB_CMD_FDSYNC)
+      sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+   if(cb->aio_flags & IOCB_FLAG_IOPRIO)
+      sqe->ioprio = cb->aio_reqprio;
+   sqe->addr = cb->aio_buf;
+   sqe->len = cb->aio_nbytes;
+   sqe->off = cb->aio_offset;
+   sqe->user_data = (uint64_t)cb;
+}
+
+static int uring_submit_iocbs(struct io_context *ctx, long nr, struct iocb **iocbpp) {
+   for(size_t i = 0; i < nr; i++) {
+      struct io_uring_sqe *sqe = uring_get_sqe(&ctx->ring);
+      if(!sqe)
+         die("io_uring submission queue is full (%lu entries)\n", ctx->max_pending_io);
+      iocb_to_sqe(ctx, iocbpp[i], sqe);
+   }
+   return uring_submit(&ctx->ring);
+}
+
+static int uring_getevents(struct io_context *ctx, long min_nr, long max_nr, struct io_event *events) {
+   long nr = 0;
+   while(nr < max_nr) {
+      struct io_uring_cqe *cqe = uring_peek_cqe(&ctx->ring);
+      if(!cqe) {
+         if(nr >= min_nr)
+            break;
+         int ret = uring_wait_cqes(&ctx->ring, min_nr - nr);
+         if(ret < 0 && ret != -EINTR)
+            return ret;
+         continue;
+      }
+      events[nr].data = 0;
+      events[nr].obj = cqe->user_data;
+      events[nr].res = cqe->res;
+      events[nr].res2 = 0;
+      uring_cqe_seen(&ctx->ring);
+      nr++;
+   }
+   return nr;
+}
+
 #define MAX_STAT 300000
 static __thread size_t queue_length[MAX_STAT];
 static __thread size_t queue_time[MAX_STAT];
 static __thread size_t queue_idx, dumped;
 size_t collect_stats = 0, _print_stats = 0;
-static int io_submit(struct io_context *ctx, long nr, struct iocb **iocbpp) {
+static void record_queue_stats(struct io_context *ctx, long nr) {
    if(collect_stats) {
       uint64_t s;
       rdtscll(s);
@@ -90,33 +243,44 @@ static int io_submit(struct io_context *ctx, long nr, struct iocb **iocbpp) {
       }
       dumped = 1;
    }
+}
+
+static int io_submit(struct io_context *ctx, long nr, struct iocb **iocbpp) {
+   record_queue_stats(ctx, nr);
 
    static __thread declare_periodic_overhead;
    start_periodic_overhead;
    stop_periodic_overhead2(1000, ctx->sent_io, "IO PER SEC", "io_submit");
+   if(ctx->engine == IO_ENGINE_URING)
+      return uring_submit_iocbs(ctx, nr, iocbpp);
 	return syscall(__NR_io_submit, ctx->ctx, nr, iocbpp);
 }
 
 static int io_getevents(struct io_context *ctx, long min_nr, long max_nr,
 		struct io_event *events, struct timespec *timeout) {
-	int nr = syscall(__NR_io_getevents, ctx->ctx, min_nr, max_nr, events, timeout);
-   if(collect_stats) {
-      uint64_t s;
-      rdtscll(s);
-      queue_time[queue_idx] = s;
-      queue_length[queue_idx] = 0;
-      queue_idx++;
-   }
-   if(_print_stats && !dumped) {
-      for(size_t i = 0; i < queue_idx; i++) {
-         printf("%d %lu %lu\n", ctx->worker_id, queue_time[i], queue_length[i]);
-      }
-      dumped = 1;
-   }
+   int nr;
+   if(ctx->engine == IO_ENGINE_URING)
+      nr = uring_getevents(ctx, min_nr, max_nr, events);
+   else
+      nr = syscall(__NR_io_getevents, ctx->ctx, min_nr, max_nr, events, timeout);
+   record_queue_stats(ctx, 0);
    return nr;
 }
 
 
+static struct linked_callbacks *new_linked_callback(struct io_context *ctx) {
+   struct linked_callbacks *linked_cb = ctx->free_linked_callbacks;
+   if(!linked_cb)
+      return malloc(sizeof(*linked_cb));
+   ctx->free_linked_callbacks = linked_cb->next;
+   return linked_cb;
+}
+
+static void free_linked_callback(struct io_context *ctx, struct linked_callbacks *linked_cb) {
+   linked_cb->next = ctx->free_linked_callbacks;
+   ctx->free_linked_callbacks = linked_cb;
+}
+
 /*
  * After completing IOs we need to call all the "linked callbacks", i.e., reads done to a page that was already in the process of being fetched.
  */
@@ -134,7 +298,7 @@ static void process_linked_callbacks(struct io_context *ctx) {
          struct slab_callback *callback = linked_cb->callback;
          if(callback->lru_entry->contains_data) {
             callback->io_cb(callback);
-            free(linked_cb);
+            free_linked_callback(ctx, linked_cb);
          } else { // page has not been prefetched yet, it's likely in the list of pages that will be read during the next kernel call
             linked_cb->next = ctx->linked_callbacks;
             ctx->linked_callbacks = linked_cb; // re-link our callback
@@ -145,17 +309,193 @@ static void process_linked_callbacks(struct io_context *ctx) {
    } stop_debug_timer(10000, "%lu linked callbacks\n", nb_linked);
 }
 
+/*
+ * Merge the runs of contiguous pages of ctx->iocbs[0..pending[ in vectored IOs.
+ * ctx->iocbs then contains the IOs to submit, the function returns their number.
+ */
+static int compare_iocbs(const void *a, const void *b) {
+   const struct iocb *x = *(struct iocb **)a, *y = *(struct iocb **)b;
+   if(x->aio_fildes != y->aio_fildes)
+      return (x->aio_fildes < y->aio_fildes)?-1:1;
+   if(x->aio_lio_opcode != y->aio_lio_opcode)
+      return (x->aio_lio_opcode < y->aio_lio_opcode)?-1:1;
+   if(x->aio_reqprio != y->aio_reqprio)
+      return (x->aio_reqprio < y->aio_reqprio)?-1:1;
+   if(x->aio_offset != y->aio_offset)
+      return (x->aio_offset < y->aio_offset)?-1:1;
+   return 0;
+}
+
+static int are_contiguous(struct iocb *prev, struct iocb *next) {
+   return prev->aio_fildes == next->aio_fildes
+      && prev->aio_lio_opcode == next->aio_lio_opcode
+      && prev->aio_reqprio == next->aio_reqprio
+      && prev->aio_offset + prev->aio_nbytes == next->aio_offset;
+}
+
+static size_t coalesce_ios(struct io_context *ctx, size_t pending) {
+   if(IO_MAX_COALESCED_PAGES <= 1 || pending < 2)
+      return pending;
+
+   memcpy(ctx->sorted, ctx->iocbs, pending*sizeof(*ctx->sorted));
+   qsort(ctx->sorted, pending, sizeof(*ctx->sorted), compare_iocbs);
+
+   size_t nb_ios = 0, nb_coalesced = 0;
+   for(size_t first = 0, last; first < pending; first = last) {
+      for(last = first + 1; last < pending && last - first < IO_MAX_COALESCED_PAGES; last++)
+         if(!are_contiguous(ctx->sorted[last - 1], ctx->sorted[last]))
+            break;
+      if(last - first == 1) {
+         ctx->iocbs[nb_ios++] = ctx->sorted[first];
+         continue;
+      }
+
+      struct coalesced_io *c = &ctx->coalesced[nb_coalesced++];
+      c->pages = &ctx->sorted[first];
+      c->nb_pages = last - first;
+      c->nb_bytes = 0;
+      for(size_t i = first; i < last; i++) {
+         ctx->iovecs[i].iov_base = (void*)ctx->sorted[i]->aio_buf;
+         ctx->iovecs[i].iov_len = ctx->sorted[i]->aio_nbytes;
+         c->nb_bytes += ctx->sorted[i]->aio_nbytes;
+      }
+      memset(&c->iocb, 0, sizeof(c->iocb));
+      c->iocb.aio_fildes = ctx->sorted[first]->aio_fildes;
+      c->iocb.aio_lio_opcode = (ctx->sorted[first]->aio_lio_opcode == IOCB_CMD_PREAD)?IOCB_CMD_PREADV:IOCB_CMD_PWRITEV;
+      c->iocb.aio_flags = ctx->sorted[first]->aio_flags;
+      c->iocb.aio_reqprio = ctx->sorted[first]->aio_reqprio;
+      c->iocb.aio_buf = (uint64_t)&ctx->iovecs[first];
+      c->iocb.aio_nbytes = c->nb_pages; // number of iovecs
+      c->iocb.aio_offset = ctx->sorted[first]->aio_offset;
+      c->iocb.aio_data = (uint64_t)c;
+      ctx->iocbs[nb_ios++] = &c->iocb;
+   }
+   return nb_ios;
+}
+
+/*
+ * Syncs: add one fdatasync per file of the written callbacks that can be synced to ctx->iocbs.
+ */
+static int sync_is_due(struct io_context *ctx) {
+   if(!ctx->nb_waiting_sync)
+      return 0;
+   if(DURABILITY_MODE == DURABILITY_PERIODIC) {
+      uint64_t now;
+      rdtscll(now);
+      if(cycles_to_us(now - ctx->last_sync) < DURABILITY_SYNC_INTERVAL_US)
+         return 0;
+   }
+   return 1;
+}
+
+static int add_synced_file(struct io_context *ctx, int fd) {
+   for(size_t i = 0; i < ctx->nb_syncs_in_flight; i++)
+      if(ctx->sync_iocb[i].aio_fildes == fd)
+         return 1;
+   if(ctx->nb_syncs_in_flight == MAX_SYNCS)
+      return 0; // synced next time
+   struct iocb *_iocb = &ctx->sync_iocb[ctx->nb_syncs_in_flight++];
+   memset(_iocb, 0, sizeof(*_iocb));
+   _iocb->aio_fildes = fd;
+   _iocb->aio_lio_opcode = IOCB_CMD_FDSYNC;
+   return 1;
+}
+
+static size_t add_syncs(struct io_context *ctx, size_t nb_ios) {
+   if(!sync_is_due(ctx))
+      return nb_ios;
+
+   size_t nb_left = 0;
+   for(size_t i = 0; i < ctx->nb_waiting_sync; i++) {
+      struct synced_callback *w = &ctx->waiting_sync[i];
+      if(w->written_before > ctx->processed_io || !add_synced_file(ctx, w->callback->slab->fd)) {
+         ctx->waiting_sync[nb_left++] = *w;
+         continue;
+      }
+      if(ctx->nb_syncing == ctx->max_syncing) {
+         ctx->max_syncing = ctx->max_syncing?2*ctx->max_syncing:64;
+         ctx->syncing = realloc(ctx->syncing, ctx->max_syncing*sizeof(*ctx->syncing));
+      }
+      ctx->syncing[ctx->nb_syncing++] = w->callback;
+   }
+   ctx->nb_waiting_sync = nb_left;
+
+   for(size_t i = 0; i < ctx->nb_syncs_in_flight; i++)
+      ctx->iocbs[nb_ios++] = &ctx->sync_iocb[i];
+   rdtscll(ctx->last_sync);
+   return nb_ios;
+}
+
+/*
+ * Priorities: choose the pending IOs submitted in this round, and move them at the beginning of the pending IOs in the ring.
+ * The writes of pages that are not in the checkpoint log yet are never chosen. Returns the number of IOs to submit.
+ */
+static enum io_class get_io_class(struct iocb *cb) {
+   struct slab_callback *callback = (void*)cb->aio_data;
+   return callback->io_class;
+}
+
+/* The write of a page of a slab waits until the page is in the checkpoint log (see checkpoint.c) */
+static int is_ready(struct iocb *cb) {
+   struct slab_callback *callback = (void*)cb->aio_data;
+   if(cb->aio_lio_opcode != IOCB_CMD_PWRITE || !callback->slab->checkpoint)
+      return 1;
+   return checkpoint_page_logged(callback->slab, cb->aio_offset / callback->slab->page_size);
+}
+
+#define NOT_READY 2 // value of chosen[i] for the IOs that are not ready
+
+static size_t schedule_ios(struct io_context *ctx, size_t pending) {
+   size_t limit = NEVER_EXCEED_QUEUE_DEPTH?QUEUE_DEPTH:queue_depth_budget(ctx->queue_depth); // -1 if the queue depth is not adaptive
+   char *chosen = ctx->chosen;
+   size_t nb_ready = 0;
+   for(size_t i = 0; i < pending; i++) {
+      chosen[i] = is_ready(&ctx->iocb[(ctx->processed_io + i)%ctx->max_pending_io])?0:NOT_READY;
+      nb_ready += !chosen[i];
+   }
+   if(nb_ready == pending && pending <= limit)
+      return pending;
+
+   size_t shares[NB_IO_CLASSES] = { [IO_CLASS_POINT] = IO_SHARE_POINT, [IO_CLASS_SCAN] = IO_SHARE_SCAN, [IO_CLASS_MAINTENANCE] = IO_SHARE_MAINTENANCE };
+   size_t quotas[NB_IO_CLASSES], nb_scheduled = 0;
+   for(size_t c = 0; c < NB_IO_CLASSES; c++)
+      quotas[c] = limit * shares[c] / 100 + 1;
+
+   /* Each class gets its share, then the rest by order of priority */
+   for(size_t i = 0; i < pending && nb_scheduled < limit; i++) {
+      enum io_class c = get_io_class(&ctx->iocb[(ctx->processed_io + i)%ctx->max_pending_io]);
+      if(!chosen[i] && quotas[c]) {
+         quotas[c]--;
+         chosen[i] = 1;
+         nb_scheduled++;
+      }
+   }
+   for(size_t c = 0; c < NB_IO_CLASSES; c++) {
+      for(size_t i = 0; i < pending && nb_scheduled < limit; i++) {
+         if(!chosen[i] && get_io_class(&ctx->iocb[(ctx->processed_io + i)%ctx->max_pending_io]) == c) {
+            chosen[i] = 1;
+            nb_scheduled++;
+         }
+      }
+   }
+
+   /* Chosen IOs first, then the others, in order */
+   size_t nb_moved = 0;
+   for(int pass = 1; pass >= 0; pass--)
+      for(size_t i = 0; i < pending; i++)
+         if((chosen[i] == 1) == pass)
+            ctx->scheduled[nb_moved++] = ctx->iocb[(ctx->processed_io + i)%ctx->max_pending_io];
+   for(size_t i = 0; i < pending; i++)
+      ctx->iocb[(ctx->processed_io + i)%ctx->max_pending_io] = ctx->scheduled[i];
+   return nb_scheduled;
+}
+
 /*
  * Loop executed by worker threads
  */
 static void worker_do_io(struct io_context *ctx) {
    size_t pending = ctx->sent_io - ctx->processed_io;
-   if(pending == 0) {
-      ctx->ios_sent_to_disk = 0;
-      return;
-   }
-   /*if(pending > QUEUE_DEPTH)
-      pending = QUEUE_DEPTH;*/
+   pending = schedule_ios(ctx, pending); // the other IOs wait for the next round
 
    for(size_t i = 0; i < pending; i++) {
       struct slab_callback *callback;
@@ -168,23 +508,43 @@ static void worker_do_io(struct io_context *ctx) {
                                        //              |                           write page (no IO order because dirty = 1, see write_page_async "if(lru_entry->dirty)" condition)
                                        //        complete ios
                                        //        (old value written to disk)
+      if(ctx->iocbs[i]->aio_lio_opcode == IOCB_CMD_PWRITE)
+         callback->lru_entry->nb_writes++; // ... but the page is still busy until the write completes
 
       add_time_in_payload(callback, 3);
    }
 
    // Submit requests to the kernel
-   int ret = io_submit(ctx, pending, ctx->iocbs);
-   if (ret != pending)
-      perr("Couldn't submit all io requests! %d submitted / %lu (%lu sent, %lu processed)\n", ret, pending, ctx->sent_io, ctx->processed_io);
+   size_t nb_ios = coalesce_ios(ctx, pending);
+   nb_ios = add_syncs(ctx, nb_ios);
+   if(nb_ios == 0) {
+      ctx->ios_sent_to_disk = 0;
+      ctx->pages_sent_to_disk = 0;
+      return;
+   }
+   int ret = io_submit(ctx, nb_ios, ctx->iocbs);
+   if (ret != nb_ios)
+      perr("Couldn't submit all io requests! %d submitted / %lu (%lu pages, %lu sent, %lu processed)\n", ret, nb_ios, pending, ctx->sent_io, ctx->processed_io);
    ctx->ios_sent_to_disk = ret;
+   ctx->pages_sent_to_disk = pending;
+   queue_depth_submitted(ctx->queue_depth, pending);
+   rdtscll(ctx->submitted_at);
 }
 
 
 /* We need a unique hash for each page for the page cache */
-static uint64_t get_hash_for_page(int fd, uint64_t page_num) {
+uint64_t get_hash_for_page(int fd, uint64_t page_num) {
    return (((uint64_t)fd)<<40LU)+page_num; // Works for files less than 40EB
 }
 
+static void set_io_priority(struct iocb *_iocb, struct slab_callback *callback) {
+   static const uint16_t priorities[NB_IO_CLASSES] = { [IO_CLASS_POINT] = IO_PRIO_POINT, [IO_CLASS_SCAN] = IO_PRIO_SCAN, [IO_CLASS_MAINTENANCE] = IO_PRIO_MAINTENANCE };
+   if(!IO_PRIORITIES)
+      return;
+   _iocb->aio_flags |= IOCB_FLAG_IOPRIO;
+   _iocb->aio_reqprio = priorities[callback->io_class];
+}
+
 /* Enqueue a request to read a page */
 char *read_page_async(struct slab_callback *callback) {
    int alread_used;
@@ -194,7 +554,10 @@ char *read_page_async(struct slab_callback *callback) {
    struct io_context *ctx = get_io_context(callback->slab->ctx);
    uint64_t hash = get_hash_for_page(callback->slab->fd, page_num);
 
-   alread_used = get_page(get_pagecache(callback->slab->ctx), hash, &disk_page, &lru_entry);
+   int one_shot = (callback->action == READ_NEXT_BATCH || callback->action == READ_NEXT_BATCH_CLONE); // scans should not evict the working set
+   if(!callback->slab->pagecache)
+      callback->slab->pagecache = get_pagecache(callback->slab->ctx, callback->slab->page_size);
+   alread_used = get_page(callback->slab->pagecache, hash, one_shot, &disk_page, &lru_entry);
    callback->lru_entry = lru_entry;
    if(lru_entry->contains_data) {   // content is cached already
       callback->io_cb(callback);       // call the callback directly
@@ -202,7 +565,7 @@ char *read_page_async(struct slab_callback *callback) {
    }
 
    if(alread_used) { // Somebody else is already prefetching the same page!
-      struct linked_callbacks *linked_cb = malloc(sizeof(*linked_cb));
+      struct linked_callbacks *linked_cb = new_linked_callback(ctx);
       linked_cb->callback = callback;
       linked_cb->next = ctx->linked_callbacks;
       ctx->linked_callbacks = linked_cb; // link our callback
@@ -216,8 +579,9 @@ char *read_page_async(struct slab_callback *callback) {
    _iocb->aio_lio_opcode = IOCB_CMD_PREAD;
    _iocb->aio_buf = (uint64_t)disk_page;
    _iocb->aio_data = (uint64_t)callback;
-   _iocb->aio_offset = page_num * PAGE_SIZE;
-   _iocb->aio_nbytes = PAGE_SIZE;
+   set_io_priority(_iocb, callback);
+   _iocb->aio_offset = page_num * callback->slab->page_size;
+   _iocb->aio_nbytes = callback->slab->page_size; // 1 IO per page, or per extent for items bigger than a page
    if(ctx->sent_io - ctx->processed_io >= ctx->max_pending_io)
       die("Sent %lu ios, processed %lu (> %lu waiting), IO buffer is too full!\n", ctx->sent_io, ctx->processed_io, ctx->max_pending_io);
    ctx->sent_io++;
@@ -243,8 +607,7 @@ char *write_page_async(struct slab_callback *callback) {
    }
 
    if(lru_entry->dirty) { // this is the second time we write the page, which means it already has been queued for writting
-      struct linked_callbacks *linked_cb;
-      linked_cb = malloc(sizeof(*linked_cb));
+      struct linked_callbacks *linked_cb = new_linked_callback(ctx);
       linked_cb->callback = callback;
       linked_cb->next = ctx->linked_callbacks;
       ctx->linked_callbacks = linked_cb; // link our callback
@@ -252,6 +615,8 @@ char *write_page_async(struct slab_callback *callback) {
    }
 
    lru_entry->dirty = 1;
+   if(callback->slab->checkpoint)
+      checkpoint_page_dirtied(callback->slab, page_num);
 
    int buffer_idx = ctx->sent_io % ctx->max_pending_io;
    struct iocb *_iocb = &ctx->iocb[buffer_idx];
@@ -260,8 +625,9 @@ char *write_page_async(struct slab_callback *callback) {
    _iocb->aio_lio_opcode = IOCB_CMD_PWRITE;
    _iocb->aio_buf = (uint64_t)disk_page;
    _iocb->aio_data = (uint64_t)callback;
-   _iocb->aio_offset = page_num * PAGE_SIZE;
-   _iocb->aio_nbytes = PAGE_SIZE;
+   set_io_priority(_iocb, callback);
+   _iocb->aio_offset = page_num * callback->slab->page_size;
+   _iocb->aio_nbytes = callback->slab->page_size; // 1 IO per page, or per extent for items bigger than a page
    if(ctx->sent_io - ctx->processed_io >= ctx->max_pending_io)
       die("Sent %lu ios, processed %lu (> %lu waiting), IO buffer is too full!\n", ctx->sent_io, ctx->processed_io, ctx->max_pending_io);
    ctx->sent_io++;
@@ -270,6 +636,23 @@ char *write_page_async(struct slab_callback *callback) {
    return NULL;
 }
 
+/* Call callback->io_cb once the page written by the callback is durable, see DURABILITY_MODE */
+void sync_page_async(struct slab_callback *callback) {
+   if(DURABILITY_MODE == DURABILITY_NONE) {
+      callback->io_cb(callback);
+      return;
+   }
+
+   struct io_context *ctx = get_io_context(callback->slab->ctx);
+   if(ctx->nb_waiting_sync == ctx->max_waiting_sync) {
+      ctx->max_waiting_sync = ctx->max_waiting_sync?2*ctx->max_waiting_sync:64;
+      ctx->waiting_sync = realloc(ctx->waiting_sync, ctx->max_waiting_sync*sizeof(*ctx->waiting_sync));
+   }
+   struct synced_callback *w = &ctx->waiting_sync[ctx->nb_waiting_sync++];
+   w->callback = callback;
+   w->written_before = callback->lru_entry->dirty?ctx->sent_io:0; // linked callback, the page has not been written yet
+}
+
 /*
  * Init an IO worker
  */
@@ -283,16 +666,89 @@ struct io_context *worker_ioengine_init(int id, size_t nb_callbacks) {
       ctx->max_pending_io = nb_callbacks * 2;
    }
    ctx->iocb = calloc(ctx->max_pending_io, sizeof(*ctx->iocb));
-   ctx->iocbs = calloc(ctx->max_pending_io, sizeof(*ctx->iocbs));
-   ctx->events = calloc(ctx->max_pending_io, sizeof(*ctx->events));
+   ctx->iocbs = calloc(ctx->max_pending_io + MAX_SYNCS, sizeof(*ctx->iocbs));
+   ctx->scheduled = calloc(ctx->max_pending_io, sizeof(*ctx->scheduled));
+   ctx->chosen = calloc(ctx->max_pending_io, sizeof(*ctx->chosen));
+   ctx->sorted = calloc(ctx->max_pending_io, sizeof(*ctx->sorted));
+   ctx->iovecs = calloc(ctx->max_pending_io, sizeof(*ctx->iovecs));
+   ctx->coalesced = calloc(ctx->max_pending_io / 2, sizeof(*ctx->coalesced)); // a coalesced IO has at least 2 pages
+   ctx->events = calloc(ctx->max_pending_io + MAX_SYNCS, sizeof(*ctx->events));
+
+   ctx->queue_depth = get_queue_depth(id / (get_nb_workers()/get_nb_disks()));
+
+   ctx->engine = IO_ENGINE;
+   if(ctx->engine == IO_ENGINE_URING) {
+      ret = uring_init(&ctx->ring, ctx->max_pending_io + MAX_SYNCS, URING_SQPOLL, URING_SQPOLL_IDLE_MS);
+      if(ret == -ENOSYS || ret == -EPERM) {
+         printf("#WARNING: io_uring is not available (%s), worker %d falls back to Linux AIO\n", strerror(-ret), id);
+         ctx->engine = IO_ENGINE_AIO;
+      } else if(ret < 0) {
+         die("Cannot create io_uring (%s)\n", strerror(-ret));
+      } else if(URING_REGISTERED_FILES) {
+         int fds[MAX_REGISTERED_FILES];
+         for(size_t i = 0; i < MAX_REGISTERED_FILES; i++)
+            fds[i] = -1; // sparse set, filled by ioengine_register_file
+         ret = uring_register_files(&ctx->ring, fds, MAX_REGISTERED_FILES);
+         if(ret < 0)
+            printf("#WARNING: cannot register files with io_uring (%s)\n", strerror(-ret));
+      }
+   }
 
-   ret = io_setup(ctx->max_pending_io, &ctx->ctx);
-   if(ret < 0)
-      perr("Cannot create aio setup\n");
+   if(ctx->engine == IO_ENGINE_AIO) {
+      ret = io_setup(ctx->max_pending_io + MAX_SYNCS, &ctx->ctx);
+      if(ret < 0)
+         perr("Cannot create aio setup\n");
+   }
 
    return ctx;
 }
 
+/*
+ * Registered files: a file is registered once and IOs then use its index in the registered set.
+ * @return the index of the file or -1 if it cannot be registered (e.g., AIO engine). IOs on non registered files still work.
+ */
+int ioengine_register_file(struct io_context *ctx, int fd) {
+   if(ctx->engine != IO_ENGINE_URING || !URING_REGISTERED_FILES)
+      return -1;
+   if(ctx->nb_registered_fds >= MAX_REGISTERED_FILES) {
+      printf("#WARNING: worker %d cannot register more than %d files, increase MAX_REGISTERED_FILES\n", ctx->worker_id, MAX_REGISTERED_FILES);
+      return -1;
+   }
+
+   size_t slot = ctx->nb_registered_fds;
+   int ret = uring_update_file(&ctx->ring, slot, fd);
+   if(ret < 0) {
+      printf("#WARNING: cannot register file %d with io_uring (%s)\n", fd, strerror(-ret));
+      return -1;
+   }
+   ctx->registered_fds[slot] = fd;
+   ctx->nb_registered_fds++;
+   return slot;
+}
+
+/*
+ * Registered buffers: the memory is pinned once, reads and writes to a page of buffers[i] then use the _FIXED opcodes with buf_index = i.
+ * Can only be called once per worker.
+ */
+void ioengine_register_buffers(struct io_context *ctx, struct iovec *buffers, size_t nb_buffers) {
+   if(ctx->engine != IO_ENGINE_URING || !URING_REGISTERED_BUFFERS)
+      return;
+   assert(!ctx->nb_registered_buffers);
+
+   int ret = uring_register_buffers(&ctx->ring, buffers, nb_buffers);
+   if(ret < 0) { // most likely RLIMIT_MEMLOCK, not fatal
+      printf("#WARNING: cannot register %lu buffers with io_uring (%s), check ulimit -l\n", nb_buffers, strerror(-ret));
+      return;
+   }
+   ctx->nb_registered_buffers = nb_buffers;
+}
+
+const char *ioengine_name(struct io_context *ctx) {
+   if(ctx->engine == IO_ENGINE_URING)
+      return URING_SQPOLL?"io_uring (sqpoll)":"io_uring";
+   return "aio";
+}
+
 /* Enqueue requests */
 void worker_ioengine_enqueue_ios(struct io_context *ctx) {
    worker_do_io(ctx); // Process IO queue
@@ -311,9 +767,22 @@ void worker_ioengine_get_completed_ios(struct io_context *ctx) {
       if(ret != ctx->ios_sent_to_disk)
          die("Problem: only got %d answers out of %lu enqueued IO requests\n", ret, ctx->ios_sent_to_disk);
    } stop_debug_timer(10000, "io_getevents took more than 10ms!!");
+
+   uint64_t now;
+   rdtscll(now);
+   queue_depth_completed(ctx->queue_depth, ctx->pages_sent_to_disk, cycles_to_us(now - ctx->submitted_at)); // all the IOs of the batch waited for the slowest one
 }
 
 
+static void complete_page_io(struct iocb *cb) {
+   struct slab_callback *callback = (void*)cb->aio_data;
+   callback->lru_entry->contains_data = 1;
+   //callback->lru_entry->dirty = 0; // done before
+   if(cb->aio_lio_opcode == IOCB_CMD_PWRITE)
+      callback->lru_entry->nb_writes--;
+   callback->io_cb(callback);
+}
+
 void worker_ioengine_process_completed_ios(struct io_context *ctx) {
    int ret = ctx->ios_sent_to_disk;
    declare_debug_timer;
@@ -326,11 +795,26 @@ void worker_ioengine_process_completed_ios(struct io_context *ctx) {
       // Enqueue completed IO requests
       for(size_t i = 0; i < ret; i++) {
          struct iocb *cb = (void*)ctx->events[i].obj;
-         struct slab_callback *callback = (void*)cb->aio_data;
-         assert(ctx->events[i].res == 4096); // otherwise page hasn't been read
-         callback->lru_entry->contains_data = 1;
-         //callback->lru_entry->dirty = 0; // done before
-         callback->io_cb(callback);
+         if(cb->aio_lio_opcode == IOCB_CMD_FDSYNC) {
+            if(ctx->events[i].res != 0)
+               die("fdatasync failed (%s)\n", strerror(-ctx->events[i].res));
+            ctx->nb_syncs_in_flight--;
+         } else if(is_coalesced_io(cb)) {
+            struct coalesced_io *c = (void*)cb->aio_data;
+            assert(ctx->events[i].res == c->nb_bytes); // otherwise pages haven't been read
+            for(size_t j = 0; j < c->nb_pages; j++)
+               complete_page_io(c->pages[j]);
+         } else {
+            assert(ctx->events[i].res == cb->aio_nbytes); // otherwise page hasn't been read
+            complete_page_io(cb);
+         }
+      }
+
+      // All the syncs have completed, the callbacks they covered are durable
+      if(!ctx->nb_syncs_in_flight) {
+         for(size_t i = 0; i < ctx->nb_syncing; i++)
+            ctx->syncing[i]->io_cb(ctx->syncing[i]);
+         ctx->nb_syncing = 0;
       }
 
       // We might have "linked callbacks" so process them
@@ -338,9 +822,14 @@ void worker_ioengine_process_completed_ios(struct io_context *ctx) {
    } stop_debug_timer(10000, "rest of worker_ioengine_process_completed_ios (%d requests)", ret);
 
    // Ok, now the main thread can push more requests
-   ctx->processed_io += ctx->ios_sent_to_disk;
+   ctx->processed_io += ctx->pages_sent_to_disk;
 }
 
 int io_pending(struct io_context *ctx) {
-   return ctx->sent_io - ctx->processed_io;
+   return ctx->sent_io - ctx->processed_io + sync_is_due(ctx);
+}
+
+/* Written callbacks waiting for a sync that is not due yet (DURABILITY_PERIODIC) */
+int io_waiting_for_sync(struct io_context *ctx) {
+   return ctx->nb_waiting_sync;
 }
@@ -3,15 +3,21 @@
 
 
 struct io_context *worker_ioengine_init(int id, size_t nb_callbacks);
+int ioengine_register_file(struct io_context *ctx, int fd);
+void ioengine_register_buffers(struct io_context *ctx, struct iovec *buffers, size_t nb_buffers);
+const char *ioengine_name(struct io_context *ctx);
 
-void *safe_pread(int fd, off_t offset);
-void safe_pwrite(int fd, off_t offset, off_t offset_in_page, size_t size, void *data);
+void *safe_pread(int fd, off_t offset, size_t size);
+void safe_pwrite(int fd, off_t offset, size_t page_size, off_t offset_in_page, size_t size, void *data);
 
 typedef void (io_cb_t)(struct slab_callback *);
 char *read_page_async(struct slab_callback *cb);
 char *write_page_async(struct slab_callback *cb);
+void sync_page_async(struct slab_callback *cb);
+uint64_t get_hash_for_page(int fd, uint64_t page_num); // hash of the page in the page cache, see write_page_async
 
 int io_pending(struct io_context *ctx);
+int io_waiting_for_sync(struct io_context *ctx);
 
 void worker_ioengine_enqueue_ios(struct io_context *ctx);
 void worker_ioengine_get_completed_ios(struct io_context *ctx);
@@ -1,4 +1,5 @@
 #include "headers.h"
+#include <time.h>
 
 /*
  * KVell stores binary data, but we want to store integers, sets and hashes. These functions serialize / deserialize data for KVell.
@@ -34,15 +35,100 @@ uint64_t item_get_rdt(char *item) {
 
 size_t get_item_size(char *item) {
    struct item_metadata *meta = (struct item_metadata *)item;
+   if(meta->value_size == TOMBSTONE_VALUE_SIZE)
+      return sizeof(*meta) + meta->key_size;
+   if(meta->value_size & ITEM_HAS_TTL)
+      return sizeof(*meta) + meta->key_size + (meta->value_size & ~ITEM_HAS_TTL) + sizeof(uint64_t);
    return sizeof(*meta) + meta->key_size + meta->value_size;
 }
 
+int item_is_tombstone(char *item) {
+   struct item_metadata *meta = (void*)item;
+   return meta->value_size == TOMBSTONE_VALUE_SIZE;
+}
+
+/*
+ * Expired items are not returned to requests and are reclaimed in the background (see sweeper.c).
+ * Expiration times are absolute so that they survive restarts.
+ */
+static char *item_set_expires(char *item, uint64_t expires) {
+   struct item_metadata *meta = (void*)item;
+   size_t size = sizeof(*meta) + meta->key_size + item_get_value_size(item);
+   if(!expires) {
+      meta->value_size &= ~ITEM_HAS_TTL;
+      return item;
+   }
+   item = realloc(item, size + sizeof(expires));
+   meta = (void*)item;
+   meta->value_size |= ITEM_HAS_TTL;
+   memcpy(&item[size], &expires, sizeof(expires));
+   return item;
+}
+
+char *item_set_ttl(char *item, uint64_t seconds) {
+   return item_set_expires(item, seconds?time(NULL) + seconds:0);
+}
+
+uint64_t item_get_expires(char *item) {
+   struct item_metadata *meta = (void*)item;
+   uint64_t expires;
+   if(meta->value_size == TOMBSTONE_VALUE_SIZE || !(meta->value_size & ITEM_HAS_TTL))
+      return 0;
+   memcpy(&expires, &item[get_item_size(item) - sizeof(expires)], sizeof(expires));
+   return expires;
+}
+
 
 uint64_t item_get_key(char *item) {
    char *item_key = &item[sizeof(struct item_metadata)];
    return *(uint64_t*)item_key;
 }
 
+/*
+ * Fingerprint of the key, used to shard items between workers and to index them.
+ * Keys of 8 bytes or less are their own fingerprint (so integer keys keep their order for scans), longer keys are hashed.
+ * Different keys may have the same fingerprint, see in-memory-index.c.
+ */
+static uint64_t mix64(uint64_t h) {
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdLU;
+   h ^= h >> 33;
+   h *= 0xc4ceb9fe1a85ec53LU;
+   h ^= h >> 33;
+   return h;
+}
+
+uint64_t item_get_key_hash(char *item) {
+   struct item_metadata *meta = (void*)item;
+   char *item_key = &item[sizeof(*meta)];
+   uint64_t hash = 0;
+   if(meta->key_size <= sizeof(hash)) {
+      memcpy(&hash, item_key, meta->key_size);
+      return hash;
+   }
+
+   hash = meta->key_size;
+   for(size_t i = 0; i < meta->key_size; i += sizeof(uint64_t)) {
+      uint64_t word = 0;
+      memcpy(&word, &item_key[i], (meta->key_size - i < sizeof(word))?(meta->key_size - i):sizeof(word));
+      hash = mix64(hash ^ word);
+   }
+   return hash;
+}
+
+/* The fingerprint of an 8B key is the key itself: two 8B keys that have the same fingerprint are the same key */
+int item_key_is_fingerprint(char *item) {
+   struct item_metadata *meta = (void*)item;
+   return meta->key_size == sizeof(uint64_t);
+}
+
+int item_keys_match(char *item1, char *item2) {
+   struct item_metadata *meta1 = (void*)item1, *meta2 = (void*)item2;
+   if(meta1->key_size != meta2->key_size)
+      return 0;
+   return !memcmp(&item1[sizeof(*meta1)], &item2[sizeof(*meta2)], meta1->key_size);
+}
+
 void* item_get_value(char *item) {
    struct item_metadata *meta = (void*)item;
    char *item_value = &item[sizeof(*meta) + meta->key_size];
@@ -51,7 +137,9 @@ void* item_get_value(char *item) {
 
 uint64_t item_get_value_size(char *item) {
    struct item_metadata *meta = (void*)item;
-   return meta->value_size;
+   if(meta->value_size == TOMBSTONE_VALUE_SIZE)
+      return meta->value_size;
+   return meta->value_size & ~ITEM_HAS_TTL;
 }
 
 
@@ -104,18 +192,19 @@ char *add_smember(char *old_item, uint64_t val, int free_item) {
    struct smember *new_set;
 
    old_meta = (struct item_metadata *)old_item;
-   old_item_size = sizeof(struct item_metadata) + old_meta->key_size + old_meta->value_size;
+   old_item_size = sizeof(struct item_metadata) + old_meta->key_size + item_get_value_size(old_item);
 
    new_item_size = old_item_size + sizeof(val);
    new_item = malloc(new_item_size);
    memcpy(new_item, old_item, old_item_size);
 
    new_meta = (struct item_metadata *)new_item;
-   new_meta->value_size += new_item_size - old_item_size;
+   new_meta->value_size = item_get_value_size(old_item) + new_item_size - old_item_size;
 
    new_set = get_smember(new_item);
    new_set->elements[new_set->nb_elements] = val;
    new_set->nb_elements++;
+   new_item = item_set_expires(new_item, item_get_expires(old_item));
 
    if(free_item)
       free(old_item);
@@ -230,14 +319,14 @@ char *add_shash_element(char *old_item, int column, void *value, size_t value_si
    struct selement *new_element;
 
    old_meta = (struct item_metadata *)old_item;
-   old_item_size = sizeof(struct item_metadata) + old_meta->key_size + old_meta->value_size;
+   old_item_size = sizeof(struct item_metadata) + old_meta->key_size + item_get_value_size(old_item);
 
    new_item_size = old_item_size + sizeof(struct selement) + value_size;
    new_item = calloc(1, new_item_size);
    memcpy(new_item, old_item, old_item_size);
 
    new_meta = (struct item_metadata *)new_item;
-   new_meta->value_size += new_item_size - old_item_size;
+   new_meta->value_size = item_get_value_size(old_item) + new_item_size - old_item_size;
 
    new_hash = get_shash(new_item);
    new_element = _get_shash_element(new_item, column, 1);
@@ -246,6 +335,7 @@ char *add_shash_element(char *old_item, int column, void *value, size_t value_si
    new_element->size = value_size;
    memcpy(new_element->value, value, value_size);
    new_hash->nb_elements++;
+   new_item = item_set_expires(new_item, item_get_expires(old_item));
 
    if(free_item)
       free(old_item);
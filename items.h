@@ -11,14 +11,32 @@
 struct item_metadata {
    size_t rdt;
    size_t key_size;
-   size_t value_size;
+   size_t value_size;   // with ITEM_HAS_TTL if the item expires
    // key
    // value
+   // expiration time (uint64_t), only if value_size has ITEM_HAS_TTL
 };
 
+/*
+ * Deleting a key writes a tombstone: an item that contains the key and no value, with value_size == TOMBSTONE_VALUE_SIZE (see slab.c).
+ */
+#define TOMBSTONE_VALUE_SIZE ((size_t)-1)
+
+/*
+ * Items with a TTL have ITEM_HAS_TTL in value_size and their expiration time (in seconds since the Epoch) after the value, so items without
+ * TTL keep the format they had before TTLs existed. Use item_get_value_size and item_get_expires instead of reading value_size.
+ */
+#define ITEM_HAS_TTL (1LU << 62)
+
 uint64_t item_get_rdt(char *item);
 size_t get_item_size(char *item);
 uint64_t item_get_key(char *item);
+uint64_t item_get_key_hash(char *item);          // fingerprint of the key
+int item_keys_match(char *item1, char *item2);   // 1 if both items have the same key
+int item_key_is_fingerprint(char *item);         // 1 if the key is 8B long
+int item_is_tombstone(char *item);
+char *item_set_ttl(char *item, uint64_t seconds); // the item expires in that many seconds, 0 = never; returns the item, reallocated
+uint64_t item_get_expires(char *item);            // 0 if the item never expires
 void* item_get_value(char *item);
 uint64_t item_get_value_size(char *item);
 char *clone_item(char *item);
@@ -5,7 +5,7 @@ void commit_done(struct slab_callback *cb, void *item) {
    printf("Just committed transaction %lu\n", get_transaction_id(cb->transaction));
    _commit_done = 1;
    free(cb->transaction);
-   free(cb);
+   free_slab_callback(cb);
 }
 
 int commit(struct transaction *t, struct injector_queue *q) {
@@ -27,7 +27,7 @@ void cb_trans(struct slab_callback *cb, void *item) {
    }
 
    free(cb->item);
-   free(cb);
+   free_slab_callback(cb);
 }
 
 struct slab_callback *t_bench_cb(void) {
@@ -61,15 +61,23 @@ int main(int argc, char **argv) {
 
    /* Parsing of the options */
    if(argc < 3)
-      die("Usage: ./main <nb disks> <nb workers per disk>\n\tData is stored in %s\n", PATH);
+      die("Usage: ./main <nb disks> <nb workers per disk> [lru|clock|s3fifo]\n\tData is stored in %s\n", PATH);
    nb_disks = atoi(argv[1]);
    nb_workers_per_disk = atoi(argv[2]);
+   if(argc > 3) {
+      struct pagecache_policy *policy = page_cache_policy_by_name(argv[3]);
+      if(!policy)
+         die("Unknown page cache policy %s (lru, clock or s3fifo)\n", argv[3]);
+      page_cache_set_policy(policy);
+   }
 
    /* Pretty printing useful info */
    printf("# Configuration:\n");
-   printf("# \tPage cache size: %lu GB\n", PAGE_CACHE_SIZE/1024/1024/1024);
+   printf("# \tPage cache size: %lu GB (policy: %s)\n", PAGE_CACHE_SIZE/1024/1024/1024, page_cache_get_policy()->name);
    printf("# \tWorkers: %d working on %d disks\n", nb_disks*nb_workers_per_disk, nb_disks);
-   printf("# \tIO configuration: %d queue depth (capped: %s)\n", QUEUE_DEPTH, NEVER_EXCEED_QUEUE_DEPTH?"yes":"no");
+   printf("# \tIO configuration: %d queue depth (capped: %s, adaptive: %s)\n", QUEUE_DEPTH, NEVER_EXCEED_QUEUE_DEPTH?"yes":"no", ADAPTIVE_QUEUE_DEPTH?"yes":"no");
+   printf("# \tIO engine: %s (sqpoll: %s, registered files: %s, registered buffers: %s)\n", IO_ENGINE==IO_ENGINE_URING?"io_uring":"aio", URING_SQPOLL?"yes":"no", URING_REGISTERED_FILES?"yes":"no", URING_REGISTERED_BUFFERS?"yes":"no");
+   printf("# \tDurability: %s\n", DURABILITY_MODE==DURABILITY_BATCH?"fdatasync per batch":(DURABILITY_MODE==DURABILITY_PERIODIC?"periodic fdatasync":"none"));
    printf("# \tQueue configuration: %d maximum pending callbaks per worker\n", MAX_NB_PENDING_CALLBACKS_PER_WORKER);
    printf("# \tThread pinning: %s spinning: %s\n", PINNING?"yes":"no", SPINNING?"yes":"no");
    printf("# \tBench: %s (%lu elements)\n", w.api->api_name(), w.nb_items_in_db);
@@ -86,6 +94,7 @@ int main(int argc, char **argv) {
    start_timer {
       slab_workers_init(nb_disks, nb_workers_per_disk);
    } stop_timer("Init found %lu elements", get_database_size());
+   printf("# \tRecovery: read %lu MB (%.2f GB/s, %lu items/s)\n", get_recovered_bytes()/1024/1024, (double)get_recovered_bytes()/1024/1024/1024/((double)elapsed/1000000), get_database_size()*1000000LU/elapsed);
 
    /* Add missing items if any */
    repopulate_db(&w);
@@ -6,6 +6,7 @@
 #include "indexes/btree.h"
 #include <sys/resource.h>
 #include <errno.h>
+#include <malloc.h>
 
 
 /*
@@ -26,6 +27,17 @@ struct pdata {
    size_t rw;
 };
 
+/* Which operation for the next IO? */
+static int next_is_write(struct pdata *pdata, unsigned int *seed) {
+   if(pdata->rw == RO)
+      return 0;
+   if(pdata->rw == WO)
+      return 1;
+   if(pdata->rw == RW)
+      return rand_r(seed)%2;
+   return rand_r(seed)%100<5;
+}
+
 static char *path = NULL;
 
 static int io_setup(unsigned nr, aio_context_t *ctxp) {
@@ -82,15 +94,7 @@ void *do_libaio(void *data) {
          uint64_t page = rand_r(&seed) % nb_pages;
 
          cb[j].aio_fildes = fd;
-         if(pdata->rw == RO) {
-            cb[j].aio_lio_opcode = IOCB_CMD_PREAD;
-         } else if(pdata->rw == WO) {
-            cb[j].aio_lio_opcode = IOCB_CMD_PWRITE;
-         } else if(pdata->rw == RW) {
-            cb[j].aio_lio_opcode = (rand_r(&seed)%2)?IOCB_CMD_PWRITE:IOCB_CMD_PREAD;
-         } else {
-            cb[j].aio_lio_opcode = (rand_r(&seed)%100<5)?IOCB_CMD_PWRITE:IOCB_CMD_PREAD;
-         }
+         cb[j].aio_lio_opcode = next_is_write(pdata, &seed)?IOCB_CMD_PWRITE:IOCB_CMD_PREAD;
          cb[j].aio_buf = (uint64_t)&buffers[PAGE_SIZE*j];
          cb[j].aio_offset = page * PAGE_SIZE;
          cb[j].aio_nbytes = PAGE_SIZE;
@@ -125,6 +129,85 @@ void *do_libaio(void *data) {
    return NULL;
 }
 
+/*
+ * Same benchmark as do_libaio, but with io_uring (registered file and buffers, SQPOLL if URING_SQPOLL).
+ */
+void *do_uring(void *data) {
+   struct pdata *pdata = data;
+   int fd = pdata->fd;
+   int queue_size = pdata->queue_size;
+   size_t nb_accesses = pdata->nb_accesses;
+   size_t nb_pages = pdata->nb_pages;
+   unsigned int seed = rand();
+
+   struct uring ring;
+   int ret;
+   char *buffers = aligned_alloc(PAGE_SIZE, PAGE_SIZE * queue_size);
+
+   ret = uring_init(&ring, 1024, URING_SQPOLL, URING_SQPOLL_IDLE_MS);
+   if(ret < 0)
+      die("uring_init: %s\n", strerror(-ret));
+
+   int registered_file = (uring_register_files(&ring, &fd, 1) >= 0);
+   struct iovec iov = { .iov_base = buffers, .iov_len = PAGE_SIZE * queue_size };
+   int registered_buffers = (uring_register_buffers(&ring, &iov, 1) >= 0);
+
+   declare_breakdown;
+
+   for(size_t i = 0; i < nb_accesses; ) {
+      for(size_t j = 0; j < queue_size; j++) {
+         uint64_t page = rand_r(&seed) % nb_pages;
+         int write = next_is_write(pdata, &seed);
+         struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+
+         if(registered_buffers) {
+            sqe->opcode = write?IORING_OP_WRITE_FIXED:IORING_OP_READ_FIXED;
+            sqe->buf_index = 0;
+         } else {
+            sqe->opcode = write?IORING_OP_WRITE:IORING_OP_READ;
+         }
+         if(registered_file) {
+            sqe->fd = 0;
+            sqe->flags |= IOSQE_FIXED_FILE;
+         } else {
+            sqe->fd = fd;
+         }
+         sqe->addr = (uint64_t)&buffers[PAGE_SIZE*j];
+         sqe->off = page * PAGE_SIZE;
+         sqe->len = PAGE_SIZE;
+
+         i++;
+      }
+
+      ret = uring_submit(&ring);
+      if (ret != queue_size) {
+         if (ret < 0) fprintf(stderr, "uring_submit: %s\n", strerror(-ret));
+         else fprintf(stderr, "uring_submit only submitted %d\n", ret);
+      } __1
+
+      for(size_t j = 0; j < queue_size; ) {
+         struct io_uring_cqe *cqe = uring_peek_cqe(&ring);
+         if(!cqe) {
+            uring_wait_cqes(&ring, queue_size - j);
+            continue;
+         }
+         if(cqe->res != PAGE_SIZE)
+            fprintf(stderr, "uring IO failed: %d\n", cqe->res);
+         uring_cqe_seen(&ring);
+         j++;
+      } __2
+
+      show_breakdown_periodic(1000, i, "uring_submit", "uring_wait", "waiting", "unused", "unused", "unused", "");
+   }
+
+   uring_exit(&ring);
+
+   free(pdata);
+   free(buffers);
+
+   return NULL;
+}
+
 const char* rw_to_str(size_t rw) {
    if(rw == RO)
       return "Read only";
@@ -203,6 +286,57 @@ int bench_io(void) {
 }
 
 
+/*
+ * Linux AIO vs io_uring, side by side, same file, same access pattern
+ */
+static void run_io_threads(void *(*fun)(void*), int fd, size_t rw, size_t queue_size, size_t nb_pages) {
+   pthread_t threads[NB_THREADS];
+   for(size_t i = 0; i < NB_THREADS; i++) {
+      struct pdata *data = malloc(sizeof(*data));
+      data->fd = fd;
+      data->rw = rw;
+      data->queue_size = queue_size;
+      data->nb_accesses = NB_ACCESSES / NB_THREADS;
+      data->nb_pages = nb_pages;
+      pthread_create(&threads[i], NULL, fun, data);
+   }
+   for(size_t i = 0; i < NB_THREADS; i++) {
+      pthread_join(threads[i], NULL);
+   }
+}
+
+int bench_io_engines(void) {
+   declare_timer;
+
+   struct stat sb;
+   int fd = open(path,  O_RDWR | O_CREAT | O_DIRECT, 0777);
+   if(fd == -1)
+      perr("Cannot open %s\n", path);
+   fstat(fd, &sb);
+   size_t nb_pages = sb.st_size / PAGE_SIZE;
+   if(nb_pages == 0)
+      die("%s is empty, nothing to bench\n", path);
+   printf("# Size of file being benched: %luB = %lu pages\n", sb.st_size, nb_pages);
+
+   size_t queue_sizes[] = { 1, 8, 32, 64 };
+   for(size_t rw = RO; rw <= RM; rw++) {
+      for(size_t q = 0; q < sizeof(queue_sizes)/sizeof(*queue_sizes); q++) {
+         size_t queue_size = queue_sizes[q];
+
+         start_timer {
+            run_io_threads(do_libaio, fd, rw, queue_size, nb_pages);
+         } stop_timer("libaio   %d threads - %s - Time for %lu accesses queue size %lu = %lums (%lu io/s)", NB_THREADS, rw_to_str(rw), NB_ACCESSES, queue_size, elapsed/1000, NB_ACCESSES*1000000LU/elapsed);
+
+         start_timer {
+            run_io_threads(do_uring, fd, rw, queue_size, nb_pages);
+         } stop_timer("io_uring %d threads - %s - Time for %lu accesses queue size %lu = %lums (%lu io/s)", NB_THREADS, rw_to_str(rw), NB_ACCESSES, queue_size, elapsed/1000, NB_ACCESSES*1000000LU/elapsed);
+      }
+   }
+
+   close(fd);
+   return 0;
+}
+
 /*
  * Data structures tests
  */
@@ -257,6 +391,105 @@ int bench_data_structures(void) {
    return 0;
 }
 
+/*
+ * Memory used by the main index, 24B entries vs packed 16B entries.
+ * ru_maxrss never decreases, so we look at the bytes allocated by malloc instead.
+ */
+#define NB_INDEX_ENTRIES 50000000LU
+
+static size_t get_allocated_bytes(void) {
+   return mallinfo2().uordblks + mallinfo2().hblkhd;
+}
+
+int bench_index_memory(size_t nb_entries) {
+   declare_timer;
+
+   size_t before = get_allocated_bytes();
+   btree_t *b = btree_create();
+   start_timer {
+      struct index_entry e = { .slab = NULL, .slab_idx = 0, .rdt = 0 };
+      for(size_t i = 0; i < nb_entries; i++) {
+         uint64_t hash = xorshf96();
+         e.slab_idx = i;
+         btree_insert(b, (unsigned char*)&hash, sizeof(hash), &e);
+      }
+   } stop_timer("BTREE - %lu inserts (%lu inserts/s)", nb_entries, nb_entries*1000000LU/elapsed);
+   size_t used = get_allocated_bytes() - before;
+   printf("BTREE - %lu entries (%luB per entry) = %luMB, %.1fB per item in the index\n", btree_size(b), sizeof(struct index_entry), used/1024/1024, (double)used/btree_size(b));
+   btree_free(b);
+
+   before = get_allocated_bytes();
+   b = btree_packed_create();
+   start_timer {
+      struct packed_index_entry e = { .location = 0, .rdt = 0 };
+      for(size_t i = 0; i < nb_entries; i++) {
+         uint64_t hash = xorshf96();
+         e.location = i;
+         btree_packed_insert(b, (unsigned char*)&hash, sizeof(hash), &e);
+      }
+   } stop_timer("PACKED BTREE - %lu inserts (%lu inserts/s)", nb_entries, nb_entries*1000000LU/elapsed);
+   size_t used_packed = get_allocated_bytes() - before;
+   printf("PACKED BTREE - %lu entries (%luB per entry) = %luMB, %.1fB per item in the index (%.1f%% less)\n", btree_packed_size(b), sizeof(struct packed_index_entry), used_packed/1024/1024, (double)used_packed/btree_packed_size(b), 100. - 100.*used_packed/used);
+   btree_packed_free(b);
+
+   return 0;
+}
+
+/*
+ * Timestamps taken by transactions: a global counter incremented at begin and commit (old get_highest_rdt) vs the timestamp oracle
+ * (begin reads the clock, commit increments it, see timestamp.c).
+ */
+#define NB_TIMESTAMP_TRANSACTIONS 10000000LU
+#define MAX_TIMESTAMP_THREADS 64
+
+struct timestamp_pdata {
+   int oracle;
+   int write;              // read-only transactions do not commit
+   size_t nb_transactions;
+   uint64_t sum;           // so that the compiler keeps the reads
+};
+static volatile uint64_t counter_rdt __attribute__((aligned(64)));
+
+static void *do_timestamps(void *data) {
+   struct timestamp_pdata *p = data;
+   for(size_t i = 0; i < p->nb_transactions; i++) {
+      if(p->oracle) {
+         p->sum += timestamp_read();
+         if(p->write)
+            p->sum += timestamp_commit();
+      } else {
+         p->sum += __sync_add_and_fetch(&counter_rdt, 1);
+         if(p->write)
+            p->sum += __sync_add_and_fetch(&counter_rdt, 1);
+      }
+   }
+   return NULL;
+}
+
+int bench_timestamps(size_t max_threads) {
+   declare_timer;
+   pthread_t threads[MAX_TIMESTAMP_THREADS];
+   struct timestamp_pdata pdata[MAX_TIMESTAMP_THREADS];
+   if(max_threads > MAX_TIMESTAMP_THREADS)
+      max_threads = MAX_TIMESTAMP_THREADS;
+
+   for(int write = 0; write <= 1; write++) {
+      for(int oracle = 0; oracle <= 1; oracle++) {
+         for(size_t nb_threads = 1; nb_threads <= max_threads; nb_threads *= 2) {
+            start_timer {
+               for(size_t i = 0; i < nb_threads; i++) {
+                  pdata[i] = (struct timestamp_pdata) { .oracle = oracle, .write = write, .nb_transactions = NB_TIMESTAMP_TRANSACTIONS / nb_threads };
+                  pthread_create(&threads[i], NULL, do_timestamps, &pdata[i]);
+               }
+               for(size_t i = 0; i < nb_threads; i++)
+                  pthread_join(threads[i], NULL);
+            } stop_timer("%s - %s transactions - %2lu threads - %lu transactions/s", oracle?"ORACLE ":"COUNTER", write?"write    ":"read-only", nb_threads, NB_TIMESTAMP_TRANSACTIONS*1000000LU/elapsed);
+         }
+      }
+   }
+   return 0;
+}
+
 /*
  * Understand Zipf
  */
@@ -291,8 +524,17 @@ void bench_zipf(void) {
 
 int main(int argc, char **argv) {
    path = "/data/sli144/scratch0/blepers/slab-0-0-0-1024";
+   if(argc > 2)
+      path = argv[2];
    srand(time(NULL));
-   bench_io();
+   if(argc > 1 && !strcmp(argv[1], "engines")) // ./microbench engines [file]
+      bench_io_engines();
+   else if(argc > 1 && !strcmp(argv[1], "index")) // ./microbench index [nb entries]
+      bench_index_memory((argc > 2)?atol(argv[2]):NB_INDEX_ENTRIES);
+   else if(argc > 1 && !strcmp(argv[1], "timestamps")) // ./microbench timestamps [max threads]
+      bench_timestamps((argc > 2)?atol(argv[2]):sysconf(_SC_NPROCESSORS_ONLN));
+   else
+      bench_io();
    //bench_data_structures();
    //bench_zipf();
    return 0;
@@ -9,6 +9,10 @@
 #define TRANSACTION_OBJECT_SIZE 512
 #define PATH "/data/sli144/scratch%lu/kvell/slab-%d-%lu"   // path where data is store -- disk, worker_id, item_size
 #define PATH_TRANSACTIONS "/data/sli144/scratch%lu/kvell/trans-%d-%lu" // path where the transaction log is store -- disk, worker_id, transaction_size
+#define PATH_CHECKPOINT "/data/sli144/scratch%lu/kvell/checkpoint-%d" // path of the index checkpoints -- disk, worker_id
+#define PATH_CHECKPOINT_LOG "/data/sli144/scratch%lu/kvell/checkpoint-log-%d-%d" // pages written since the last checkpoints -- disk, worker_id, log (0 or 1)
+#define PATH_COMMIT_LOG "/data/sli144/scratch%lu/kvell/commit-log-%d" // commit markers of the transactions -- disk, worker_id
+#define PATH_FORMAT "/data/sli144/scratch%lu/kvell/format-%d" // version of the on-disk format -- disk, worker_id
 
 /* Which transaction type are we using? */
 #define TRANS_SNAPSHOT 0
@@ -17,10 +21,46 @@
 #define TRANSACTION_TYPE TRANS_LONG
 /*#define TRANSACTION_TYPE TRANS_SNAPSHOT*/
 
+/* IO engine */
+#define IO_ENGINE_AIO 0
+#define IO_ENGINE_URING 1
+#define IO_ENGINE IO_ENGINE_URING // Workers fall back to Linux AIO if io_uring is not available
+#define URING_SQPOLL 0 // A kernel thread polls the submission ring of each worker: no syscall to submit IOs, but burns a core per worker when busy
+#define URING_SQPOLL_IDLE_MS 1000 // ... and goes to sleep after that much idle time
+#define URING_REGISTERED_FILES 1 // Register slab files once instead of taking a reference on every IO
+#define URING_REGISTERED_BUFFERS 1 // Register the page cache memory once instead of pinning pages on every IO
+#define MAX_REGISTERED_FILES 32 // Per worker
+#define IO_MAX_COALESCED_PAGES 32 // Contiguous pages read or written in a loop of a worker are sent as one vectored IO of at most that many pages (1 = no coalescing)
+
+/* IO priority classes: point requests, scans and maintenance (compaction, sweeper), see ioengine.c */
+#define IO_SHARE_POINT 60 // When more IOs are pending than the queue depth allows, each class first gets that percentage of the queue depth...
+#define IO_SHARE_SCAN 25 // ... then what is left goes to point requests, then scans, then maintenance
+#define IO_SHARE_MAINTENANCE 15
+#define IO_PRIORITIES 1 // Tag IOs with the kernel IO priority of their class (honored by the IO schedulers that support priorities, e.g., mq-deadline and bfq)
+#define IO_PRIO_POINT IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 0)
+#define IO_PRIO_SCAN IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 4)
+#define IO_PRIO_MAINTENANCE IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7) // not IOPRIO_CLASS_IDLE: workers wait for all their IOs, a starved IO would stall point requests
+
+/* Durability */
+#define DURABILITY_NONE 0 // Writes complete once the page has been written (O_DIRECT, but the drive may still cache it)
+#define DURABILITY_BATCH 1 // Writes complete once an fdatasync of their file submitted after the write has completed, one sync per file per loop of the worker
+#define DURABILITY_PERIODIC 2 // Same, but files are synced at most every DURABILITY_SYNC_INTERVAL_US
+#define DURABILITY_MODE DURABILITY_NONE
+#define DURABILITY_SYNC_INTERVAL_US 1000
+
+/* Commit markers of transactions (see commitlog.c) */
+#define COMMIT_LOG 1 // Markers of the transactions committing at the same time are packed in a page of a per-worker log, written once per batch of requests; 0 = one item of the transactions slab per commit
+#define COMMIT_LOG_PAGES 1024 // Size of the circular log, per worker
+
 /* Queue depth management */
 #define QUEUE_DEPTH 32
 #define MAX_NB_PENDING_CALLBACKS_PER_WORKER (2*QUEUE_DEPTH)
 #define NEVER_EXCEED_QUEUE_DEPTH 0 // Never submit more than QUEUE_DEPTH IO requests simultaneously, otherwise up to 2*MAX_NB_PENDING_CALLBACKS_PER_WORKER (very unlikely)
+#define ADAPTIVE_QUEUE_DEPTH 1 // The workers of a disk share a budget of in-flight IOs that follows the latency of the disk (see queuedepth.c), starts at QUEUE_DEPTH per worker
+#define ADAPTIVE_QD_MIN 4 // Per disk
+#define ADAPTIVE_QD_WINDOW_US 10000 // The budget is adjusted every window...
+#define ADAPTIVE_QD_LATENCY_FACTOR 2 // ... and shrinks when the latency of the window is that many times higher than the lowest latency seen
+#define ADAPTIVE_QD_MIN_LATENCY_US 100 // ... and higher than that (IOs served from a cache should not make the baseline collapse)
 
 /* Snapshot management */
 #if TRANSACTION_TYPE == TRANS_SNAPSHOT
@@ -36,13 +76,37 @@
 /*#define PAGE_CACHE_SIZE (PAGE_SIZE * 5242880) //20GB*/
 //#define PAGE_CACHE_SIZE (PAGE_SIZE * 786432) //3GB
 #define MAX_PAGE_CACHE (PAGE_CACHE_SIZE / PAGE_SIZE)
+#define EXTENT_CACHE_SIZE (PAGE_SIZE * 16384) // Per slab of items > PAGE_SIZE (8K..256K), split between workers, at least 2*MAX_NB_PENDING_CALLBACKS_PER_WORKER extents per worker, only allocated once the slab is used
+#define DEFAULT_PAGE_CACHE_POLICY S3FIFO_POLICY // LRU_POLICY, CLOCK_POLICY or S3FIFO_POLICY (scan resistant), see pagecache.c
 
 /* Injector queues */
 #define SAFE_INJECTOR_QUEUES 1 // see injectorqueue.c
 
+/* Recovery: the slabs of a worker are read by helper threads while the worker rebuilds the index */
+#define REBUILD_THREADS_PER_WORKER 4
+#define REBUILD_QUEUE_DEPTH 16 // Number of 2MB chunks read in advance, per worker
+
+/* Checkpoints of the index, loaded on restart instead of scanning the slabs (see checkpoint.c) */
+#define CHECKPOINT_INTERVAL 0 // in seconds, 0 = disabled
+
+/* Compaction: live items at the end of slabs with many free spots are moved to the free spots, and the end of the files is punched (see compaction.c) */
+#define COMPACTION_MIN_FREE_PERCENT 30 // Compact slabs that have at least that many free spots
+#define COMPACTION_BATCH 16 // Spots at the end of a slab compacted at once, must be less than MAX_NB_PENDING_CALLBACKS_PER_WORKER
+#define COMPACTION_MAX_PENDING_REQUESTS QUEUE_DEPTH // Foreground requests first: do not compact when more requests are queued
+#define COMPACTION_MAX_SPOTS_PER_SEC 65536 // Per worker, 0 = compaction disabled
+
+/* Sweeper: tombstones of deleted items are dropped once no copy of the items is left on disk (see sweeper.c) */
+#define SWEEPER_BATCH 16 // Pages swept at once, must be less than MAX_NB_PENDING_CALLBACKS_PER_WORKER
+#define SWEEPER_MAX_PAGES_PER_SEC 16384 // Per worker, also limited by COMPACTION_MAX_PENDING_REQUESTS
+#define TTL_SWEEP_INTERVAL 1 // Seconds between two walks of the index looking for expired items, 0 = expired items are never reclaimed
+#define TTL_SWEEP_BATCH 65536 // Entries of the index examined between two batches of requests
+
 /* Free list */
 #define FREELIST_IN_MEMORY_ITEMS (25600) // We need enough to never have to read from disk
 
+/* BATCHING of requests sent by YCSB injectors (kv_read_many / kv_update_many), 0 = one request at a time */
+#define YCSB_BATCH_SIZE 0
+
 /* BATCHING of requests for scans */
 #define MAX_BATCH_SIZE 30
 #endif
@@ -3,66 +3,300 @@
 /*
  * Basic page cache implementation.
  *
- * Only 1 operation: get_page(hash).
+ * Only 1 operation: get_page(hash, one_shot).
  * Hash must be chosen carefully otherwise the page cache might return the same cached page for two different files / offsets.
  * Currently the IO engine appends the file descriptor number and the page offset to create a hash (fd << 40 + page_num).
  *
- * A hash is used to remember what is in the cache.
- * hash_to_page[hash].data1 = address of the page
- * hash_to_page[hash].data2 = lru entry of the page
+ * A hash table is used to remember what is in the cache.
+ * hash_to_page[hash] = frame number of the page, i.e., the page is used_pages[frame].page and its lru entry is used_pages[frame]
+ * The hash table has a fixed size (1 entry per frame), see indexes/openhash.c.
  *
- * The lru entry is used to have a lru order of cached content + some metadata.
+ * The lru entry is used by the replacement policy (see below) + some metadata.
  * lru_entry.dirty = the page has been written but not flushed
  * lru_entry.contains_data = the page already contains the correct content, no need to read page from disk
+ * lru_entry.nb_writes = number of writes of the page currently processed by the disk
  * These metadata are cleared by the page cache and set by the IO engine.
  *
  * The page cache shouldn't be used directly, the interface of the IO engine is a more convenient way to access data.
+ *
+ * The memory of the page cache is allocated once and split in p->buffers. The IO engine registers these buffers with the kernel
+ * (ioengine_register_buffers) so that pages are pinned once instead of on every IO; IOs then reference lru_entry->buf_index.
+ * A worker registers the buffers of all its caches at once, p->first_buffer is the index of p->buffers[0] in that registration.
+ *
+ * A "page" of the cache is a frame of p->frame_size bytes. Workers have one cache of PAGE_SIZE frames, plus one cache per slab of items
+ * bigger than PAGE_SIZE whose frames are extents of the size of the items (see slab.c), so that such items are read and written with a single IO.
  */
 
-void page_cache_init(struct pagecache *p) {
+#define PAGE_CACHE_BUFFER_SIZE (1LU*1024LU*1024LU*1024LU) // io_uring does not accept registered buffers bigger than 1GB
+
+static void page_cache_init_buffers(struct pagecache *p, size_t size) {
+   p->nb_buffers = (size + PAGE_CACHE_BUFFER_SIZE - 1) / PAGE_CACHE_BUFFER_SIZE;
+   p->buffers = calloc(p->nb_buffers, sizeof(*p->buffers));
+   for(size_t i = 0; i < p->nb_buffers; i++) {
+      p->buffers[i].iov_base = &p->cached_data[i*PAGE_CACHE_BUFFER_SIZE];
+      p->buffers[i].iov_len = (i == p->nb_buffers - 1)?(size - i*PAGE_CACHE_BUFFER_SIZE):PAGE_CACHE_BUFFER_SIZE;
+   }
+}
+
+/*
+ * Replacement policies.
+ *
+ * A policy is notified when a page enters the cache (insert) and when a cached page is accessed again (hit), and chooses the frame to reuse
+ * when the cache is full (evict). Pages read by scans are "one shot": they should not push the working set of point requests out of the cache.
+ *
+ * LRU: strict LRU, one shot pages are inserted at the cold end of the list and are not bumped on hits.
+ * CLOCK: 1 reference bit per frame, the hand clears bits until it finds an unreferenced frame.
+ * S3-FIFO: a small FIFO (10% of the frames) filters pages accessed only once, pages hit while in the small FIFO are moved to the main FIFO,
+ *          the main FIFO is a CLOCK-like FIFO with a 2 bit frequency counter. Hashes evicted from the small FIFO are remembered in a ghost FIFO,
+ *          if they come back they go directly to the main FIFO. One shot pages never leave the small FIFO and are not remembered.
+ *
+ * Frames that have an IO in flight (not read yet / write not submitted or not completed yet) are given a second chance, unless the whole cache is busy.
+ */
+#define S3FIFO_SMALL_RATIO 10 // % of the frames in the small FIFO
+#define S3FIFO_MAX_FREQ 3
+
+enum { SMALL_QUEUE = 0, MAIN_QUEUE = 1 };
+
+static int page_is_busy(struct lru *e) {
+   return !e->contains_data || e->dirty || e->nb_writes;
+}
+
+static void list_remove(struct lru_list *l, struct lru *e) {
+   if(e->prev)
+      e->prev->next = e->next;
+   else
+      l->newest = e->next;
+   if(e->next)
+      e->next->prev = e->prev;
+   else
+      l->oldest = e->prev;
+   l->size--;
+}
+
+static void list_push_newest(struct lru_list *l, struct lru *e) {
+   e->prev = NULL;
+   e->next = l->newest;
+   if(l->newest)
+      l->newest->prev = e;
+   l->newest = e;
+   if(!l->oldest)
+      l->oldest = e;
+   l->size++;
+}
+
+static void list_push_oldest(struct lru_list *l, struct lru *e) {
+   e->next = NULL;
+   e->prev = l->oldest;
+   if(l->oldest)
+      l->oldest->next = e;
+   l->oldest = e;
+   if(!l->newest)
+      l->newest = e;
+   l->size++;
+}
+
+/* LRU */
+static void lru_init(struct pagecache *p) {
+}
+
+static void lru_insert(struct pagecache *p, struct lru *e, int one_shot) {
+   if(one_shot)
+      list_push_oldest(&p->queues[0], e);
+   else
+      list_push_newest(&p->queues[0], e);
+}
+
+static void lru_hit(struct pagecache *p, struct lru *e, int one_shot) {
+   if(one_shot || e == p->queues[0].newest)
+      return;
+   list_remove(&p->queues[0], e);
+   list_push_newest(&p->queues[0], e);
+}
+
+static struct lru *lru_evict(struct pagecache *p) {
+   struct lru *e = p->queues[0].oldest;
+   for(size_t i = 0; i < p->queues[0].size && page_is_busy(e); i++)
+      e = e->prev ? e->prev : p->queues[0].oldest;
+   list_remove(&p->queues[0], e);
+   return e;
+}
+
+struct pagecache_policy LRU_POLICY = {
+   .name = "LRU",
+   .init = lru_init,
+   .insert = lru_insert,
+   .hit = lru_hit,
+   .evict = lru_evict,
+};
+
+/* CLOCK */
+static void clock_init(struct pagecache *p) {
+   p->clock_hand = 0;
+}
+
+static void clock_insert(struct pagecache *p, struct lru *e, int one_shot) {
+   e->freq = !one_shot;
+}
+
+static void clock_hit(struct pagecache *p, struct lru *e, int one_shot) {
+   if(!one_shot)
+      e->freq = 1;
+}
+
+static struct lru *clock_evict(struct pagecache *p) {
+   for(size_t i = 0; ; i++) {
+      struct lru *e = &p->used_pages[p->clock_hand];
+      p->clock_hand = (p->clock_hand + 1) % p->used_page_size;
+      if(i >= 2*p->used_page_size) // everything is busy, just take the next one
+         return e;
+      if(page_is_busy(e))
+         continue;
+      if(e->freq) {
+         e->freq = 0;
+         continue;
+      }
+      return e;
+   }
+}
+
+struct pagecache_policy CLOCK_POLICY = {
+   .name = "CLOCK",
+   .init = clock_init,
+   .insert = clock_insert,
+   .hit = clock_hit,
+   .evict = clock_evict,
+};
+
+/* S3-FIFO */
+static void s3fifo_init(struct pagecache *p) {
+   p->ghost_size = p->nb_frames - p->nb_frames * S3FIFO_SMALL_RATIO / 100 + 1; // same size as the main FIFO
+   p->ghost_fifo = calloc(p->ghost_size, sizeof(*p->ghost_fifo));
+   p->ghost_head = 0;
+   p->ghost = openhash_create(p->ghost_size);
+}
+
+static void ghost_add(struct pagecache *p, uint64_t hash) {
+   uint32_t pos;
+   uint64_t old = p->ghost_fifo[p->ghost_head];
+   if(openhash_lookup(p->ghost, old, &pos) && pos == p->ghost_head) // oldest ghost falls out of the FIFO
+      openhash_delete(p->ghost, old);
+   p->ghost_fifo[p->ghost_head] = hash;
+   openhash_delete(p->ghost, hash); // still a ghost (e.g., inserted by a scan, then hit by a point request), only keep the newest position
+   openhash_insert(p->ghost, hash, p->ghost_head);
+   p->ghost_head = (p->ghost_head + 1) % p->ghost_size;
+}
+
+static void s3fifo_insert(struct pagecache *p, struct lru *e, int one_shot) {
+   e->freq = 0;
+   e->one_shot = one_shot;
+   if(!one_shot && openhash_delete(p->ghost, e->hash)) {
+      e->queue = MAIN_QUEUE;
+      list_push_newest(&p->queues[MAIN_QUEUE], e);
+   } else {
+      e->queue = SMALL_QUEUE;
+      list_push_newest(&p->queues[SMALL_QUEUE], e);
+   }
+}
+
+static void s3fifo_hit(struct pagecache *p, struct lru *e, int one_shot) {
+   if(one_shot)
+      return;
+   e->one_shot = 0; // a point request needs the page, it is not a scan-only page anymore
+   if(e->freq < S3FIFO_MAX_FREQ)
+      e->freq++;
+}
+
+static struct lru *s3fifo_evict(struct pagecache *p) {
+   struct lru_list *small = &p->queues[SMALL_QUEUE], *main = &p->queues[MAIN_QUEUE];
+   size_t max_tries = 4*p->used_page_size, nb_busy_small = 0;
+
+   for(size_t i = 0; ; i++) {
+      int force = (i >= max_tries);
+      int use_small = small->size && (small->size >= p->nb_frames * S3FIFO_SMALL_RATIO / 100 || !main->size);
+      if(use_small && nb_busy_small >= small->size && main->size) // all the pages of the small FIFO are busy, look in the main FIFO
+         use_small = 0;
+      if(use_small) {
+         struct lru *e = small->oldest;
+         list_remove(small, e);
+         if(!force && page_is_busy(e)) {
+            list_push_newest(small, e);
+            nb_busy_small++;
+         } else if(!force && e->freq) {
+            e->freq = 0;
+            e->queue = MAIN_QUEUE;
+            list_push_newest(main, e);
+         } else {
+            if(!e->one_shot)
+               ghost_add(p, e->hash);
+            return e;
+         }
+      } else {
+         struct lru *e = main->oldest;
+         list_remove(main, e);
+         if(!force && (page_is_busy(e) || e->freq)) {
+            if(e->freq)
+               e->freq--;
+            list_push_newest(main, e);
+         } else {
+            return e;
+         }
+      }
+   }
+}
+
+struct pagecache_policy S3FIFO_POLICY = {
+   .name = "S3-FIFO",
+   .init = s3fifo_init,
+   .insert = s3fifo_insert,
+   .hit = s3fifo_hit,
+   .evict = s3fifo_evict,
+};
+
+/* Policy used by the page caches created after the call (i.e., must be called before starting the workers) */
+static struct pagecache_policy *default_policy = &DEFAULT_PAGE_CACHE_POLICY;
+void page_cache_set_policy(struct pagecache_policy *policy) {
+   default_policy = policy;
+}
+
+struct pagecache_policy *page_cache_get_policy(void) {
+   return default_policy;
+}
+
+struct pagecache_policy *page_cache_policy_by_name(const char *name) {
+   struct pagecache_policy *policies[] = { &LRU_POLICY, &CLOCK_POLICY, &S3FIFO_POLICY };
+   for(size_t i = 0; i < sizeof(policies)/sizeof(*policies); i++)
+      if(!strcasecmp(policies[i]->name, name) || (!strcasecmp(name, "s3fifo") && policies[i] == &S3FIFO_POLICY))
+         return policies[i];
+   return NULL;
+}
+
+/*
+ * Create a page cache of size bytes, split in frames of frame_size bytes.
+ * frame_size is PAGE_SIZE for the main cache of a worker, or the size of an extent for slabs of items bigger than a page.
+ */
+void page_cache_init(struct pagecache *p, size_t frame_size, size_t size) {
+   if(frame_size % PAGE_SIZE || PAGE_CACHE_BUFFER_SIZE % frame_size)
+      die("Invalid page cache frame size %lu\n", frame_size);
+   size = size - size % frame_size;
    declare_timer;
    start_timer {
       printf("#Reserving memory for page cache...\n");
-      p->cached_data = aligned_alloc(PAGE_SIZE, PAGE_CACHE_SIZE/get_nb_workers());
+      p->cached_data = aligned_alloc(PAGE_SIZE, size);
       assert(p->cached_data); // If it fails here, it's probably because page cache size is bigger than RAM -- see options.h
-      memset(p->cached_data, 0, PAGE_CACHE_SIZE/get_nb_workers());
+      memset(p->cached_data, 0, size);
    } stop_timer("Page cache initialization");
+   page_cache_init_buffers(p, size);
+
+   p->frame_size = frame_size;
+   p->nb_frames = size / frame_size;
+   p->first_buffer = 0;
 
-   p->hash_to_page = tree_create();
-   p->used_pages = calloc(MAX_PAGE_CACHE/get_nb_workers(), sizeof(*p->used_pages));
+   p->hash_to_page = openhash_create(p->nb_frames);
+   p->used_pages = calloc(p->nb_frames, sizeof(*p->used_pages));
    p->used_page_size = 0;
-   p->oldest_page = NULL;
-   p->newest_page = NULL;
-}
-
-struct lru *add_page_in_lru(struct pagecache *p, void *page, uint64_t hash) {
-   struct lru *me = &p->used_pages[p->used_page_size];
-   me->hash = hash;
-   me->page = page;
-   if(!p->oldest_page)
-      p->oldest_page = me;
-   me->prev = NULL;
-   me->next = p->newest_page;
-   if(p->newest_page)
-      p->newest_page->prev = me;
-   p->newest_page = me;
-   return me;
-}
-
-void bump_page_in_lru(struct pagecache *p, struct lru *me, uint64_t hash) {
-   assert(me->hash == hash);
-   if(me == p->newest_page)
-      return;
-   if(p->oldest_page == me && me->prev)
-      p->oldest_page = me->prev;
-   if(me->prev)
-      me->prev->next = me->next;
-   if(me->next)
-      me->next->prev = me->prev;
-   me->prev = NULL;
-   me->next = p->newest_page;
-   p->newest_page->prev = me;
-   p->newest_page = me;
+   memset(p->queues, 0, sizeof(p->queues));
+   p->policy = default_policy;
+   p->policy->init(p);
 }
 
 /*
@@ -70,54 +304,52 @@ void bump_page_in_lru(struct pagecache *p, struct lru *me, uint64_t hash) {
  * *page will be set to the address in the page cache
  * @return 1 if the page already contains the right data, 0 otherwise.
  */
-int get_page(struct pagecache *p, uint64_t hash, void **page, struct lru **lru) {
+int get_page(struct pagecache *p, uint64_t hash, int one_shot, void **page, struct lru **lru) {
    void *dst;
    struct lru *lru_entry = *lru;
-   maybe_unused pagecache_entry_t *tmp_entry;
-   maybe_unused pagecache_entry_t *old_entry = NULL;
+   uint32_t frame;
 
    // The user gave us a possible lru entry, check if it still contains the data
    if(lru_entry && lru_entry->hash == hash) {
-      bump_page_in_lru(p, lru_entry, hash);
+      p->policy->hit(p, lru_entry, one_shot);
       *page = lru_entry->page;
       return 1;
    }
 
    // Is the page already cached?
-   pagecache_entry_t *e = tree_lookup(p->hash_to_page, hash);
-   if(e) {
-      dst = e->page;
-      lru_entry = e->lru;
+   if(openhash_lookup(p->hash_to_page, hash, &frame)) {
+      lru_entry = &p->used_pages[frame];
+      dst = lru_entry->page;
       if(lru_entry->hash != hash)
          die("LRU wierdness %lu vs %lu\n", lru_entry->hash, hash);
-      bump_page_in_lru(p, lru_entry, hash);
+      p->policy->hit(p, lru_entry, one_shot);
       *page = dst;
       *lru = lru_entry;
       return 1;
    }
 
 
-   // Otherwise allocate a new page, either a free one, or reuse the oldest
-   if(p->used_page_size < MAX_PAGE_CACHE/get_nb_workers()) {
-      dst = &p->cached_data[PAGE_SIZE*p->used_page_size];
-      lru_entry = add_page_in_lru(p, dst, hash);
+   // Otherwise allocate a new page, either a free one, or ask the policy which one to reuse
+   if(p->used_page_size < p->nb_frames) {
+      frame = p->used_page_size;
+      lru_entry = &p->used_pages[frame];
+      lru_entry->page = &p->cached_data[p->frame_size*frame];
+      lru_entry->buf_index = p->registered?(p->first_buffer + (p->frame_size*frame) / PAGE_CACHE_BUFFER_SIZE):-1;
       p->used_page_size++;
    } else {
-      lru_entry = p->oldest_page;
-      dst = p->oldest_page->page;
-
-      tree_delete(p->hash_to_page, p->oldest_page->hash, &old_entry);
-
-      lru_entry->hash = hash;
-      lru_entry->page = dst;
-      bump_page_in_lru(p, lru_entry, hash);
+      lru_entry = p->policy->evict(p);
+      frame = lru_entry - p->used_pages;
+      openhash_delete(p->hash_to_page, lru_entry->hash);
    }
+   dst = lru_entry->page;
+   lru_entry->hash = hash;
+   lru_entry->contains_data = 0;
+   lru_entry->dirty = 0; // should already be equal to 0, but we never know
 
    // Remember that the page cache now stores this hash
-   tree_insert(p->hash_to_page, hash, old_entry, dst, lru_entry);
+   openhash_insert(p->hash_to_page, hash, frame);
+   p->policy->insert(p, lru_entry, one_shot);
 
-   lru_entry->contains_data = 0;
-   lru_entry->dirty = 0; // should already be equal to 0, but we never know
    *page = dst;
    *lru = lru_entry;
 
@@ -1,23 +1,7 @@
 #ifndef PAGE_CACHE_H
 #define PAGE_CACHE_H 1
 
-typedef struct index_entry pagecache_entry_t;
-
-
-#include "indexes/btree.h"
-typedef btree_t* hash_t;
-#define tree_create() btree_create()
-#define tree_lookup(h, hash) ({ int res = btree_find((h), (unsigned char*)&(hash), sizeof(hash), &tmp_entry); res?tmp_entry:NULL; })
-#define tree_delete(h, hash, old_entry) \
-   do { \
-      btree_delete((h), (unsigned char*)&(hash), sizeof(hash)); \
-   } while(0);
-#define tree_insert(h, hash, old_entry, dst, lru_entry) \
-   do { \
-      pagecache_entry_t new_entry = { .page = dst, .lru = lru_entry }; \
-      btree_insert((h),(unsigned char*)&(hash),sizeof(hash), &new_entry); \
-   } while(0)
-
+#include "indexes/openhash.h"
 
 struct lru {
    struct lru *prev;
@@ -26,16 +10,55 @@ struct lru {
    void *page;
    int contains_data;
    int dirty;
+   int nb_writes;    // writes of the page submitted to the disk and not completed yet, the frame must not be reused before they complete
+   int buf_index;    // Index of the buffer that contains the page in pagecache->buffers (registered with the IO engine), -1 if not registered
+   uint8_t freq;     // Policy metadata: reference bit (CLOCK) or access frequency (S3-FIFO)
+   uint8_t queue;    // S3-FIFO: small or main FIFO
+   uint8_t one_shot; // S3-FIFO: page only read by a scan so far
+};
+
+struct lru_list {
+   struct lru *oldest, *newest;
+   size_t size;
 };
 
+struct pagecache;
+struct pagecache_policy {
+   const char *name;
+   void (*init)(struct pagecache *p);
+   void (*insert)(struct pagecache *p, struct lru *e, int one_shot); // a new page has been added in frame e
+   void (*hit)(struct pagecache *p, struct lru *e, int one_shot);    // page already in frame e has been accessed
+   struct lru *(*evict)(struct pagecache *p);                        // choose the frame to reuse, the frame must be removed from the policy structures
+};
+extern struct pagecache_policy LRU_POLICY;
+extern struct pagecache_policy CLOCK_POLICY;
+extern struct pagecache_policy S3FIFO_POLICY;
+
 struct pagecache {
    char *cached_data;
-   hash_t hash_to_page;
-   struct lru *used_pages, *oldest_page, *newest_page;
+   struct iovec *buffers;  // cached_data split in chunks that can be registered with the IO engine
+   size_t nb_buffers;
+   size_t first_buffer;    // index of buffers[0] in the buffers registered by the worker
+   int registered;         // 0 if the buffers have not been registered (extent caches, see init_pagecaches)
+   size_t frame_size;      // PAGE_SIZE, or size of an extent
+   size_t nb_frames;
+   struct openhash *hash_to_page; // hash -> frame number (index in used_pages)
+   struct lru *used_pages;
    size_t used_page_size;
+
+   struct pagecache_policy *policy;
+   struct lru_list queues[2];     // LRU list (LRU) or small and main FIFOs (S3-FIFO)
+   size_t clock_hand;             // CLOCK
+   struct openhash *ghost;        // S3-FIFO: hash -> position in ghost_fifo
+   uint64_t *ghost_fifo;
+   size_t ghost_size, ghost_head;
 };
 
-void page_cache_init(struct pagecache *p);
-int get_page(struct pagecache *p, uint64_t hash, void **page, struct lru **lru);
+void page_cache_set_policy(struct pagecache_policy *policy); // before the page caches are created
+struct pagecache_policy *page_cache_get_policy(void);
+struct pagecache_policy *page_cache_policy_by_name(const char *name); // "lru", "clock" or "s3fifo", NULL if unknown
+
+void page_cache_init(struct pagecache *p, size_t frame_size, size_t size);
+int get_page(struct pagecache *p, uint64_t hash, int one_shot, void **page, struct lru **lru);
 
 #endif
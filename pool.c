@@ -0,0 +1,98 @@
+#include "headers.h"
+
+/*
+ * Object pools.
+ *
+ * Requests are allocated by injectors and usually freed by workers (or the other way around), so a plain per-thread freelist would
+ * only grow on one side. Each thread has a small cache of free objects per pool. When the cache is full, a "magazine" of
+ * POOL_MAGAZINE_SIZE objects is moved to the shared depot of the pool; when it is empty, a full magazine is taken from the depot.
+ * The lock of the depot is taken once every POOL_MAGAZINE_SIZE allocations / frees, malloc is only called when the depot is empty.
+ *
+ * Free objects are chained through their first bytes.
+ */
+#define POOL_MAX_POOLS 8
+#define POOL_MAGAZINE_SIZE 64
+#define POOL_MAX_MAGAZINES 4096 // above that, memory is returned to malloc
+
+struct pool_object {
+   struct pool_object *next;
+};
+
+struct pool_cache {
+   struct pool_object *objects;
+   size_t nb_objects;
+};
+
+static int nb_pools;
+static __thread struct pool_cache caches[POOL_MAX_POOLS];
+
+void pool_init(struct pool *p, const char *name, size_t object_size) {
+   p->name = name;
+   p->object_size = (object_size < sizeof(struct pool_object))?sizeof(struct pool_object):object_size;
+   p->id = __sync_fetch_and_add(&nb_pools, 1);
+   if(p->id >= POOL_MAX_POOLS)
+      die("Too many pools, increase POOL_MAX_POOLS\n");
+   pthread_mutex_init(&p->lock, NULL);
+   p->depot = calloc(POOL_MAX_MAGAZINES, sizeof(*p->depot));
+   p->nb_magazines = 0;
+}
+
+/* Move POOL_MAGAZINE_SIZE objects of the cache to the depot */
+static void pool_flush_magazine(struct pool *p, struct pool_cache *c) {
+   struct pool_object *head = c->objects, *tail = head;
+   for(size_t i = 1; i < POOL_MAGAZINE_SIZE; i++)
+      tail = tail->next;
+   c->objects = tail->next;
+   c->nb_objects -= POOL_MAGAZINE_SIZE;
+   tail->next = NULL;
+
+   pthread_mutex_lock(&p->lock);
+   if(p->nb_magazines < POOL_MAX_MAGAZINES) {
+      p->depot[p->nb_magazines++] = head; // a magazine is a list of POOL_MAGAZINE_SIZE objects
+      head = NULL;
+   }
+   pthread_mutex_unlock(&p->lock);
+
+   while(head) { // depot is full
+      struct pool_object *next = head->next;
+      free(head);
+      head = next;
+   }
+}
+
+/* Refill the cache with a magazine of the depot, returns 0 if the depot is empty */
+static int pool_get_magazine(struct pool *p, struct pool_cache *c) {
+   struct pool_object *magazine = NULL;
+   pthread_mutex_lock(&p->lock);
+   if(p->nb_magazines)
+      magazine = p->depot[--p->nb_magazines];
+   pthread_mutex_unlock(&p->lock);
+   if(!magazine)
+      return 0;
+
+   c->objects = magazine;
+   c->nb_objects = POOL_MAGAZINE_SIZE;
+   return 1;
+}
+
+void *pool_alloc(struct pool *p) {
+   struct pool_cache *c = &caches[p->id];
+   if(!c->objects && !pool_get_magazine(p, c))
+      return calloc(1, p->object_size);
+
+   struct pool_object *o = c->objects;
+   c->objects = o->next;
+   c->nb_objects--;
+   memset(o, 0, p->object_size);
+   return o;
+}
+
+void pool_free(struct pool *p, void *object) {
+   struct pool_cache *c = &caches[p->id];
+   struct pool_object *o = object;
+   o->next = c->objects;
+   c->objects = o;
+   c->nb_objects++;
+   if(c->nb_objects >= 2*POOL_MAGAZINE_SIZE)
+      pool_flush_magazine(p, c);
+}
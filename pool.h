@@ -0,0 +1,21 @@
+#ifndef POOL_H
+#define POOL_H 1
+
+/*
+ * Pool of fixed size objects with a per-thread cache (see pool.c).
+ * Objects are individually malloc'ed, so an object of a pool can still be released with free().
+ */
+struct pool {
+   const char *name;
+   size_t object_size;
+   int id;                                   // index of the per-thread cache of the pool
+   pthread_mutex_t lock;
+   void **depot;                             // full magazines (lists of objects) given back by threads that free more than they allocate
+   size_t nb_magazines;
+};
+
+void pool_init(struct pool *p, const char *name, size_t object_size);
+void *pool_alloc(struct pool *p);          // zeroed object
+void pool_free(struct pool *p, void *object);
+
+#endif
@@ -0,0 +1,125 @@
+#include "headers.h"
+
+/*
+ * Adaptive queue depth.
+ * A fixed QUEUE_DEPTH is either too low to saturate a fast drive or so high that requests only wait longer in the queue of a slower one.
+ * Instead, the workers of a disk share a budget of in-flight IOs (target) that follows the latency of the disk:
+ * - The IO engine reports the IOs it submits and, when a batch completes, how long the batch took.
+ * - Every ADAPTIVE_QD_WINDOW_US, the mean latency of the window is compared to the lowest one seen so far (baseline). Above
+ *   ADAPTIVE_QD_LATENCY_FACTOR times the baseline (and ADAPTIVE_QD_MIN_LATENCY_US), the disk is past the knee of its latency/throughput
+ *   curve: the target shrinks by 1/4.
+ *   Otherwise, if the workers had more requests than their budget, the target grows by one IO per worker (AIMD).
+ * - The baseline slowly drifts up, so that a disk that got slower (e.g., garbage collection of the drive) does not shrink the target forever.
+ * Workers dequeue at most target - in_flight requests (see worker_dequeue_requests), the budget is soft: workers of the same disk might
+ * dequeue at the same time and go a little over.
+ */
+struct queue_depth {
+   int disk;
+   size_t nb_workers;
+   size_t min_target, max_target;
+
+   volatile size_t target __attribute__((aligned(64)));
+   volatile size_t in_flight __attribute__((aligned(64)));
+
+   /* Current window, updated by all the workers of the disk */
+   volatile uint64_t window_latency __attribute__((aligned(64)));  // sum of the latencies of the IOs
+   volatile uint64_t window_ios;
+   volatile int window_limited;
+   uint64_t window_start;
+   double baseline;                                                // lowest mean latency of a window, in us
+   pthread_mutex_t lock;                                           // only one worker closes the window
+};
+
+static struct queue_depth *queue_depths;
+
+void queue_depth_init(int nb_disks, int nb_workers_per_disk) {
+   queue_depths = calloc(nb_disks, sizeof(*queue_depths));
+   for(int i = 0; i < nb_disks; i++) {
+      struct queue_depth *qd = &queue_depths[i];
+      qd->disk = i;
+      qd->nb_workers = nb_workers_per_disk;
+      qd->min_target = ADAPTIVE_QD_MIN;
+      qd->max_target = nb_workers_per_disk * MAX_NB_PENDING_CALLBACKS_PER_WORKER;
+      qd->target = nb_workers_per_disk * QUEUE_DEPTH;
+      if(qd->target > qd->max_target)
+         qd->target = qd->max_target;
+      rdtscll(qd->window_start);
+      pthread_mutex_init(&qd->lock, NULL);
+   }
+}
+
+struct queue_depth *get_queue_depth(int disk) {
+   if(!ADAPTIVE_QUEUE_DEPTH || !queue_depths)
+      return NULL;
+   return &queue_depths[disk];
+}
+
+static void close_window(struct queue_depth *qd, uint64_t now) {
+   static __thread declare_periodic_count;
+   uint64_t nb_ios = qd->window_ios;
+   if(!nb_ios)
+      return; // idle, or everything was cached
+
+   uint64_t latency = qd->window_latency / nb_ios;
+   int limited = qd->window_limited;
+   __sync_fetch_and_sub(&qd->window_latency, latency * nb_ios);
+   __sync_fetch_and_sub(&qd->window_ios, nb_ios);
+   qd->window_limited = 0;
+   qd->window_start = now;
+
+   if(!qd->baseline || latency < qd->baseline)
+      qd->baseline = latency;
+   else
+      qd->baseline *= 1.001; // doubles after ~7s of windows above the baseline
+
+   size_t target = qd->target;
+   if(latency > qd->baseline * ADAPTIVE_QD_LATENCY_FACTOR && latency > ADAPTIVE_QD_MIN_LATENCY_US)
+      target -= target / 4;
+   else if(limited)
+      target += qd->nb_workers;
+   if(target < qd->min_target)
+      target = qd->min_target;
+   if(target > qd->max_target)
+      target = qd->max_target;
+   qd->target = target;
+
+   periodic_count(1000, "[DISK %d] Queue depth %lu (latency %lu us, baseline %lu us)", qd->disk, target, latency, (uint64_t)qd->baseline);
+}
+
+void queue_depth_submitted(struct queue_depth *qd, size_t nb_ios) {
+   if(!qd)
+      return;
+   __sync_fetch_and_add(&qd->in_flight, nb_ios);
+}
+
+void queue_depth_completed(struct queue_depth *qd, size_t nb_ios, uint64_t latency_us) {
+   if(!qd)
+      return;
+   __sync_fetch_and_sub(&qd->in_flight, nb_ios);
+   __sync_fetch_and_add(&qd->window_latency, latency_us * nb_ios);
+   __sync_fetch_and_add(&qd->window_ios, nb_ios);
+
+   uint64_t now;
+   rdtscll(now);
+   if(cycles_to_us(now - qd->window_start) < ADAPTIVE_QD_WINDOW_US || pthread_mutex_trylock(&qd->lock))
+      return;
+   if(cycles_to_us(now - qd->window_start) >= ADAPTIVE_QD_WINDOW_US) // another worker might have closed it
+      close_window(qd, now);
+   pthread_mutex_unlock(&qd->lock);
+}
+
+size_t queue_depth_budget(struct queue_depth *qd) {
+   if(!qd)
+      return -1;
+   size_t target = qd->target, in_flight = qd->in_flight;
+   return (in_flight < target)?(target - in_flight):1;
+}
+
+void queue_depth_limited(struct queue_depth *qd) {
+   if(qd && !qd->window_limited)
+      qd->window_limited = 1;
+}
+
+size_t queue_depth_target(struct queue_depth *qd) {
+   return qd?qd->target:0;
+}
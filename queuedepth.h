@@ -0,0 +1,18 @@
+#ifndef QUEUEDEPTH_H
+#define QUEUEDEPTH_H 1
+
+struct queue_depth;
+
+void queue_depth_init(int nb_disks, int nb_workers_per_disk);
+struct queue_depth *get_queue_depth(int disk);
+
+/* Called by the IO engine of the workers of the disk */
+void queue_depth_submitted(struct queue_depth *qd, size_t nb_ios);
+void queue_depth_completed(struct queue_depth *qd, size_t nb_ios, uint64_t latency_us);
+
+/* Number of IOs a worker of the disk may start, at least 1 when the worker has no IO in flight (called between two batches of requests) */
+size_t queue_depth_budget(struct queue_depth *qd);
+void queue_depth_limited(struct queue_depth *qd);                 // a worker had more requests than its budget
+size_t queue_depth_target(struct queue_depth *qd);
+
+#endif
@@ -1,4 +1,5 @@
 #include "headers.h"
+#include <time.h>
 #include "utils.h"
 #include "items.h"
 #include "slab.h"
@@ -11,10 +12,24 @@
  * The size of items is in slab->item_size.
  *
  * Format is [ [size_t rdt1, size_t key_size1, size_t value_size1][key1][value1][maybe some empty space]     [rdt2, key_size2, value_size2][key2]etc. ]
+ * Items with a TTL have their expiration time right after their value (see ITEM_HAS_TTL in items.h).
  *
  * When an idem is deleted its key_size becomes -1. value_size is then equal to a next free idx in the slab.
  * That way, when we reuse an empty spot, we know where the next one is.
  *
+ * Deletes (kv_remove_async) do not erase the item, because snapshots might still read it and because recovery would then find its
+ * older copies. A delete is an update that writes a tombstone (key only, value_size == TOMBSTONE_VALUE_SIZE) in a new spot:
+ * - the index keeps the location of the tombstone with the deleted flag; requests see a deleted item, snapshots older than the tombstone
+ *   still read the old versions, and recovery keeps the most recent of the tombstone and the older copies as usual;
+ * - the old version is freed by the GC like the old version of any update;
+ * - once no snapshot can read the old versions and the old version has been freed, the sweeper checks that no copy of the key is left in
+ *   a free spot before removing the key from the index and freeing the spot of the tombstone (see sweeper.c).
+ * Adding a key that has a tombstone replaces the tombstone like an update.
+ *
+ *
+ * Items bigger than PAGE_SIZE go in slabs whose item size is a multiple of PAGE_SIZE (see slab_sizes in slabworker.c). In these slabs an item is
+ * an "extent" of contiguous pages: slab->page_size is the item size instead of PAGE_SIZE, the item is read or written with a single IO, and the
+ * extent is cached in a page cache of the worker whose frames have the size of the extent (slab->pagecache).
  *
  * This whole file assumes that when a file is newly created, then all the data is equal to 0. This should be true on Linux.
  *
@@ -30,22 +45,62 @@
  *       - finish_update_cb sees that [callback->old_slab] is set ==> need to delete old value
  */
 
+/*
+ * Callbacks are allocated for every request, they come from a pool (see pool.c) and must be released with free_slab_callback.
+ */
+static struct pool callback_pool;
+__attribute__((constructor)) static void init_callback_pool(void) {
+   pool_init(&callback_pool, "slab_callback", sizeof(struct slab_callback));
+}
+
 struct slab_callback *new_slab_callback(void) {
-   return calloc(1, sizeof(struct slab_callback));
+   return pool_alloc(&callback_pool);
+}
+
+void free_slab_callback(struct slab_callback *cb) {
+   pool_free(&callback_pool, cb);
 }
 
 /*
  * Where is my item in the slab?
  */
 off_t item_page_num(struct slab *s, size_t idx) {
-   size_t items_per_page = PAGE_SIZE/s->item_size;
+   size_t items_per_page = s->page_size/s->item_size;
    return idx / items_per_page;
 }
-static off_t item_in_page_offset(struct slab *s, size_t idx) {
-   size_t items_per_page = PAGE_SIZE/s->item_size;
+off_t item_in_page_offset(struct slab *s, size_t idx) {
+   size_t items_per_page = s->page_size/s->item_size;
    return (idx % items_per_page)*s->item_size;
 }
 
+/*
+ * When does the item in a spot expire? Set when an item is written in the spot or recovered, 4 bytes per spot once the slab contains an item
+ * with a TTL (0 = never). The index only points to the spots of current versions, so lookups find the expiration time of the item they return.
+ */
+void slab_set_expiry(struct slab *s, size_t idx, uint64_t expires) {
+   if(idx >= s->expires_capacity) {
+      if(!expires) // slabs without TTL do not pay for the array
+         return;
+      size_t old_capacity = s->expires_capacity, new_capacity = old_capacity?old_capacity:4096;
+      while(new_capacity <= idx)
+         new_capacity *= 2;
+      s->expires = realloc(s->expires, new_capacity*sizeof(*s->expires));
+      memset(&s->expires[old_capacity], 0, (new_capacity - old_capacity)*sizeof(*s->expires));
+      s->expires_capacity = new_capacity;
+   }
+   s->expires[idx] = (expires > UINT32_MAX)?UINT32_MAX:expires;
+}
+
+uint64_t slab_get_expiry(struct slab *s, size_t idx) {
+   return (idx < s->expires_capacity)?s->expires[idx]:0;
+}
+
+int slab_spot_expired(struct slab *s, size_t idx) {
+   if(!s || idx >= s->expires_capacity || !s->expires[idx])
+      return 0;
+   return s->expires[idx] <= time(NULL);
+}
+
 /*
  * When first loading a slab from disk we need to rebuild the in memory tree, these functions do that.
  */
@@ -59,6 +114,7 @@ static void add_existing_item(struct slab *s, size_t idx, void *_item, struct sl
       s->nb_items++;
       if(idx > s->last_item)
          s->last_item = idx;
+      slab_set_expiry(s, idx, item_get_expires(_item));
       if(item->rdt > get_rdt(s->ctx)) // Remember the maximum timestamp existing in the DB
          set_rdt(s->ctx, item->rdt);
       //print_item(item->rdt, item);
@@ -73,12 +129,12 @@ static void add_existing_item(struct slab *s, size_t idx, void *_item, struct sl
 
 static void process_existing_chunk(int slab_worker_id, struct slab *s, size_t nb_files, size_t file_idx, char *data, size_t start, size_t length, struct slab_callback *callback) {
    static __thread declare_periodic_count;
-   size_t nb_items_per_page = PAGE_SIZE / s->item_size;
-   size_t nb_pages = length / PAGE_SIZE;
+   size_t nb_items_per_page = s->page_size / s->item_size;
+   size_t nb_pages = length / s->page_size;
    for(size_t p = 0; p < nb_pages; p++) {
-      size_t page_num = ((start + p*PAGE_SIZE) / PAGE_SIZE); // Physical page to virtual page
+      size_t page_num = ((start + p*s->page_size) / s->page_size); // Physical page to virtual page
       size_t base_idx = page_num*nb_items_per_page*nb_files + file_idx*nb_items_per_page;
-      size_t current = p*PAGE_SIZE;
+      size_t current = p*s->page_size;
       for(size_t i = 0; i < nb_items_per_page; i++) {
          add_existing_item(s, base_idx, &data[current], callback);
          base_idx++;
@@ -88,45 +144,208 @@ static void process_existing_chunk(int slab_worker_id, struct slab *s, size_t nb
    }
 }
 
-#define GRANULARITY_REBUILD (2*1024*1024) // We rebuild 2MB by 2MB
-static void rebuild_index(int slab_worker_id, struct slab *s, struct slab_callback *callback) {
-   char *cached_data = aligned_alloc(PAGE_SIZE, GRANULARITY_REBUILD);
-
-   int fd = s->fd;
-   size_t start = 0, end;
-   while(1) {
-      end = start + GRANULARITY_REBUILD;
-      if(end > s->size_on_disk)
-         end = s->size_on_disk;
-      if( ((end - start) % PAGE_SIZE) != 0)
-         end = end - (end % PAGE_SIZE);
-      if( ((end - start) % PAGE_SIZE) != 0)
-         die("File size is wrong (%%PAGE_SIZE!=0)\n");
-      if(end == start)
-         break;
-      int r = pread(fd, cached_data, end - start, start);
-      if(r != end - start)
-         perr("pread failed! Read %d instead of %lu (offset %lu)\n", r, end-start, start);
-      process_existing_chunk(slab_worker_id, s, 1, 0, cached_data, start, end-start, callback);
-      start = end;
+/*
+ * All the slabs of a worker are rebuilt at once. The files are cut in chunks of GRANULARITY_REBUILD bytes, interleaved so that all the files
+ * are read in parallel. REBUILD_THREADS_PER_WORKER helper threads read the chunks in REBUILD_QUEUE_DEPTH buffers while the worker parses
+ * them in order (only the worker modifies its index). Chunk i is read in buffer i % REBUILD_QUEUE_DEPTH, once chunk i - REBUILD_QUEUE_DEPTH has been parsed.
+ */
+#define GRANULARITY_REBUILD (2*1024*1024) // We rebuild 2MB by 2MB, must be a multiple of the page size of all slabs
+struct rebuild_chunk {
+   struct slab *slab;
+   size_t start, end;
+};
+
+struct rebuild_context {
+   struct rebuild_chunk *chunks;
+   size_t nb_chunks;
+   char *buffers[REBUILD_QUEUE_DEPTH];
+   int ready[REBUILD_QUEUE_DEPTH];       // 1 when the chunk has been read in the buffer
+   size_t next_chunk;                    // next chunk to read
+   size_t nb_parsed;                     // chunks < nb_parsed have been parsed, their buffer can be reused
+   pthread_mutex_t lock;
+   pthread_cond_t chunk_read, chunk_parsed;
+};
+
+static size_t recovered_bytes;
+size_t get_recovered_bytes(void) {
+   return recovered_bytes;
+}
+
+static void *rebuild_helper(void *pdata) {
+   struct rebuild_context *r = pdata;
+   pthread_mutex_lock(&r->lock);
+   while(r->next_chunk < r->nb_chunks) {
+      size_t c = r->next_chunk++;
+      while(c >= r->nb_parsed + REBUILD_QUEUE_DEPTH) // buffer still contains a chunk that has not been parsed
+         pthread_cond_wait(&r->chunk_parsed, &r->lock);
+      pthread_mutex_unlock(&r->lock);
+
+      struct rebuild_chunk *chunk = &r->chunks[c];
+      size_t length = chunk->end - chunk->start;
+      ssize_t res = pread(chunk->slab->fd, r->buffers[c % REBUILD_QUEUE_DEPTH], length, chunk->start);
+      if(res != length)
+         perr("pread failed! Read %ld instead of %lu (offset %lu)\n", res, length, chunk->start);
+      __sync_fetch_and_add(&recovered_bytes, length);
+
+      pthread_mutex_lock(&r->lock);
+      r->ready[c % REBUILD_QUEUE_DEPTH] = 1;
+      pthread_cond_broadcast(&r->chunk_read);
+   }
+   pthread_mutex_unlock(&r->lock);
+   return NULL;
+}
+
+/* Read the chunks with the helper threads and parse them in order */
+static void rebuild_chunks(int slab_worker_id, struct rebuild_chunk *chunks, size_t nb_chunks, struct slab_callback *callback) {
+   struct rebuild_context r;
+   memset(&r, 0, sizeof(r));
+   pthread_mutex_init(&r.lock, NULL);
+   pthread_cond_init(&r.chunk_read, NULL);
+   pthread_cond_init(&r.chunk_parsed, NULL);
+   r.chunks = chunks;
+   r.nb_chunks = nb_chunks;
+   for(size_t i = 0; i < REBUILD_QUEUE_DEPTH; i++)
+      r.buffers[i] = aligned_alloc(PAGE_SIZE, GRANULARITY_REBUILD);
+
+   pthread_t helpers[REBUILD_THREADS_PER_WORKER];
+   for(size_t i = 0; i < REBUILD_THREADS_PER_WORKER; i++)
+      pthread_create(&helpers[i], NULL, rebuild_helper, &r);
+
+   for(size_t c = 0; c < r.nb_chunks; c++) {
+      struct rebuild_chunk *chunk = &r.chunks[c];
+      pthread_mutex_lock(&r.lock);
+      while(!r.ready[c % REBUILD_QUEUE_DEPTH])
+         pthread_cond_wait(&r.chunk_read, &r.lock);
+      r.ready[c % REBUILD_QUEUE_DEPTH] = 0;
+      pthread_mutex_unlock(&r.lock);
+
+      callback->slab = chunk->slab;
+      process_existing_chunk(slab_worker_id, chunk->slab, 1, 0, r.buffers[c % REBUILD_QUEUE_DEPTH], chunk->start, chunk->end - chunk->start, callback);
+
+      pthread_mutex_lock(&r.lock);
+      r.nb_parsed = c + 1;
+      pthread_cond_broadcast(&r.chunk_parsed);
+      pthread_mutex_unlock(&r.lock);
+   }
+
+   for(size_t i = 0; i < REBUILD_THREADS_PER_WORKER; i++)
+      pthread_join(helpers[i], NULL);
+   for(size_t i = 0; i < REBUILD_QUEUE_DEPTH; i++)
+      free(r.buffers[i]);
+}
+
+/* Does the file contain data? */
+static int slab_needs_rebuild(struct slab *s) {
+   struct item_metadata *meta = read_item(s, 0);
+   return meta->key_size != 0; // if the key_size is not 0 then then file has been written before
+}
 
+/*
+ * Rebuild the index of all the slabs of a worker. @callback is called on all the items of the slabs.
+ * The slabs that contain data are cut in chunks, the i-th chunks of all the slabs are next to each other.
+ */
+void rebuild_slabs(int slab_worker_id, struct slab **slabs, size_t nb_slabs, struct slab_callback *callback) {
+   struct slab **to_rebuild = calloc(nb_slabs, sizeof(*to_rebuild));
+   size_t *next_start = calloc(nb_slabs, sizeof(*next_start));
+   size_t nb_chunks = 0, max_chunks = 0;
+   for(size_t i = 0; i < nb_slabs; i++) {
+      if(slab_needs_rebuild(slabs[i])) {
+         to_rebuild[i] = slabs[i];
+         max_chunks += slabs[i]->size_on_disk / GRANULARITY_REBUILD + 1;
+      }
    }
-   free(cached_data);
-   s->last_item++;
+
+   struct rebuild_chunk *chunks = calloc(max_chunks, sizeof(*chunks));
+   int done;
+   do {
+      done = 1;
+      for(size_t i = 0; i < nb_slabs; i++) {
+         struct slab *s = to_rebuild[i];
+         if(!s)
+            continue;
+         size_t start = next_start[i], end = start + GRANULARITY_REBUILD;
+         if(end > s->size_on_disk)
+            end = s->size_on_disk;
+         end = end - ((end - start) % s->page_size);
+         if(end == start)
+            continue;
+         chunks[nb_chunks++] = (struct rebuild_chunk) { .slab = s, .start = start, .end = end };
+         next_start[i] = end;
+         done = 0;
+      }
+   } while(!done);
+
+   rebuild_chunks(slab_worker_id, chunks, nb_chunks, callback);
+
+   for(size_t i = 0; i < nb_slabs; i++)
+      if(to_rebuild[i])
+         to_rebuild[i]->last_item++;
+   free(chunks);
+   free(next_start);
+   free(to_rebuild);
 }
 
+/*
+ * Only scan some pages of the slabs (used to replay the pages written after a checkpoint, see checkpoint.c).
+ * @pages[i] is the sorted list of the @nb_pages[i] pages of slabs[i] to scan. Consecutive pages are read together.
+ */
+void rebuild_slab_pages(int slab_worker_id, struct slab **slabs, size_t nb_slabs, uint64_t **pages, size_t *nb_pages, struct slab_callback *callback) {
+   size_t nb_chunks = 0, max_chunks = 0;
+   for(size_t i = 0; i < nb_slabs; i++)
+      max_chunks += nb_pages[i];
+
+   struct rebuild_chunk *chunks = calloc(max_chunks, sizeof(*chunks));
+   for(size_t i = 0; i < nb_slabs; i++) {
+      struct slab *s = slabs[i];
+      for(size_t p = 0; p < nb_pages[i]; p++) {
+         size_t start = pages[i][p] * s->page_size;
+         if(start >= s->size_on_disk)
+            break;
+         if(nb_chunks && chunks[nb_chunks-1].slab == s && chunks[nb_chunks-1].end == start && start + s->page_size - chunks[nb_chunks-1].start <= GRANULARITY_REBUILD)
+            chunks[nb_chunks-1].end += s->page_size;
+         else
+            chunks[nb_chunks++] = (struct rebuild_chunk) { .slab = s, .start = start, .end = start + s->page_size };
+      }
+      if(nb_pages[i] && s->last_item) // last_item is a number of items, the rebuild computes the maximum index
+         s->last_item--;
+   }
+
+   rebuild_chunks(slab_worker_id, chunks, nb_chunks, callback);
+
+   for(size_t i = 0; i < nb_slabs; i++)
+      if(nb_pages[i])
+         slabs[i]->last_item++;
+   free(chunks);
+}
 
 
 
+/*
+ * All the slabs of the DB. The in-memory index stores the position of a slab in this array (16 bits) instead of a pointer.
+ * Position 0 is never used, it means "no slab".
+ */
+static struct slab *slabs_by_id[MAX_NB_SLABS];
+static size_t nb_slabs;
+
+struct slab* get_slab_from_id(size_t id) {
+   return slabs_by_id[id];
+}
+
 /*
  * Create a slab: a file that only contains items of a given size.
  * @callback is a callback that will be called on all previously existing items of the slab if it is restored from disk.
+ * If @callback is NULL, the index is not rebuilt, rebuild_slabs must be called later (to rebuild all the slabs of a worker in parallel).
  */
 static struct slab* _create_slab(struct slab_context *ctx, int slab_worker_id, size_t item_size, struct slab_callback *callback, int is_transaction) {
    struct stat sb;
    char path[512];
    struct slab *s = calloc(1, sizeof(*s));
 
+   s->id = __sync_add_and_fetch(&nb_slabs, 1); // slabs are created in parallel by the workers
+   if(s->id >= MAX_NB_SLABS)
+      die("Too many slabs, the index cannot reference more than %lu slabs\n", MAX_NB_SLABS - 1);
+   slabs_by_id[s->id] = s; // must be set before rebuilding the index
+
    size_t disk = slab_worker_id / (get_nb_workers()/get_nb_disks());
    if(is_transaction)
       sprintf(path, PATH_TRANSACTIONS, disk, slab_worker_id, item_size);
@@ -135,28 +354,32 @@ static struct slab* _create_slab(struct slab_context *ctx, int slab_worker_id, s
    s->fd = open(path,  O_RDWR | O_CREAT | O_DIRECT, 0777);
    if(s->fd == -1)
       perr("Cannot allocate slab %s", path);
+   ioengine_register_file(get_io_context(ctx), s->fd);
+
+   s->item_size = item_size;
+   s->page_size = (item_size > PAGE_SIZE)?item_size:PAGE_SIZE;
+   if(s->page_size % PAGE_SIZE || GRANULARITY_REBUILD % s->page_size)
+      die("Items bigger than a page must have a size multiple of PAGE_SIZE (%lu)\n", item_size);
+   s->pagecache = (s->page_size == PAGE_SIZE)?get_pagecache(ctx, PAGE_SIZE):NULL; // extent caches are created by the first IO of the slab
 
    fstat(s->fd, &sb);
    s->size_on_disk = sb.st_size;
-   if(s->size_on_disk < 2*PAGE_SIZE) {
-      fallocate(s->fd, 0, 0, 2*PAGE_SIZE);
-      s->size_on_disk = 2*PAGE_SIZE;
+   if(s->size_on_disk < 2*s->page_size) {
+      fallocate(s->fd, 0, 0, 2*s->page_size);
+      s->size_on_disk = 2*s->page_size;
    }
 
-   size_t nb_items_per_page = PAGE_SIZE / item_size;
-   s->nb_max_items = s->size_on_disk / PAGE_SIZE * nb_items_per_page;
+   size_t nb_items_per_page = s->page_size / item_size;
+   s->nb_max_items = s->size_on_disk / s->page_size * nb_items_per_page;
    s->nb_items = 0;
-   s->item_size = item_size;
-   s->nb_partially_freed_items = 0;
+   freelist_init(s);
+   s->compacting_from = -1;
    s->last_item = 0;
    s->ctx = ctx;
 
    // Read the first page and rebuild the index if the file contains data
-   struct item_metadata *meta = read_item(s, 0);
-   if(meta->key_size != 0) { // if the key_size is not 0 then then file has been written before
-      callback->slab = s;
-      rebuild_index(slab_worker_id, s, callback);
-   }
+   if(callback)
+      rebuild_slabs(slab_worker_id, &s, 1, callback);
 
    return s;
 }
@@ -179,12 +402,13 @@ struct slab* resize_slab(struct slab *s) {
          perr("Cannot resize slab (item size %lu) new size %lu\n", s->item_size, s->size_on_disk);
       s->nb_max_items *= 2;
    } else {
-      size_t nb_items_per_page = PAGE_SIZE / s->item_size;
+      size_t nb_items_per_page = s->page_size / s->item_size;
       //s->size_on_disk += 10000000000LU;
       s->size_on_disk += 1000000000LU;
+      s->size_on_disk -= s->size_on_disk % s->page_size;
       if(fallocate(s->fd, 0, 0, s->size_on_disk))
          perr("Cannot resize slab (item size %lu) new size %lu\n", s->item_size, s->size_on_disk);
-      s->nb_max_items = s->size_on_disk / PAGE_SIZE * nb_items_per_page;
+      s->nb_max_items = s->size_on_disk / s->page_size * nb_items_per_page;
    }
    return s;
 }
@@ -198,7 +422,7 @@ struct slab* resize_slab(struct slab *s) {
  */
 void *read_item(struct slab *s, size_t idx) {
    size_t page_num = item_page_num(s, idx);
-   char *disk_data = safe_pread(s->fd, page_num*PAGE_SIZE);
+   char *disk_data = safe_pread(s->fd, page_num*s->page_size, s->page_size);
    return &disk_data[item_in_page_offset(s, idx)];
 }
 
@@ -206,31 +430,10 @@ void write_item(struct slab *s, size_t idx, void *data) {
    size_t page_num = item_page_num(s, idx);
    size_t offset = item_in_page_offset(s, idx);
    size_t size = get_item_size(data);
-   safe_pwrite(s->fd, page_num*PAGE_SIZE, offset, size, data);
+   safe_pwrite(s->fd, page_num*s->page_size, s->page_size, offset, size, data);
    return;
 }
 
-/*
- * Helper function:
- * Because the indexes only store prefixes, we might try to update the wrong location. Check that here!
- */
-static void check_if_keys_match(char *old_item, char *new_item) {
-   struct item_metadata *new_meta = (void*)new_item;
-   struct item_metadata *old_meta = (void*)old_item;
-
-   size_t new_key_size = new_meta->key_size;
-   size_t old_key_size = old_meta->key_size;
-   if(new_key_size != old_key_size) {
-      die("Updating an item, but key size changed! Likely this is because 2 keys have the same prefix in the index and we got confused because they have the same prefix. TODO: make the index more robust by detecting that 2 keys have the same prefix and transforming the prefix -> slab_idx to prefix -> [ { full key 1, slab_idx1 }, { full key 2, slab_idx2 } ]\n");
-   }
-
-   char *new_key = &new_item[sizeof(*new_meta)];
-   char *old_key = &old_item[sizeof(*old_meta)];
-   if(memcmp(new_key, old_key, new_key_size))
-      die("Updating an item, but key mismatch! Likely this is because 2 keys have the same prefix in the index. TODO: make the index more robust by detecting that 2 keys have the same prefix and transforming the prefix -> slab_idx to prefix -> [ { full key 1, slab_idx1 }, { full key 2, slab_idx2 } ]\n");
-}
-
-
 /*
  * Asynchronous read
  * - read_item_async creates a callback for the ioengine and queues the io request
@@ -239,7 +442,13 @@ static void check_if_keys_match(char *old_item, char *new_item) {
 static void read_item_async_cb(struct slab_callback *callback) {
    char *disk_page = callback->lru_entry->page;
    off_t in_page_offset = item_in_page_offset(callback->slab, callback->slab_idx);
-   call_callback(callback, &disk_page[in_page_offset]);
+   char *item = &disk_page[in_page_offset];
+   if(callback->action == READ && item_get_key_hash(item) == item_get_key_hash(callback->item) && !item_keys_match(item, callback->item))
+      item = NULL; // the fingerprint of the key belongs to another key, so the key is not in the DB
+   else if(TRANSACTION_TYPE == TRANS_LONG && (callback->action == READ_NEXT || callback->action == READ_NEXT_BATCH || callback->action == READ_NEXT_BATCH_CLONE)
+         && (((struct item_metadata*)item)->key_size == -1 || memory_index_get_hash(get_worker(callback->slab), item) != callback->next_key))
+      callback->raced = 1; // the spot has been reused by another key, see check_races_and_call (the key might use an alias, so check it here)
+   call_callback(callback, item);
 }
 
 void read_item_async(struct slab_callback *callback) {
@@ -259,6 +468,10 @@ static void finish_update_cb(struct slab_callback *callback) {
       /* Mark the old spot as deleted but don't actually delete it, put in in the free list instead */
       add_item_in_gc(get_gc_for_item(callback->item), callback, index_rdt);
 
+      /* A delete: the tombstone is dropped from the index once the old versions are gone (see sweeper.c) */
+      if(callback->action == DELETE)
+         add_tombstone_in_gc(get_gc_for_item(callback->item), callback, index_rdt);
+
       /* Complete the call */
       call_callback(callback, NULL);
    } else { // update complete, return the updated item
@@ -266,6 +479,79 @@ static void finish_update_cb(struct slab_callback *callback) {
    }
 }
 
+/* The write is only complete once it is durable, see DURABILITY_MODE */
+static void written_cb(struct slab_callback *callback) {
+   callback->io_cb = finish_update_cb;
+   sync_page_async(callback);
+}
+
+/*
+ * The index only knows the fingerprints of the keys (see in-memory-index.c). When the fingerprint of a new key is already in the index,
+ * the item that owns the fingerprint is read: if it has the same key, the key really is in the DB; otherwise the new key gets its
+ * own fingerprint and is added normally.
+ */
+static void add_colliding_item(struct slab_callback *callback, char *old_item) {
+   if(item_keys_match(old_item, callback->item))
+      die("Adding item that is already in the database! Use update instead!\n");
+   memory_index_add_alias(get_worker(callback->slab), callback->item);
+   callback->action = ADD;
+   callback->slab = get_item_slab(callback->item);
+   callback->slab_idx = -1;
+   callback->lru_entry = NULL;
+   add_item_async(callback);
+}
+
+static void add_colliding_item_async_cb(struct slab_callback *callback) {
+   char *disk_page = callback->lru_entry->page;
+   add_colliding_item(callback, &disk_page[item_in_page_offset(callback->slab, callback->slab_idx)]);
+}
+
+void add_colliding_item_async(struct slab_callback *callback) {
+   callback->io_cb = add_colliding_item_async_cb;
+   read_page_async(callback);
+}
+
+/*
+ * A transaction locked the entry of the fingerprint of its key, but we could not tell from the index that the key owns it (see
+ * memory_index_key_is_owner). Read the owner: if it is another key, release its entry and lock or reserve the key under its own alias.
+ */
+static void lock_colliding_item(struct slab_callback *callback) {
+   int worker_id = get_worker(callback->slab);
+   int present, allowed;
+   memory_index_unlock(worker_id, item_get_key_hash(callback->item));
+   memory_index_add_alias(worker_id, callback->item);
+   index_entry_t *e = memory_index_lookup_and_lock(worker_id, callback->item, callback, get_transaction_id(callback->transaction), &present, &allowed);
+   if(!present)
+      memory_index_reserve(worker_id, callback->item, get_transaction_id(callback->transaction));
+   callback->failed = !allowed;
+   callback->lru_entry = NULL;
+   if(e && e->slab && callback->action == READ_FOR_WRITE) { // a concurrent ADD indexed the key under its alias while we were reading
+      callback->slab = e->slab;
+      callback->slab_idx = e->slab_idx;
+      lock_item_async(callback);
+   } else {
+      callback->slab = NULL;
+      callback->slab_idx = -1;
+      call_callback(callback, NULL);
+   }
+}
+
+static void lock_item_async_cb(struct slab_callback *callback) {
+   char *disk_page = callback->lru_entry->page;
+   char *item = &disk_page[item_in_page_offset(callback->slab, callback->slab_idx)];
+   if(!item_keys_match(item, callback->item))
+      lock_colliding_item(callback);
+   else if(callback->action == READ_FOR_WRITE)
+      call_callback(callback, (item_is_tombstone(item) || slab_spot_expired(callback->slab, callback->slab_idx))?NULL:item);
+   else
+      call_callback(callback, NULL);
+}
+
+void lock_item_async(struct slab_callback *callback) {
+   callback->io_cb = lock_item_async_cb;
+   read_page_async(callback);
+}
+
 /*
  * Generic function called to write the new version of the item on disk.
  * - First read the page where the item is staying
@@ -282,6 +568,15 @@ static void generic_add_or_update_with_location_cb1(struct slab_callback *callba
    off_t offset_in_page = item_in_page_offset(s, idx);
    void *old_item = &disk_page[offset_in_page];
 
+   if((callback->action == UPDATE_IN_PLACE || callback->action == ADD_OR_UPDATE_IN_PLACE) && !item_keys_match(item, old_item)) {
+      // The index gave us the location of another key that has the same fingerprint, our key is not in the DB
+      if(callback->action == ADD_OR_UPDATE_IN_PLACE)
+         add_colliding_item(callback, old_item);
+      else
+         call_callback(callback, NULL);
+      return;
+   }
+
    if(callback->propagate_value_until && TRANSACTION_TYPE == TRANS_LONG && callback->action != START_TRANSACTION_COMMIT) { // do not propagate commit id on disk, these are never scanned
       transaction_propagate(old_item, callback->propagate_value_until);
       memory_index_clean_specific_version(old_item);
@@ -292,9 +587,11 @@ static void generic_add_or_update_with_location_cb1(struct slab_callback *callba
    else
       meta->rdt = get_rdt(s->ctx);
 
-   if(callback->action == UPDATE_IN_PLACE) {
-      check_if_keys_match(item, &disk_page[offset_in_page]);
+   if(callback->action == ADD && memory_index_is_deleted(get_worker(s), item)) { // the key has been deleted or has expired, the new item replaces it like an update
+      callback->needs_cleanup = 1;
    } else if(callback->action == ADD || callback->action == START_TRANSACTION_COMMIT) { // Not an in place update, and the item had no location before, it is a new item, so we add it in the tree!
+      if(callback->action == ADD && memory_index_lookup(get_worker(s), NULL, item, -1, NULL))
+         memory_index_add_alias(get_worker(s), item); // a concurrent ADD of another key with the same fingerprint was indexed first
       memory_index_add(callback, item); // must happen after setting ->rdt!
    }
 
@@ -304,8 +601,9 @@ static void generic_add_or_update_with_location_cb1(struct slab_callback *callba
       die("Trying to write an item that is too big for its slab\n");
    else
       memcpy(&disk_page[offset_in_page], item, get_item_size(item));
+   slab_set_expiry(s, idx, (meta->key_size == -1)?0:item_get_expires(item));
 
-   callback->io_cb = finish_update_cb;
+   callback->io_cb = written_cb;
    write_page_async(callback);
 }
 
@@ -350,41 +648,36 @@ void update_item_async(struct slab_callback *callback) {
 }
 
 /*
- * Remove an item
+ * Remove an item: the index only knows the fingerprint of the key, so first check that the item at the location given by the index has
+ * our key, then write a tombstone in a new spot (see the top of this file).
  */
 static void remove_item_async_cb1(struct slab_callback *callback) {
    char *disk_page = callback->lru_entry->page;
+   char *old_item = &disk_page[item_in_page_offset(callback->slab, callback->slab_idx)];
+   struct item_metadata *meta = callback->item;
 
-   struct slab *s = callback->slab;
-   size_t idx = callback->slab_idx;
-
-   off_t offset_in_page = item_in_page_offset(s, idx);
-   struct item_metadata *meta = (void*)&disk_page[offset_in_page];
-
-   if(meta->key_size == -1) { // already removed
-      if(callback->cb)
-         call_callback(callback, NULL);
+   if(!item_keys_match(old_item, callback->item)) { // another key has the same fingerprint, our key is not in the DB
+      callback->slab = NULL;
+      callback->slab_idx = -1;
+      call_callback(callback, NULL);
       return;
    }
 
-   meta->rdt = get_rdt(s->ctx);
-   meta->key_size = -1;
-
-   s->nb_items--;
-
-   add_item_in_partially_freed_list(s, idx, 0);
-   callback->io_cb = finish_update_cb;
-   write_page_async(callback);
+   meta->value_size = TOMBSTONE_VALUE_SIZE; // also drops the expiration time of the item
+   callback->slab = get_item_slab(callback->item);
+   callback->slab_idx = -1;
+   callback->lru_entry = NULL;
+   callback->needs_cleanup = 1;
+   update_item_async(callback);
 }
 
-
 void remove_item_async(struct slab_callback *callback) {
    callback->io_cb = remove_item_async_cb1;
    read_page_async(callback);
 }
 
 struct slab_callback *clone_callback(struct slab_callback *cb) {
-   struct slab_callback *ncb = malloc(sizeof(*ncb));
+   struct slab_callback *ncb = new_slab_callback();
    memcpy(ncb, cb, sizeof(*ncb));
    return ncb;
 }
@@ -9,8 +9,13 @@ struct slab_callback;
 
 struct slab {
    struct slab_context *ctx;
+   size_t id;         // Position in the array of all slabs, the index stores this id instead of the pointer (see get_slab_from_id)
 
    size_t item_size;
+   size_t page_size;  // Unit of IO: PAGE_SIZE, or the item size for items bigger than a page (1 item = 1 extent of contiguous pages)
+   struct pagecache *pagecache; // Cache used for the pages (or extents) of the slab
+   struct checkpoint *checkpoint; // Pages written to the slab are logged until the next checkpoint of the index (NULL if checkpoints are disabled)
+   size_t checkpoint_idx;       // Position of the slab in the checkpoint
    size_t nb_items;   // Number of non freed items
    size_t last_item;  // Total number of items, including freed
    size_t nb_max_items;
@@ -19,7 +24,12 @@ struct slab {
    size_t size_on_disk;
 
    size_t nb_partially_freed_items;
-   struct freelist_entry *partially_freed_items;
+   struct freelist *freelist; // Free spots, see freelist.c
+   size_t compacting_from;    // Spots >= compacting_from are being compacted and must not be reused, -1 if the slab is not being compacted
+   struct compaction *compaction;
+
+   uint32_t *expires;         // Per spot, expiration time of the item in seconds (see slab_set_expiry), NULL until an item of the slab has a TTL
+   size_t expires_capacity;   // in spots
 };
 
 
@@ -35,6 +45,7 @@ struct slab {
  */
 typedef void (slab_cb_t)(struct slab_callback *, void *item);
 enum slab_action { ADD, UPDATE, DELETE, READ, READ_FOR_WRITE, READ_NO_LOOKUP, ADD_OR_UPDATE_IN_PLACE, UPDATE_IN_PLACE, START_TRANSACTION_COMMIT, END_TRANSACTION_COMMIT, LOCK, REVERT, READ_NEXT, READ_NEXT_BATCH, READ_NEXT_BATCH_CLONE, MAP };
+enum io_class { IO_CLASS_POINT, IO_CLASS_SCAN, IO_CLASS_MAINTENANCE, NB_IO_CLASSES }; // see ioengine.c
 struct slab_callback {
    slab_cb_t *cb;                            // Function called once the item is read/written
    void *payload;                            // Payload for the callback, can contain anything
@@ -67,30 +78,46 @@ struct slab_callback {
 
 
    io_cb_t *io_cb;                           // This will be called by the IO engine once a page has been fetched from disk
+   enum io_class io_class;                   // Priority of the IOs of the callback, point requests by default
 
    void *returned_item;                      // When READ'ing, this contains the item read
    struct slab_callback *next;               // Callbacks are enqueues in various queues (injector_queue or slabworker_queue)
+   struct slab_callback *next_in_group;      // Multi-key request (kv_..._many): the callbacks sent to the same worker are chained behind the first one...
+   size_t group_size;                        // ... which takes a single slot of the queue of the worker and holds the size of the group (0 = not grouped)
    uint64_t next_key;                        // When reading the "next" item, this is the key that we are actually reading, used to detect races
    uint64_t max_next_key;                    // End of the scan
 };
 struct slab_callback *new_slab_callback(void);
+void free_slab_callback(struct slab_callback *cb);
 
 
 
 struct slab* create_slab(struct slab_context *ctx, int worker_id, size_t item_size, struct slab_callback *callback);
+void rebuild_slabs(int worker_id, struct slab **slabs, size_t nb_slabs, struct slab_callback *callback);
+void rebuild_slab_pages(int worker_id, struct slab **slabs, size_t nb_slabs, uint64_t **pages, size_t *nb_pages, struct slab_callback *callback);
+size_t get_recovered_bytes(void); // bytes read by rebuild_slabs
 struct slab* create_transactions_slab(struct slab_context *ctx, int worker_id, struct slab_callback *callback);
 struct slab* resize_slab(struct slab *s);
+struct slab* get_slab_from_id(size_t id); // NULL for id 0
 
 void *read_item(struct slab *s, size_t idx); // unsafe
 void write_item(struct slab *s, size_t idx, void *data); // unsafe
 
 void read_item_async(struct slab_callback *callback);
 void add_item_async(struct slab_callback *callback);
+void add_colliding_item_async(struct slab_callback *callback); // ADD of a key whose fingerprint is already in the index at callback->slab/slab_idx
+void lock_item_async(struct slab_callback *callback);          // LOCK or READ_FOR_WRITE of a key that might not own the entry at callback->slab/slab_idx
 void update_item_async(struct slab_callback *callback);
 void update_in_place_item_async(struct slab_callback *callback);
 void remove_item_async(struct slab_callback *callback);
 
 off_t item_page_num(struct slab *s, size_t idx);
+off_t item_in_page_offset(struct slab *s, size_t idx);
+
+/* Expiration time of the item stored in a spot, kept in memory so that reads of expired items do not do any IO */
+void slab_set_expiry(struct slab *s, size_t idx, uint64_t expires);
+uint64_t slab_get_expiry(struct slab *s, size_t idx);
+int slab_spot_expired(struct slab *s, size_t idx); // 0 for spots of items without TTL, and for s == NULL
 struct slab_callback *clone_callback(struct slab_callback *cb);
 int callback_is_reading(struct slab_callback *callback);
 #endif
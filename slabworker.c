@@ -50,27 +50,44 @@ int get_worker_id() {
 /*
  * Worker context - Each worker thread in KVell has one of these structure
  */
-size_t slab_sizes[] = { 100, 128, 256, 400, 512, 1024, 1365, 2048, 4096 };
+size_t slab_sizes[] = { 100, 128, 256, 400, 512, 1024, 1365, 2048, 4096, 8192, 16384, 65536, 262144 }; // sizes > PAGE_SIZE are extents, see slab.c
+/*
+ * Requests are sent to a worker through a bounded lock-free multi-producer/single-consumer ring.
+ * Injectors reserve a slot by incrementing tail (CAS), then publish the callback in the slot. The worker consumes published slots
+ * in order, resets them to NULL and moves head forward. A slot that is reserved but not published yet stops the worker until the next round.
+ *
+ * Nobody holds a lock: injectors that find the ring full and idle workers sleep on futexes (head_seq / tail_seq) and are only woken up
+ * when somebody is actually sleeping (nb_waiting_producers / worker_sleeping).
+ */
 struct cb_queue {                                        // A queue of requests pending to be processed by a worker
-   pthread_mutex_t lock;
-   pthread_cond_t cond;
-   struct slab_callback *head;
-   struct slab_callback *tail;
-   volatile size_t nb_callbacks;
+   struct slab_callback *volatile *slots;
+   size_t max_pending_callbacks;                         // Maximum possible number of enqueued requests (size of the ring)
+   volatile uint64_t tail __attribute__((aligned(64)));  // Next slot to reserve, written by injectors
+   volatile int tail_seq;                                // Incremented when requests are published to a sleeping worker
+   volatile int worker_sleeping;
+   volatile uint64_t head __attribute__((aligned(64)));  // Next slot to consume, written by the worker only
+   volatile int head_seq;                                // Incremented when the worker frees slots and injectors are waiting
+   volatile int nb_waiting_producers;
    size_t nb_total_processed_callbacks;
-   size_t max_pending_callbacks;                         // Maximum possible number of enqueued requests
 };
 struct slab_context {
    size_t worker_id __attribute__((aligned(64)));        // ID
    struct slab **slabs;                                  // Files managed by this worker
    struct slab *transactions_slab;                       // File used to store transactions
+   struct checkpoint *checkpoint;                        // Checkpoints of the index, NULL if disabled
+   struct commit_log *commit_log;                        // Commit markers of transactions, NULL if COMMIT_LOG is disabled
+   struct compaction *compaction;                        // Compaction of the slabs, NULL if disabled
+   struct sweeper *sweeper;                              // Tombstones waiting to be dropped
 
    struct cb_queue cb_queue;                             // Regular queued requests
 
-   struct pagecache *pagecache __attribute__((aligned(64)));
+   struct pagecache **pagecaches __attribute__((aligned(64))); // [0] caches pages, then 1 cache per size of extent (items > PAGE_SIZE)
+   size_t nb_pagecaches;
    struct io_context *io_ctx;
+   struct queue_depth *queue_depth;                      // Shared by the workers of the same disk, NULL if the queue depth is not adaptive
    struct to_be_freed_list *gc;
    uint64_t rdt;                                         // Latest timestamp
+   size_t nb_erased_spots;                               // Items of transactions that did not end, erased by the recovery
    int idle;
 } *slab_contexts;
 static pthread_barrier_t slab_barrier;                   // Will unblock when all workers are done with recovering their files
@@ -80,8 +97,12 @@ int get_worker(struct slab *s) {
    return s->ctx->worker_id;
 }
 
-struct pagecache *get_pagecache(struct slab_context *ctx) {
-   return ctx->pagecache;
+static struct pagecache *create_extent_cache(struct slab_context *ctx, size_t extent_size);
+struct pagecache *get_pagecache(struct slab_context *ctx, size_t page_size) {
+   for(size_t i = 0; i < ctx->nb_pagecaches; i++)
+      if(ctx->pagecaches[i]->frame_size == page_size)
+         return ctx->pagecaches[i];
+   return create_extent_cache(ctx, page_size);
 }
 
 struct io_context *get_io_context(struct slab_context *ctx) {
@@ -97,23 +118,6 @@ void set_rdt(struct slab_context *ctx, uint64_t val) {
 }
 
 
-/*
- * The DB maintains a global timestamp that corresponds to the latest items written to disk.
- */
-static pthread_mutex_t biggest_rdt_lock;
-static uint64_t biggest_rdt = 0;
-void set_highest_rdt(uint64_t val) {
-   pthread_mutex_lock(&biggest_rdt_lock);
-   if(val > biggest_rdt)
-      biggest_rdt = val;
-   pthread_mutex_unlock(&biggest_rdt_lock);
-}
-
-uint64_t get_highest_rdt(void) {
-   return __sync_add_and_fetch(&biggest_rdt, 1);
-}
-
-
 /*
  * Transaction context.
  * It is possible that a transaction is only partially committed (crash). This structure remembers which transactions to ignore during recovery.
@@ -134,14 +138,14 @@ void check_races_and_call(struct slab_callback *callback, void *item) {
       int race = 0;
       switch(callback->action) {
          case READ:
-            if(item_get_key(item) != item_get_key(callback->item)
+            if(!item_keys_match(item, callback->item)
                   || (callback->transaction && get_snapshot_version(callback->transaction) < item_get_rdt(item)))
                race = 1;
             break;
          case READ_NEXT:
          case READ_NEXT_BATCH:
          case READ_NEXT_BATCH_CLONE:
-            if(item_get_key(item) != callback->next_key
+            if(callback->raced // spot reused by another key, see read_item_async_cb
                   || (callback->transaction && get_snapshot_version(callback->transaction) < item_get_rdt(item)))
                race = 1;
             break;
@@ -178,21 +182,14 @@ void call_callback(struct slab_callback *callback, void *item) {
  * When a request is submitted by a user, it is enqueued. Functions to do that.
  */
 
-/* How many callbacks are enqueued in a given queue? */
+/* How many callbacks are enqueued in a given queue? (includes slots reserved by injectors but not published yet) */
 static size_t get_nb_pending_callbacks(struct cb_queue *q) {
-   return q->nb_callbacks;
-}
-
-/* We shard data based on the prefix of the key */
-static uint64_t get_hash_for_item(char *item) {
-   struct item_metadata *meta = (struct item_metadata *)item;
-   char *item_key = &item[sizeof(*meta)];
-   return *(uint64_t*)item_key;
+   return q->tail - q->head;
 }
 
-/* Requests are statically attributed to workers using this function */
+/* Requests are statically attributed to workers using this function, we shard data based on the fingerprint of the key */
 static struct slab_context *get_slab_context(void *item) {
-   uint64_t hash = get_hash_for_item(item);
+   uint64_t hash = item_get_key_hash(item);
    return &slab_contexts[hash%get_nb_workers()];
 }
 
@@ -204,6 +201,14 @@ struct to_be_freed_list *get_gc_for_item(char *item) {
    return get_slab_context(item)->gc;
 }
 
+struct sweeper *get_sweeper(int worker_id) {
+   return slab_contexts[worker_id].sweeper;
+}
+
+struct to_be_freed_list *get_gc(int worker_id) {
+   return slab_contexts[worker_id].gc;
+}
+
 static struct slab *get_slab(struct slab_context *ctx, void *item) {
    size_t item_size = get_item_size(item);
    for(size_t i = 0; i < sizeof(slab_sizes)/sizeof(*slab_sizes); i++) {
@@ -218,68 +223,182 @@ struct slab *get_item_slab(void *item) {
    return get_slab(ctx, item);
 }
 
-/* Called by the main thread when waiting for requests */
-static void wait_for_requests(struct cb_queue *q) {
-   pthread_mutex_lock(&q->lock);
-   volatile size_t pending = get_nb_pending_callbacks(q);
-   if(pending) {
-      pthread_mutex_unlock(&q->lock);
-   } else {
-      pthread_cond_wait(&q->cond, &q->lock);
-      pthread_mutex_unlock(&q->lock);
+/* Called by the main thread when waiting for requests, for at most timeout_us microseconds (0 = no timeout). Returns 0 on timeout. */
+static int wait_for_requests(struct cb_queue *q, uint64_t timeout_us) {
+   int seq = q->tail_seq, woken = 1;
+   q->worker_sleeping = 1;
+   __sync_synchronize(); // injectors check worker_sleeping after publishing, we check the queue after setting it
+   if(!get_nb_pending_callbacks(q)) {
+      if(timeout_us)
+         woken = futex_wait_timeout(&q->tail_seq, seq, timeout_us);
+      else
+         futex_wait(&q->tail_seq, seq);
    }
+   q->worker_sleeping = 0;
+   return woken;
 }
 
-/* Called by the injector to make sure that the request queue is not full */
-static void wait_for_free_spot_keep_lock(struct cb_queue *q) {
-again:
-   if(!PINNING || !SPINNING) { // no active waiting
-      pthread_mutex_lock(&q->lock);
-      if(q->nb_callbacks >= q->max_pending_callbacks) {
-         pthread_cond_wait(&q->cond, &q->lock); // queue is full, wait
-      }
-   } else {
-      while(q->nb_callbacks >= q->max_pending_callbacks) {
-         NOP10();
+/* Called by the worker after consuming requests, wakes up injectors blocked in wait_for_free_spot() */
+static void wakeup_injectors(struct cb_queue *q) {
+   __sync_synchronize(); // head must be visible before we check for waiting injectors
+   if(q->nb_waiting_producers) {
+      __sync_fetch_and_add(&q->head_seq, 1);
+      futex_wake(&q->head_seq, INT_MAX);
+   }
+}
+
+/* Called by the injector when the request queue does not have nb free slots */
+static void wait_for_free_spot(struct cb_queue *q, size_t nb) {
+   if(PINNING && SPINNING) { // active waiting
+      NOP10();
+      return;
+   }
+
+   int seq = q->head_seq;
+   __sync_fetch_and_add(&q->nb_waiting_producers, 1); // full barrier
+   if(get_nb_pending_callbacks(q) + nb > q->max_pending_callbacks)
+      futex_wait(&q->head_seq, seq);
+   __sync_fetch_and_sub(&q->nb_waiting_producers, 1);
+}
+
+/* Reserve nb consecutive slots in the ring (nb <= max_pending_callbacks), returns the position of the first one */
+static uint64_t reserve_slots(struct cb_queue *q, size_t nb) {
+   while(1) {
+      uint64_t tail = q->tail;
+      if(tail - q->head + nb > q->max_pending_callbacks) {
+         wait_for_free_spot(q, nb);
+         continue;
       }
-      pthread_mutex_lock(&q->lock);
+      if(__sync_bool_compare_and_swap(&q->tail, tail, tail + nb))
+         return tail;
    }
+}
 
-   if(q->nb_callbacks >= q->max_pending_callbacks) {
-      pthread_mutex_unlock(&q->lock);
-      goto again;
+/* Make a reserved slot visible to the worker */
+static void publish_slot(struct cb_queue *q, uint64_t pos, struct slab_callback *callback) {
+   __atomic_store_n(&q->slots[pos % q->max_pending_callbacks], callback, __ATOMIC_RELEASE);
+}
+
+/* Called after publishing slots */
+static void wakeup_worker(struct cb_queue *q) {
+   __sync_synchronize(); // the slots must be visible before we check if the worker sleeps
+   if(q->worker_sleeping) {
+      __sync_fetch_and_add(&q->tail_seq, 1);
+      futex_wake(&q->tail_seq, 1); // signal the worker that it now has work, wakes up wait_for_requests()
    }
 }
 
-static void enqueue_slab_callback(struct slab_context *ctx, enum slab_action action, struct slab_callback *callback) {
+/* Enqueue nb callbacks in the queue of the same worker, using one reservation per ring-full of callbacks */
+static void enqueue_slab_callbacks(struct slab_context *ctx, enum slab_action action, struct slab_callback **callbacks, size_t nb) {
    if(is_worker_context())
       die("Trying to perform kv_... operations from a callback is forbidden without using injector contexts\n");
 
    static __thread declare_periodic_overhead;
    struct cb_queue *q = &ctx->cb_queue;
-   callback->action = action;
-   add_time_in_payload(callback, 0);
+   while(nb) {
+      size_t batch = (nb > q->max_pending_callbacks)?q->max_pending_callbacks:nb;
+      uint64_t pos;
 
-   start_periodic_overhead {
-      wait_for_free_spot_keep_lock(q); // takes q->lock
-   } stop_periodic_overhead(1000, "INJECTOR BREAKDOWN", "request_queue_full");
+      for(size_t i = 0; i < batch; i++) {
+         callbacks[i]->action = action;
+         add_time_in_payload(callbacks[i], 0);
+      }
 
-   callback->next = NULL;
-   add_time_in_payload(callback, 1);
+      start_periodic_overhead {
+         pos = reserve_slots(q, batch); // waits if the queue is full
+      } stop_periodic_overhead(1000, "INJECTOR BREAKDOWN", "request_queue_full");
 
-   if(!q->head) {
-      q->head = callback;
-      q->tail = callback;
-   } else {
-      q->tail->next = callback;
-      q->tail = callback;
+      for(size_t i = 0; i < batch; i++) {
+         callbacks[i]->next = NULL;
+         add_time_in_payload(callbacks[i], 1);
+         publish_slot(q, pos + i, callbacks[i]);
+      }
+      wakeup_worker(q);
+
+      callbacks += batch;
+      nb -= batch;
+   }
+}
+
+static void enqueue_slab_callback(struct slab_context *ctx, enum slab_action action, struct slab_callback *callback) {
+   callback->group_size = 0;
+   enqueue_slab_callbacks(ctx, action, &callback, 1);
+}
+
+/* Largest multi-key request: the worker cannot dequeue more requests than that in a batch */
+static size_t get_max_group_size(struct slab_context *ctx) {
+   return NEVER_EXCEED_QUEUE_DEPTH?QUEUE_DEPTH:ctx->cb_queue.max_pending_callbacks;
+}
+
+/*
+ * Send nb callbacks of the same worker as multi-key requests: the callbacks are chained in groups of at most get_max_group_size, and each
+ * group takes a single slot of the queue. The first callback of a group heads it, callbacks[i] is overwritten by the head of the i-th group.
+ */
+static void enqueue_groups(struct slab_context *ctx, enum slab_action action, struct slab_callback **callbacks, size_t nb) {
+   size_t max_group_size = get_max_group_size(ctx), nb_groups = 0;
+   for(size_t first = 0; first < nb; first += max_group_size) {
+      size_t size = (nb - first > max_group_size)?max_group_size:(nb - first);
+      for(size_t i = first; i < first + size; i++) {
+         callbacks[i]->action = action;
+         callbacks[i]->group_size = 0;
+         callbacks[i]->next_in_group = (i + 1 < first + size)?callbacks[i + 1]:NULL;
+         if(i != first) { // the head is timed when it is published
+            add_time_in_payload(callbacks[i], 0);
+            add_time_in_payload(callbacks[i], 1);
+         }
+      }
+      callbacks[first]->group_size = (size > 1)?size:0;
+      callbacks[nb_groups++] = callbacks[first]; // nb_groups <= first, the callbacks before first are already chained
    }
+   enqueue_slab_callbacks(ctx, action, callbacks, nb_groups);
+}
 
-   if(q->nb_callbacks == 0)
-      pthread_cond_broadcast(&q->cond); // signal the main thread that it now has work, wakes up wait_for_requests()
+/* Number of requests of a slot: a multi-key request counts as all its callbacks (IOs, budget of the batch) */
+static size_t get_request_weight(struct slab_callback *callback) {
+   return callback->group_size?callback->group_size:1;
+}
+
+/* Scratch arrays of enqueue_many, per injector, grown as needed */
+static __thread size_t *many_first;
+static __thread int *many_workers;
+static __thread struct slab_callback **many_sorted;
+static __thread size_t many_capacity;
 
-   q->nb_callbacks++;
-   pthread_mutex_unlock(&q->lock);
+/*
+ * Group the callbacks by worker (keeping their order) and send each group as a multi-key request (see enqueue_groups).
+ * The worker processes all the callbacks of a group back to back in worker_do_one_request: no other request of the worker runs in between,
+ * so the index operations of a group (e.g., the LOCKs or REVERTs of a transaction) are atomic for that worker. Each callback still gets its
+ * own completion, and its own failure (a lock taken by another transaction only fails the callback of that key).
+ */
+static void enqueue_many(enum slab_action action, struct slab_callback **callbacks, size_t nb) {
+   size_t nb_workers = get_nb_workers();
+   if(!many_first)
+      many_first = malloc((nb_workers + 1) * sizeof(*many_first));
+   if(nb > many_capacity) {
+      many_capacity = (nb > 2*many_capacity)?nb:2*many_capacity;
+      many_workers = realloc(many_workers, many_capacity * sizeof(*many_workers));
+      many_sorted = realloc(many_sorted, many_capacity * sizeof(*many_sorted));
+   }
+   size_t *first = many_first;
+   int *workers = many_workers;
+   struct slab_callback **sorted = many_sorted;
+   memset(first, 0, (nb_workers + 1) * sizeof(*first));
+
+   for(size_t i = 0; i < nb; i++) {
+      workers[i] = get_slab_context(callbacks[i]->item)->worker_id;
+      first[workers[i] + 1]++;
+   }
+   for(size_t w = 0; w < nb_workers; w++)
+      first[w + 1] += first[w];
+   for(size_t i = 0; i < nb; i++)
+      sorted[first[workers[i]]++] = callbacks[i];
+
+   // first[w] is now the end of the group of worker w
+   for(size_t w = 0, start = 0; w < nb_workers; w++) {
+      if(first[w] > start)
+         enqueue_groups(&slab_contexts[w], action, &sorted[start], first[w] - start);
+      start = first[w];
+   }
 }
 
 /*
@@ -298,10 +417,12 @@ int get_worker_for_prefix(uint64_t hash) {
 void *kv_read_sync(void *item) {
    struct slab_context *ctx = get_slab_context(item);
    index_entry_t *e = memory_index_lookup(ctx->worker_id, NULL, item, -1, NULL);
-   if(e)
-      return read_item(e->slab, e->slab_idx);
-   else
+   if(!e)
+      return NULL;
+   void *disk_item = read_item(e->slab, e->slab_idx);
+   if(!item_keys_match(disk_item, item)) // the fingerprint of the key belongs to another key
       return NULL;
+   return disk_item;
 }
 
 void kv_read_sync_safe_cb(struct slab_callback *cb, void *item) {
@@ -323,7 +444,7 @@ void *kv_read_sync_safe(void *item) {
    } while(pending_work() || injector_has_pending_work(q));
 
    void *ret = cb->payload;
-   free(cb);
+   free_slab_callback(cb);
    free(q);
    return ret;
 }
@@ -333,6 +454,24 @@ void kv_read_async(struct slab_callback *callback) {
    return enqueue_slab_callback(ctx, READ, callback);
 }
 
+/* Batched versions of kv_read_async and kv_update_async, callbacks[i] is handled as if kv_..._async(callbacks[i]) had been called */
+void kv_read_many(struct slab_callback **callbacks, size_t nb) {
+   enqueue_many(READ, callbacks, nb);
+}
+
+void kv_update_many(struct slab_callback **callbacks, size_t nb) {
+   enqueue_many(UPDATE, callbacks, nb);
+}
+
+/* Same for kv_lock_async and kv_revert_update, used by transactions to lock, write and unlock their write set */
+void kv_lock_many(struct slab_callback **callbacks, size_t nb) {
+   enqueue_many(LOCK, callbacks, nb);
+}
+
+void kv_revert_many(struct slab_callback **callbacks, size_t nb) {
+   enqueue_many(REVERT, callbacks, nb);
+}
+
 void kv_read_for_write_async(struct slab_callback *callback) {
    struct slab_context *ctx = get_slab_context(callback->item);
    return enqueue_slab_callback(ctx, READ_FOR_WRITE, callback);
@@ -374,6 +513,7 @@ void kv_add_or_update_async(struct slab_callback *callback) {
    return enqueue_slab_callback(ctx, ADD_OR_UPDATE_IN_PLACE, callback);
 }
 
+/* Only the key of callback->item is used, the item becomes the tombstone written on disk (see slab.c) */
 void kv_remove_async(struct slab_callback *callback) {
    struct slab_context *ctx = get_slab_context(callback->item);
    return enqueue_slab_callback(ctx, DELETE, callback);
@@ -405,6 +545,16 @@ void kv_read_next_batch_async(struct slab_callback *callback, int worker) {
 
 /* Dequeue enqueued callbacks */
 static int worker_do_one_request(struct slab_context *ctx, struct slab_callback *callback, int max_extra_io) {
+   if(callback->group_size) { // multi-key request, the callbacks of the group are processed back to back
+      int extra_ios_done = 0;
+      for(struct slab_callback *next; callback; callback = next) {
+         next = callback->next_in_group; // the callback might be completed and freed before we come back
+         callback->next_in_group = NULL;
+         callback->group_size = 0;
+         extra_ios_done += worker_do_one_request(ctx, callback, max_extra_io - extra_ios_done);
+      }
+      return extra_ios_done;
+   }
    add_time_in_payload(callback, 2);
 
    index_entry_t *e = NULL, *entries_array = NULL;
@@ -416,6 +566,10 @@ static int worker_do_one_request(struct slab_context *ctx, struct slab_callback
 
    /* Get the item location from the index */
    action = callback->action;
+   if(ctx->commit_log && (action == START_TRANSACTION_COMMIT || action == END_TRANSACTION_COMMIT)) {
+      commit_log_append(ctx->commit_log, callback); // called once the page of the marker is written, at the end of the batch
+      goto end;
+   }
    present = 0; // Was the item in the index?
    allowed = -1; // Are we allowed to perform the action?
    switch(action) {
@@ -431,10 +585,12 @@ static int worker_do_one_request(struct slab_context *ctx, struct slab_callback
          e = memory_index_lookup(ctx->worker_id, callback, callback->item, max_snapshot, &allowed);
          break;
       case READ_NEXT:
+         callback->io_class = IO_CLASS_SCAN;
          e = memory_index_lookup_next(ctx->worker_id, callback, callback->item, &found_hash, max_snapshot, &allowed);
          callback->next_key = found_hash;
          break;
       case READ_NEXT_BATCH:
+         callback->io_class = IO_CLASS_SCAN; // the clones of the batch too
          batch_size = (max_extra_io >= MAX_BATCH_SIZE)?MAX_BATCH_SIZE:(1+max_extra_io);
          //batch_size = MAX_BATCH_SIZE;
          entries_array = memory_index_read_next_batch(ctx->worker_id, callback, callback->item, max_snapshot, &batch_size, &found_hashes, &allowed);
@@ -444,10 +600,14 @@ static int worker_do_one_request(struct slab_context *ctx, struct slab_callback
       case READ_NO_LOOKUP:
          // No need to do a lookup for an UPDATE because it starts by ADDing
          break;
+      case DELETE:
+         // A delete is a write, it is not allowed on a locked item and it does not fall back on the snapshots
+         e = memory_index_lookup(ctx->worker_id, NULL, callback->item, -1, NULL);
+         break;
       case READ_FOR_WRITE:
       case LOCK:
          // called by a write in a transaction -- doesn't actually write, but locks the index
-         memory_index_lookup_and_lock(ctx->worker_id, callback->item, callback, transaction_id, &present, &allowed);
+         e = memory_index_lookup_and_lock(ctx->worker_id, callback->item, callback, transaction_id, &present, &allowed);
          if(!present) // Item is not in DB, but we must create it to avoid future conflicts!
             memory_index_reserve(ctx->worker_id, callback->item, transaction_id);
          break;
@@ -477,7 +637,16 @@ static int worker_do_one_request(struct slab_context *ctx, struct slab_callback
    /* Now perform the actual data related action */
    switch(action) {
       case LOCK:
-         call_callback(callback, NULL);
+      case READ_FOR_WRITE:
+         if(e && e->slab && (action == READ_FOR_WRITE || !memory_index_key_is_owner(ctx->worker_id, e, callback->item))) {
+            callback->slab = e->slab;
+            callback->slab_idx = e->slab_idx;
+            lock_item_async(callback); // the entry might belong to another key with the same fingerprint
+         } else {
+            callback->slab = NULL;
+            callback->slab_idx = -1;
+            call_callback(callback, NULL);
+         }
          break;
 
       case READ_NO_LOOKUP:
@@ -487,7 +656,6 @@ static int worker_do_one_request(struct slab_context *ctx, struct slab_callback
       /* Reads */
       case READ:
       case READ_NEXT:
-      case READ_FOR_WRITE:
          if(!e) { // Item is not in DB
             callback->slab = NULL;
             callback->slab_idx = -1;
@@ -530,11 +698,13 @@ static int worker_do_one_request(struct slab_context *ctx, struct slab_callback
       case ADD:
       case START_TRANSACTION_COMMIT:
          if(e) {
-            print_item(e->slab_idx, callback->item);
-            if(action == START_TRANSACTION_COMMIT)
-               die("Adding a transaction that is already in the database! (This error might also appear if 2 keys have the same prefix, TODO: make index more robust to that.)\n");
-            else
-               die("Adding item that is already in the database! Use update instead! (This error might also appear if 2 keys have the same prefix, TODO: make index more robust to that.)\n");
+            if(action == START_TRANSACTION_COMMIT) {
+               print_item(e->slab_idx, callback->item);
+               die("Adding a transaction that is already in the database!\n");
+            }
+            callback->slab = e->slab;
+            callback->slab_idx = e->slab_idx;
+            add_colliding_item_async(callback); // same key (error) or another key with the same fingerprint?
          } else {
             //callback->action = ADD;
             if(action == ADD)
@@ -568,8 +738,7 @@ static int worker_do_one_request(struct slab_context *ctx, struct slab_callback
          } else {
             callback->slab = e->slab;
             callback->slab_idx = e->slab_idx;
-            callback->action = UPDATE_IN_PLACE;
-            update_in_place_item_async(callback);
+            update_in_place_item_async(callback); // action stays ADD_OR_UPDATE_IN_PLACE, the item is added if the key is not the one of e
          }
          break;
 
@@ -583,11 +752,15 @@ static int worker_do_one_request(struct slab_context *ctx, struct slab_callback
 
       /* Deletes */
       case DELETE:
-         die("Not implemented");
-         /* To implement:
-          * - Do a special update that would write a tombstone to disk for the key... But this is a bit weird and probably doesn't play very well with our current assumption that deleted = (key_size == -1)
-          * - Also, make sure it plays nicely with snapshots somehow...
-          */
+         if(!e || get_deleted_bit(e) || slab_spot_expired(e->slab, e->slab_idx)) { // Item is not in DB
+            callback->slab = NULL;
+            callback->slab_idx = -1;
+            call_callback(callback, NULL);
+         } else {
+            callback->slab = e->slab;
+            callback->slab_idx = e->slab_idx;
+            remove_item_async(callback);
+         }
          break;
 
       case END_TRANSACTION_COMMIT:
@@ -616,46 +789,62 @@ static void worker_do_cleaning(struct slab_context *ctx) {
 /* Dequeue requests from a slab context */
 static void worker_dequeue_requests(struct slab_context *ctx) {
    struct cb_queue *q = &ctx->cb_queue;
-   struct slab_callback *head = NULL;
-   if(q->nb_callbacks == 0)
+   struct slab_callback *head = NULL, *tail = NULL;
+   uint64_t nb_slots = get_nb_pending_callbacks(q);
+   if(nb_slots == 0)
       return;
 
-   pthread_mutex_lock(&q->lock);
-   int need_to_wakeup_injectors = (q->nb_callbacks == q->max_pending_callbacks); // queue was full, injectors might be waiting
-
-   uint64_t to_dequeue = q->nb_callbacks;
-   if(NEVER_EXCEED_QUEUE_DEPTH && (io_pending(ctx->io_ctx) + to_dequeue > QUEUE_DEPTH)) {
+   // Requests that can be dequeued, a slot can contain several requests (see enqueue_groups)
+   uint64_t to_dequeue = q->max_pending_callbacks;
+   size_t compaction_ios = compaction_pending_spots(ctx->compaction) + sweeper_pending_ios(ctx->sweeper); // each spot being compacted or page being swept can do 1 IO, like a request
+   if(to_dequeue + compaction_ios > q->max_pending_callbacks)
+      to_dequeue = q->max_pending_callbacks - compaction_ios;
+   if(NEVER_EXCEED_QUEUE_DEPTH && (io_pending(ctx->io_ctx) + to_dequeue > QUEUE_DEPTH))
       to_dequeue = QUEUE_DEPTH - io_pending(ctx->io_ctx);
-      if(to_dequeue) {
-         head = q->head;
-         struct slab_callback *tmp = head, *prev = NULL;
-         for(size_t i = 0; i < to_dequeue; i++) {
-            prev = tmp;
-            tmp = tmp->next;
-         }
-         assert(tmp);
-         prev->next = NULL;
-         q->head = tmp;
-         q->nb_callbacks -= to_dequeue;
-         q->nb_total_processed_callbacks += to_dequeue;
-      }
-   } else {
-      head = q->head;
-      q->head = q->tail = NULL;
-      q->nb_total_processed_callbacks += q->nb_callbacks;
-      q->nb_callbacks = 0;
+   size_t budget = queue_depth_budget(ctx->queue_depth); // IOs the disk can take, -1 if the queue depth is not adaptive
+   int limited = 0;
+   if(to_dequeue > budget) {
+      to_dequeue = budget;
+      limited = 1;
    }
 
-   if(need_to_wakeup_injectors)
-      pthread_cond_broadcast(&q->cond); // wakeup all injectors blocked in wait_for_free_spot_keep_lock()
-   pthread_mutex_unlock(&q->lock);
+   // Take the published requests, in order, and chain them. A multi-key request that does not fit waits for the next batch, unless it is
+   // the first one (it is not bigger than the queue, see get_max_group_size).
+   uint64_t dequeued = 0, nb_requests = 0;
+   for(; dequeued < nb_slots && nb_requests < to_dequeue; dequeued++) {
+      struct slab_callback *volatile *slot = &q->slots[(q->head + dequeued) % q->max_pending_callbacks];
+      struct slab_callback *callback = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+      if(!callback) // reserved by an injector but not published yet
+         break;
+      if(nb_requests && nb_requests + get_request_weight(callback) > to_dequeue)
+         break;
+      *slot = NULL;
+      nb_requests += get_request_weight(callback);
+      if(tail)
+         tail->next = callback;
+      else
+         head = callback;
+      tail = callback;
+   }
+   if(limited && dequeued < nb_slots)
+      queue_depth_limited(ctx->queue_depth);
+   if(!dequeued)
+      return;
+   __atomic_store_n(&q->head, q->head + dequeued, __ATOMIC_RELEASE);
+   q->nb_total_processed_callbacks += nb_requests;
+   wakeup_injectors(q);
+   to_dequeue = nb_requests;
 
    int max_extra_io;
    if(NEVER_EXCEED_QUEUE_DEPTH) {
       max_extra_io = QUEUE_DEPTH - to_dequeue;
    } else {
-      max_extra_io = ctx->cb_queue.max_pending_callbacks - to_dequeue;
+      max_extra_io = ctx->cb_queue.max_pending_callbacks - to_dequeue - compaction_ios;
    }
+   if(ctx->queue_depth && max_extra_io > (int)(budget - to_dequeue))
+      max_extra_io = budget - to_dequeue; // scans do not read more than the budget in advance
+   if(max_extra_io < 0) // a multi-key request bigger than the budget
+      max_extra_io = 0;
    while(head) {
       struct slab_callback *next = head->next;
       head->next = NULL;
@@ -691,33 +880,48 @@ static int item_is_part_of_ignored_transaction(struct slab_callback *cb, void *i
    for(size_t i = 0; i < transaction_recovery_context.nb_ignored_rdts; i++) {
       if(new_meta->rdt == transaction_recovery_context.ignored_rdts[i]) {
          printf("#WARNING: ignoring an item partially committed by transaction %lu\n", new_meta->rdt);
-         // TODO: the spot should be added in the free list!
          return 1;
       }
    }
    return 0;
 }
 
+/* An item found during recovery is not going to be indexed, its spot can be reused */
+static void free_recovered_spot(struct slab *s, size_t idx) {
+   s->nb_items--;
+   add_item_in_partially_freed_list(s, idx, 0);
+}
+
+/* The item belongs to a transaction that did not end: remove it from the disk, so that the transaction can be retired (see commit_log_retire_recovered) */
+static void erase_recovered_spot(struct slab *s, size_t idx) {
+   struct item_metadata removed = { .key_size = -1 };
+   safe_pwrite(s->fd, item_page_num(s, idx)*s->page_size, s->page_size, item_in_page_offset(s, idx), sizeof(removed), &removed);
+   s->ctx->nb_erased_spots++;
+   free_recovered_spot(s, idx);
+}
+
 /* Function called on all items stored in slabs during recovery */
 static void worker_slab_init_cb(struct slab_callback *cb, void *item) {
    struct item_metadata *new_meta = item;
    if(item_is_part_of_ignored_transaction(cb, item)) {
-      // do nothing
+      erase_recovered_spot(cb->slab, cb->slab_idx);
    } else if(!memory_index_lookup(get_worker(cb->slab), NULL, item, -1, NULL)) { // item is non existant in the index => add it
       memory_index_add(cb, item);
    } else {
       /* Complex path -- item is already in the index, we should decide which one to keep based on rdt! */
       //printf("#WARNING! Item is present twice in the database! Has the database crashed?\n");
       struct item_metadata *old_meta = kv_read_sync(item);
-      assert(old_meta);
 
-      if(old_meta->rdt < new_meta->rdt) {
-         // TODO: the old spot should be added in the freelist
-         //kv_delete_sync(old_meta);
+      if(!old_meta) { // the index contains another key with the same fingerprint
+         memory_index_add_alias(get_worker(cb->slab), item);
+         memory_index_add(cb, item);
+      } else if(old_meta->rdt < new_meta->rdt) {
+         index_entry_t old = *memory_index_lookup(get_worker(cb->slab), NULL, item, -1, NULL);
          memory_index_delete(get_worker(cb->slab), old_meta);
          memory_index_add(cb, item);
+         free_recovered_spot(old.slab, old.slab_idx);
       } else {
-         //kv_delete_sync(new_meta);
+         free_recovered_spot(cb->slab, cb->slab_idx);
       }
    }
 }
@@ -726,6 +930,91 @@ int is_worker_context(void) {
    return worker_context; // 1 if worker context, 0 if injector context
 }
 
+/*
+ * Page caches of a worker: 1 cache of PAGE_SIZE frames, created at startup, and 1 cache per slab of items bigger than a page, with frames of
+ * the size of the items. An extent cache is only created by the first IO of its slab (see read_page_async), so workloads of small items do
+ * not pay for them.
+ * An extent cache must be able to hold all the extents of the IOs in flight (up to 2*MAX_NB_PENDING_CALLBACKS_PER_WORKER, see options.h),
+ * otherwise an extent could be evicted before being read or written.
+ */
+static void init_pagecaches(struct slab_context *ctx) {
+   size_t nb_slabs = sizeof(slab_sizes)/sizeof(*slab_sizes);
+   ctx->pagecaches = calloc(nb_slabs + 1, sizeof(*ctx->pagecaches));
+   ctx->pagecaches[0] = calloc(1, sizeof(**ctx->pagecaches));
+   page_cache_init(ctx->pagecaches[0], PAGE_SIZE, PAGE_CACHE_SIZE/get_nb_workers());
+   ctx->nb_pagecaches = 1;
+}
+
+/* Created after the buffers have been registered, the extents are read and written without registered buffers */
+static struct pagecache *create_extent_cache(struct slab_context *ctx, size_t extent_size) {
+   size_t size = EXTENT_CACHE_SIZE/get_nb_workers();
+   if(size < 2*MAX_NB_PENDING_CALLBACKS_PER_WORKER*extent_size)
+      size = 2*MAX_NB_PENDING_CALLBACKS_PER_WORKER*extent_size;
+   struct pagecache *p = calloc(1, sizeof(*p));
+   page_cache_init(p, extent_size, size);
+   ctx->pagecaches[ctx->nb_pagecaches++] = p;
+   return p;
+}
+
+/* All the buffers of the caches that exist at startup are registered at once, each cache remembers the index of its first buffer */
+static void register_pagecaches(struct slab_context *ctx) {
+   size_t nb_buffers = 0;
+   for(size_t i = 0; i < ctx->nb_pagecaches; i++)
+      nb_buffers += ctx->pagecaches[i]->nb_buffers;
+
+   struct iovec *buffers = calloc(nb_buffers, sizeof(*buffers));
+   nb_buffers = 0;
+   for(size_t i = 0; i < ctx->nb_pagecaches; i++) {
+      struct pagecache *p = ctx->pagecaches[i];
+      p->first_buffer = nb_buffers;
+      p->registered = 1;
+      memcpy(&buffers[nb_buffers], p->buffers, p->nb_buffers*sizeof(*buffers));
+      nb_buffers += p->nb_buffers;
+   }
+   ioengine_register_buffers(ctx->io_ctx, buffers, nb_buffers);
+   free(buffers);
+}
+
+/*
+ * The version of the on-disk format (fingerprints of the keys, layout of the items) is written next to the slabs of each worker, in PATH_FORMAT.
+ * A database written by a version of KVell that did not have this file, by another version of the format or by another number of workers
+ * is refused, instead of looking for its keys in the wrong worker or under the wrong fingerprint.
+ */
+#define DISK_FORMAT_MAGIC 0x54414D524F464B56LU // "VKFORMAT"
+#define DISK_FORMAT_VERSION 1LU                // bump when the fingerprints of the keys or the layout of the items change
+
+struct disk_format {
+   uint64_t magic;
+   uint64_t version;
+   uint64_t nb_workers;
+};
+
+static void check_disk_format(struct slab_context *ctx) {
+   char path[512], slab_path[512];
+   struct stat sb;
+   size_t disk = ctx->worker_id / (nb_workers/nb_disks);
+   struct disk_format format, expected = { .magic = DISK_FORMAT_MAGIC, .version = DISK_FORMAT_VERSION, .nb_workers = nb_workers };
+
+   sprintf(path, PATH_FORMAT, disk, (int)ctx->worker_id);
+   int fd = open(path, O_RDWR | O_CREAT, 0777);
+   if(fd == -1)
+      perr("Cannot open %s\n", path);
+   ssize_t size = pread(fd, &format, sizeof(format), 0);
+   if(size == 0) { // new database... unless the slabs of the worker already exist
+      sprintf(slab_path, PATH_TRANSACTIONS, disk, (int)ctx->worker_id, (size_t)TRANSACTION_OBJECT_SIZE);
+      if(!stat(slab_path, &sb))
+         die("[SLAB WORKER %lu] The database was written by an older version of KVell (no format file), delete it first\n", ctx->worker_id);
+      if(pwrite(fd, &expected, sizeof(expected), 0) != sizeof(expected) || fsync(fd))
+         perr("Cannot write %s\n", path);
+   } else if(size != sizeof(format) || format.magic != DISK_FORMAT_MAGIC || format.version != DISK_FORMAT_VERSION) {
+      die("[SLAB WORKER %lu] The database was written by another version of KVell (format %lu, expected %lu), delete it first\n",
+            ctx->worker_id, (size == sizeof(format) && format.magic == DISK_FORMAT_MAGIC)?format.version:0, DISK_FORMAT_VERSION);
+   } else if(format.nb_workers != nb_workers) {
+      die("[SLAB WORKER %lu] The database was written by %lu workers and not %d, delete it first\n", ctx->worker_id, format.nb_workers, nb_workers);
+   }
+   close(fd);
+}
+
 static void *worker_slab_init(void *pdata) {
    struct slab_context *ctx = pdata;
 
@@ -736,21 +1025,27 @@ static void *worker_slab_init(void *pdata) {
    printf("[SLAB WORKER %lu] tid %d\n", ctx->worker_id, x);
    pin_me_on(ctx->worker_id);
 
-   /* Create the pagecache for the worker */
-   ctx->pagecache = calloc(1, sizeof(*ctx->pagecache));
-   page_cache_init(ctx->pagecache);
+   /* Create the pagecaches for the worker */
+   init_pagecaches(ctx);
 
    /* Initialize the async io for the worker */
    ctx->io_ctx = worker_ioengine_init(ctx->worker_id, ctx->cb_queue.max_pending_callbacks);
+   ctx->queue_depth = get_queue_depth(ctx->worker_id / (nb_workers/nb_disks));
+   register_pagecaches(ctx); // pin the page caches once for all
+   printf("[SLAB WORKER %lu] IO engine: %s\n", ctx->worker_id, ioengine_name(ctx->io_ctx));
    //ctx->cb_queue.max_pending_callbacks -= 40;
 
    /* Initialize the GC */
    ctx->gc = init_gc();
 
+   /* Refuse databases written with another format, before creating any file */
+   check_disk_format(ctx);
+
    /* Detect partially committed transactions */
    struct slab_callback *trans_cb = malloc(sizeof(*trans_cb));
    trans_cb->cb = worker_slab_init_trans_cb;
    ctx->transactions_slab = create_transactions_slab(ctx, ctx->worker_id, trans_cb);
+   ctx->commit_log = commit_log_init(ctx, ctx->worker_id, trans_cb);
    pthread_barrier_wait(&transaction_barrier);
 
    /* Rebuild the index by scanning all the slabs */
@@ -759,29 +1054,54 @@ static void *worker_slab_init(void *pdata) {
    struct slab_callback *cb = new_slab_callback();
    cb->cb = worker_slab_init_cb;
    for(size_t i = 0; i < nb_slabs; i++) {
-      ctx->slabs[i] = create_slab(ctx, ctx->worker_id, slab_sizes[i], cb);
+      ctx->slabs[i] = create_slab(ctx, ctx->worker_id, slab_sizes[i], NULL);
    }
-   free(cb);
-
-   set_highest_rdt(ctx->rdt);
+   ctx->checkpoint = checkpoint_init(ctx->worker_id, ctx->slabs, nb_slabs);
+   int recovered = ctx->checkpoint && checkpoint_recover(ctx->checkpoint, cb);
+   if(!recovered)
+      rebuild_slabs(ctx->worker_id, ctx->slabs, nb_slabs, cb); // all the slabs at once
+   free_slab_callback(cb);
+   if(ctx->checkpoint) // after a restart too, the logs of the previous checkpoints are then empty
+      checkpoint_write(ctx->checkpoint);
+   ctx->compaction = compaction_init(ctx->worker_id, ctx->slabs, nb_slabs);
+   ctx->sweeper = sweeper_init(ctx->worker_id, ctx->slabs, nb_slabs);
+   for(size_t i = 0; i < nb_slabs && ctx->nb_erased_spots && DURABILITY_MODE != DURABILITY_NONE; i++)
+      if(fdatasync(ctx->slabs[i]->fd))
+         perr("Cannot sync the slabs of worker %lu\n", ctx->worker_id);
+
+   timestamp_recovered(ctx->rdt);
     __sync_add_and_fetch(&nb_workers_ready, 1);
    pthread_barrier_wait(&slab_barrier);
+   ctx->commit_log = commit_log_retire_recovered(ctx->commit_log); // all the workers have erased the items of the transactions that did not end
 
    /* Main loop: do IOs and process enqueued requests */
    declare_breakdown;
    while(1) {
       while(io_pending(ctx->io_ctx)) {
+         checkpoint_flush_log(ctx->checkpoint); // the writes of the pages wait for the log, see checkpoint_page_logged
          worker_ioengine_enqueue_ios(ctx->io_ctx); __1
          //worker_dequeue_cleaning(ctx); // while we wait for IO, dequeue cleaning
          worker_ioengine_get_completed_ios(ctx->io_ctx); __2
          worker_ioengine_process_completed_ios(ctx->io_ctx); __3
       }
 
+      checkpoint_step(ctx->checkpoint); // no IO in flight, all the locations of the index are on disk
+
+      compaction_step(ctx->compaction, get_nb_pending_callbacks(&ctx->cb_queue)); // no IO in flight, all the allocated spots have been written
+      sweeper_step(ctx->sweeper, get_nb_pending_callbacks(&ctx->cb_queue));
+
       volatile size_t pending = get_nb_pending_callbacks(&ctx->cb_queue);
       while(!pending && !io_pending(ctx->io_ctx)) {
          ctx->idle = 1;
-         if(!PINNING || !SPINNING) {
-            wait_for_requests(&ctx->cb_queue);
+         int compacting = compaction_step(ctx->compaction, 0); // compact and sweep while idle
+         if(sweeper_step(ctx->sweeper, 0) | compacting) {
+            if(!io_pending(ctx->io_ctx))
+               usleep(1000); // throttled, see COMPACTION_MAX_SPOTS_PER_SEC and SWEEPER_MAX_PAGES_PER_SEC
+         } else if(io_waiting_for_sync(ctx->io_ctx)) {
+            usleep(DURABILITY_SYNC_INTERVAL_US/10 + 1); // writes complete at the next periodic sync
+         } else if(!PINNING || !SPINNING) {
+            if(!wait_for_requests(&ctx->cb_queue, sweeper_next_walk_us(ctx->sweeper)))
+               break; // time to walk the index, and to pass the items expired by the last walk to the GC
          } else {
             NOP10();
          }
@@ -791,8 +1111,9 @@ static void *worker_slab_init(void *pdata) {
 
       worker_do_cleaning(ctx); __5
 
-      ctx->rdt = get_highest_rdt();
+      ctx->rdt = timestamp_batch(ctx->rdt);
       worker_dequeue_requests(ctx); __6 // Process queue
+      commit_log_flush(ctx->commit_log); // one write for the commit markers of the batch, submitted with the IOs of the next loop
 
       show_breakdown_periodic(1000, ctx->cb_queue.nb_total_processed_callbacks, "io_submit", "io_getevents", "io_cb", "wait", "gc", "slab_cb", " [GC - %lu elements]", gc_size(ctx->gc));
    }
@@ -808,8 +1129,8 @@ void slab_workers_init(int _nb_disks, int nb_workers_per_disk) {
    pthread_barrier_init(&slab_barrier, NULL, nb_workers+1);
    pthread_barrier_init(&transaction_barrier, NULL, nb_workers);
    pthread_mutex_init(&transaction_recovery_context_lock, NULL);
-   pthread_mutex_init(&biggest_rdt_lock, NULL);
    memory_index_init();
+   queue_depth_init(nb_disks, nb_workers_per_disk);
 
    pthread_t t;
    slab_contexts = calloc(nb_workers, sizeof(*slab_contexts));
@@ -818,9 +1139,8 @@ void slab_workers_init(int _nb_disks, int nb_workers_per_disk) {
       ctx->worker_id = w;
 
       memset(&ctx->cb_queue, 0, sizeof(ctx->cb_queue));
-      pthread_mutex_init(&ctx->cb_queue.lock, NULL);
-      pthread_cond_init(&ctx->cb_queue.cond, NULL);
       ctx->cb_queue.max_pending_callbacks = max_pending_callbacks;
+      ctx->cb_queue.slots = calloc(max_pending_callbacks, sizeof(*ctx->cb_queue.slots));
 
       pthread_create(&t, NULL, worker_slab_init, ctx);
    }
@@ -19,6 +19,9 @@ void kv_update_in_place_async(struct slab_callback *callback);
 void kv_lock_async(struct slab_callback *callback);
 void kv_add_or_update_async(struct slab_callback *callback);
 void kv_remove_async(struct slab_callback *callback);
+void kv_read_many(struct slab_callback **callbacks, size_t nb);
+void kv_update_many(struct slab_callback **callbacks, size_t nb);
+void kv_lock_many(struct slab_callback **callbacks, size_t nb);
 
 
 size_t get_database_size(void);
@@ -29,6 +32,7 @@ size_t get_database_size(void);
 void kv_start_commit(struct slab_callback *callback);
 void kv_end_commit(struct slab_callback *callback);
 void kv_revert_update(struct slab_callback *callback);
+void kv_revert_many(struct slab_callback **callbacks, size_t nb);
 void kv_read_next_async(struct slab_callback *callback, int worker);
 void kv_read_next_batch_async(struct slab_callback *callback, int worker);
 void *kv_read_sync_safe(void *item);
@@ -39,18 +43,19 @@ int get_nb_workers(void);
 /*
  * Getters/setters for the slab context of a worker
  */
-struct pagecache *get_pagecache(struct slab_context *ctx);
+struct pagecache *get_pagecache(struct slab_context *ctx, size_t page_size); // cache of the pages (PAGE_SIZE) or extents (bigger items) of a given size
 struct io_context *get_io_context(struct slab_context *ctx);
 uint64_t get_rdt(struct slab_context *ctx);
 void set_rdt(struct slab_context *ctx, uint64_t val);
 struct to_be_freed_list *get_gc_for_item(char *item);
+struct sweeper *get_sweeper(int worker_id);
+struct to_be_freed_list *get_gc(int worker_id);
 struct slab *get_item_slab(void *item);
 
 
 /*
  * Configuration of the DB
  */
-uint64_t get_highest_rdt(void);
 int get_nb_disks(void);
 size_t pending_work(void);
 
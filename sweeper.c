@@ -0,0 +1,273 @@
+#include "headers.h"
+#include <time.h>
+
+/*
+ * Sweeper of tombstones.
+ * A deleted item keeps its tombstone in the index and on disk (see slab.c). Once no snapshot can read the old versions of the item, these
+ * old versions are freed, but their content stays on disk until their spot is reused. If the tombstone disappeared before them, recovery
+ * would find the old versions and bring the item back. So the tombstone of an item is only dropped once no other copy of the item is left
+ * on disk.
+ *
+ * The sweeper reads the slabs of the worker page by page, in the background. Once its old versions have been freed, the copies of a
+ * deleted item can only be in free spots, after last_item, or in a window being compacted, so pages that only contain used spots are
+ * skipped. A copy older than the tombstone is turned into a tombstone with the timestamp of the copy: the spot stays free, the page is
+ * written, and recovery resolves the copy like any other duplicate (the most recent tombstone wins, and a lone stale tombstone is swept
+ * again). Copies in a window being compacted are left alone.
+ * At the end of a pass, the tombstones that were waiting before the pass started are dropped, unless a copy was left alone; these wait for
+ * the next pass. Passes only happen when tombstones are waiting. Like compaction, the sweeper runs between two batches of requests when
+ * few requests are queued, and never reads more than SWEEPER_MAX_PAGES_PER_SEC pages per second.
+ *
+ * Expired items (see item_set_ttl) are reclaimed the same way. Requests stop seeing them as soon as they expire (see memory_index_lookup),
+ * and every TTL_SWEEP_INTERVAL seconds the sweeper walks the index, TTL_SWEEP_BATCH entries at a time, to mark the expired items as
+ * deleted. An expired item is then a tombstone written at its location: it is passed to the GC like the tombstone of a delete, and dropped
+ * by a pass of the sweeper, which frees all the expired items of the walk in one go. Nothing is written for them. On disk an expired item
+ * still wins against its older copies, so recovery finds it again if it restarts before the item is swept, and it is reclaimed again.
+ * A worker without requests does not sleep past the next walk (see sweeper_next_walk_us), so expired items are reclaimed without traffic.
+ */
+struct waiting_tombstone {
+   uint64_t hash;
+   uint64_t rdt;
+   size_t pass;         // number of passes started before the tombstone was added
+};
+
+struct sweeper {
+   int worker_id;
+   struct slab **slabs;
+   size_t nb_slabs;
+
+   /* Tombstones that can be dropped once no copy of their item is left */
+   struct waiting_tombstone *tombstones;
+   size_t nb_tombstones, max_tombstones;
+
+   /* Current pass */
+   size_t pass;         // number of passes started
+   int running, done;
+   size_t slab, page;   // next page to read
+   size_t nb_pending;   // pages being read or written
+   btree_t *swept;      // hash -> rdt of the tombstones dropped at the end of the pass
+   btree_t *copies;     // swept items that still have a copy on disk
+
+   /* Rate limiting */
+   time_t second;
+   size_t budget;
+
+   /* Walk of the index looking for expired items */
+   int walking;
+   uint64_t cursor;     // last entry visited
+   time_t next_walk;
+
+   /* Stats */
+   size_t nb_dropped, nb_erased, nb_expired;
+};
+
+void sweeper_add_tombstone(struct sweeper *sw, uint64_t hash, uint64_t rdt) {
+   if(sw->nb_tombstones == sw->max_tombstones) {
+      sw->max_tombstones = sw->max_tombstones?2*sw->max_tombstones:1024;
+      sw->tombstones = realloc(sw->tombstones, sw->max_tombstones*sizeof(*sw->tombstones));
+   }
+   sw->tombstones[sw->nb_tombstones].hash = hash;
+   sw->tombstones[sw->nb_tombstones].rdt = rdt;
+   sw->tombstones[sw->nb_tombstones].pass = sw->pass;
+   sw->nb_tombstones++;
+}
+
+static int spot_is_unused(struct slab *s, size_t idx) {
+   return idx >= s->last_item || freelist_is_free(s, idx);
+}
+
+/* Does the page contain spots that might hold a copy of a deleted item? */
+static int page_needs_sweeping(struct slab *s, size_t page) {
+   size_t items_per_page = s->page_size / s->item_size;
+   for(size_t idx = page*items_per_page; idx < (page + 1)*items_per_page; idx++)
+      if(idx >= s->compacting_from || spot_is_unused(s, idx))
+         return 1;
+   return 0;
+}
+
+static void sweep_page_written_cb(struct slab_callback *cb) {
+   struct sweeper *sw = cb->payload;
+   free_slab_callback(cb);
+   sw->nb_pending--;
+}
+
+static void sweep_page_cb(struct slab_callback *cb) {
+   struct sweeper *sw = cb->payload;
+   struct slab *s = cb->slab;
+   char *disk_page = cb->lru_entry->page;
+   size_t items_per_page = s->page_size / s->item_size;
+   int dirty = 0;
+
+   for(size_t i = 0; i < items_per_page; i++) {
+      size_t idx = cb->slab_idx + i;
+      char *item = &disk_page[item_in_page_offset(s, idx)];
+      struct item_metadata *meta = (void*)item;
+      if(meta->key_size == -1 || meta->key_size == 0 || item_is_tombstone(item))
+         continue;
+      uint64_t hash = memory_index_get_hash(sw->worker_id, item);
+      index_entry_t *tombstone, *found;
+      if(!btree_find(sw->swept, (unsigned char*)&hash, sizeof(hash), &tombstone) || meta->rdt >= tombstone->rdt)
+         continue; // not a copy of a swept item, or a more recent version
+      if(idx < s->compacting_from && spot_is_unused(s, idx)) {
+         meta->value_size = TOMBSTONE_VALUE_SIZE; // no snapshot can read the copy, keep the spot free
+         dirty = 1;
+         sw->nb_erased++;
+      } else if(!btree_find(sw->copies, (unsigned char*)&hash, sizeof(hash), &found)) {
+         btree_insert(sw->copies, (unsigned char*)&hash, sizeof(hash), tombstone);
+      }
+   }
+
+   if(dirty) {
+      cb->io_cb = sweep_page_written_cb;
+      write_page_async(cb);
+   } else {
+      sweep_page_written_cb(cb);
+   }
+}
+
+/* All the pages have been swept and no IO is in flight: drop the tombstones that waited for the whole pass and have no copy left */
+static void finish_pass(struct sweeper *sw) {
+   static __thread declare_periodic_count;
+   size_t nb_left = 0;
+   for(size_t i = 0; i < sw->nb_tombstones; i++) {
+      struct waiting_tombstone *t = &sw->tombstones[i];
+      index_entry_t *found;
+      if(t->pass >= sw->pass) { // added during the pass, the pages read before were not swept for it
+         sw->tombstones[nb_left++] = *t;
+      } else if(btree_find(sw->copies, (unsigned char*)&t->hash, sizeof(t->hash), &found)) {
+         t->pass = sw->pass;
+         sw->tombstones[nb_left++] = *t;
+      } else {
+         memory_index_drop_tombstone(sw->worker_id, t->hash, t->rdt); // no-op if the item has been added or deleted again
+         sw->nb_dropped++;
+      }
+   }
+   sw->nb_tombstones = nb_left;
+   btree_free(sw->swept);
+   btree_free(sw->copies);
+   sw->running = 0;
+   sw->done = 0;
+   periodic_count(1000, "[SLAB WORKER %d] Sweeper - dropped %lu tombstones (%lu expired items), erased %lu copies, %lu waiting", sw->worker_id, sw->nb_dropped, sw->nb_expired, sw->nb_erased, sw->nb_tombstones);
+}
+
+static void start_pass(struct sweeper *sw) {
+   sw->pass++;
+   sw->running = 1;
+   sw->slab = 0;
+   sw->page = 0;
+   sw->swept = btree_create();
+   sw->copies = btree_create();
+   for(size_t i = 0; i < sw->nb_tombstones; i++) { // all the tombstones added before the pass can be dropped at its end
+      struct waiting_tombstone *t = &sw->tombstones[i];
+      index_entry_t *found, e = { .rdt = t->rdt };
+      if(!btree_find(sw->swept, (unsigned char*)&t->hash, sizeof(t->hash), &found))
+         btree_insert(sw->swept, (unsigned char*)&t->hash, sizeof(t->hash), &e);
+      else if(found->rdt < t->rdt) // deleted several times
+         found->rdt = t->rdt;
+   }
+}
+
+static void item_expired(uint64_t hash, uint64_t rdt, void *data) {
+   struct sweeper *sw = data;
+   add_expired_in_gc(get_gc(sw->worker_id), sw->worker_id, hash, rdt); // older versions might still be read by snapshots
+   sw->nb_expired++;
+}
+
+static int slabs_have_ttl(struct sweeper *sw) {
+   for(size_t i = 0; i < sw->nb_slabs; i++)
+      if(sw->slabs[i]->expires)
+         return 1;
+   return 0;
+}
+
+/* Returns 1 while walking the index */
+static int expire_items(struct sweeper *sw) {
+   int from_start = 0;
+   if(!TTL_SWEEP_INTERVAL)
+      return 0;
+   if(!sw->walking) {
+      if(time(NULL) < sw->next_walk || !slabs_have_ttl(sw))
+         return 0;
+      sw->walking = 1;
+      from_start = 1;
+   }
+   if(memory_index_expire(sw->worker_id, &sw->cursor, from_start, TTL_SWEEP_BATCH, item_expired, sw) < TTL_SWEEP_BATCH) {
+      sw->walking = 0;
+      sw->next_walk = time(NULL) + TTL_SWEEP_INTERVAL;
+   }
+   return sw->walking;
+}
+
+/* Returns 1 if a pass is running or if the index is being walked */
+int sweeper_step(struct sweeper *sw, size_t nb_pending_requests) {
+   if(!sw || sw->nb_pending || nb_pending_requests >= COMPACTION_MAX_PENDING_REQUESTS)
+      return sw && (sw->running || sw->walking);
+
+   int walking = expire_items(sw);
+
+   if(sw->done)
+      finish_pass(sw);
+   if(!sw->running) {
+      if(!sw->nb_tombstones)
+         return walking;
+      start_pass(sw);
+   }
+
+   time_t now = time(NULL);
+   if(now != sw->second) {
+      sw->second = now;
+      sw->budget = SWEEPER_MAX_PAGES_PER_SEC;
+   }
+
+   while(sw->budget && sw->nb_pending < SWEEPER_BATCH && sw->slab < sw->nb_slabs) {
+      struct slab *s = sw->slabs[sw->slab];
+      size_t items_per_page = s->page_size / s->item_size;
+      size_t nb_pages = (s->last_item + items_per_page - 1) / items_per_page; // compaction punches the pages after last_item
+      if(sw->page >= nb_pages || sw->page*s->page_size >= s->size_on_disk) {
+         sw->slab++;
+         sw->page = 0;
+         continue;
+      }
+      size_t page = sw->page++;
+      if(!page_needs_sweeping(s, page))
+         continue;
+      sw->budget--;
+      sw->nb_pending++;
+      struct slab_callback *cb = new_slab_callback();
+      memset(cb, 0, sizeof(*cb));
+      cb->action = READ_NO_LOOKUP;
+      cb->io_class = IO_CLASS_MAINTENANCE;
+      cb->slab = s;
+      cb->slab_idx = page*items_per_page;
+      cb->payload = sw;
+      cb->io_cb = sweep_page_cb;
+      read_page_async(cb);
+   }
+   if(sw->slab == sw->nb_slabs)
+      sw->done = 1; // the tombstones are dropped at the next step, once all the pages of the pass are on disk
+   return 1;
+}
+
+size_t sweeper_pending_ios(struct sweeper *sw) {
+   return sw?sw->nb_pending:0;
+}
+
+uint64_t sweeper_next_walk_us(struct sweeper *sw) {
+   if(!sw || !TTL_SWEEP_INTERVAL || !slabs_have_ttl(sw)) // the first item with a TTL is written by a request, which wakes up the worker
+      return 0;
+   time_t now = time(NULL);
+   return (sw->next_walk > now)?(sw->next_walk - now)*1000000LU:1;
+}
+
+static void add_recovered_tombstone(uint64_t hash, index_entry_t *e, void *data) {
+   if(get_deleted_bit(e))
+      sweeper_add_tombstone(data, hash, get_rdt_value(e));
+}
+
+struct sweeper *sweeper_init(int worker_id, struct slab **slabs, size_t nb_slabs) {
+   struct sweeper *sw = calloc(1, sizeof(*sw));
+   sw->worker_id = worker_id;
+   sw->slabs = slabs;
+   sw->nb_slabs = nb_slabs;
+   memory_index_forall(worker_id, add_recovered_tombstone, sw); // no snapshot is running after a restart
+   return sw;
+}
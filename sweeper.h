@@ -0,0 +1,14 @@
+#ifndef SWEEPER_H
+#define SWEEPER_H 1
+
+struct sweeper;
+
+struct sweeper *sweeper_init(int worker_id, struct slab **slabs, size_t nb_slabs); // also sweeps the tombstones found by the recovery
+int sweeper_step(struct sweeper *sw, size_t nb_pending_requests);                  // called between two batches of requests and when idle
+size_t sweeper_pending_ios(struct sweeper *sw);                                    // the worker dequeues less requests while pages are being swept
+uint64_t sweeper_next_walk_us(struct sweeper *sw);                                 // how long an idle worker can sleep before looking for expired items, 0 = forever
+
+/* No snapshot can read the versions older than the tombstone anymore, drop it once no copy of the item is left on disk (called by the GC) */
+void sweeper_add_tombstone(struct sweeper *sw, uint64_t hash, uint64_t rdt);
+
+#endif
@@ -0,0 +1,45 @@
+#include "headers.h"
+
+/*
+ * Timestamp oracle.
+ * The DB maintains a global clock that orders commits, snapshots and the items written outside of transactions. It used to be a single
+ * counter incremented by every transaction begin, every commit and every batch of every worker, so its cache line moved between all the
+ * cores all the time. Now, only commits and idle workers write it:
+ * - Commits take even timestamps, clock += 2.
+ * - A transaction reads the clock: its snapshot is clock + 1, the last commit and every batch stamped after it. It does not need a
+ *   timestamp of its own. A snapshot of clock alone would miss the batches stamped clock + 1, and a write acknowledged before the
+ *   transaction began would be invisible to it.
+ * - A worker stamps the items written outside of transactions with clock + 1 (odd): they are more recent than the commits before the
+ *   batch, older than the commits after it, and never equal to a commit timestamp. The timestamp of a worker must increase from one batch
+ *   to the next (recovery keeps the most recent copy of an item), so the worker only advances the clock when no commit happened since
+ *   its last batch.
+ * Read-only transactions never write the clock, and workers rarely do when transactions commit.
+ * Timestamps are stored in 60 bits with the flags of the index (see TRANSACTION_MASK), so a per-thread clock (e.g., rdtsc) or ranges of
+ * timestamps per thread do not fit: a snapshot must be ordered with every commit, whatever the thread that took it.
+ */
+static struct {
+   volatile uint64_t value;
+   char padding[56];                  // keep the clock alone on its cache line
+} global_clock __attribute__((aligned(64)));
+
+uint64_t timestamp_read(void) {
+   return global_clock.value + 1;
+}
+
+uint64_t timestamp_commit(void) {
+   return __sync_add_and_fetch(&global_clock.value, 2);
+}
+
+uint64_t timestamp_batch(uint64_t previous) {
+   uint64_t now = global_clock.value;
+   if(now + 1 <= previous) // no commit since the last batch
+      now = __sync_add_and_fetch(&global_clock.value, 2);
+   return now + 1;
+}
+
+void timestamp_recovered(uint64_t rdt) {
+   rdt += rdt % 2; // commits are even
+   uint64_t now = global_clock.value;
+   while(rdt > now && !__sync_bool_compare_and_swap(&global_clock.value, now, rdt))
+      now = global_clock.value;
+}
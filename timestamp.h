@@ -0,0 +1,9 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H 1
+
+uint64_t timestamp_read(void);                   // snapshot of a new transaction (last commit and the batches after it), no write to the shared clock
+uint64_t timestamp_commit(void);                 // unique timestamp of a commit
+uint64_t timestamp_batch(uint64_t previous);     // timestamp of the items written by a batch of a worker, > previous
+void timestamp_recovered(uint64_t rdt);          // timestamps are bigger than the ones found on disk
+
+#endif
@@ -1,7 +1,7 @@
 #include "headers.h"
-#include "indexes/pqueue.h"
 
-#define MAXIMUM_CONCURRENT_TRANSACTIONS 100000
+#define MAXIMUM_CONCURRENT_TRANSACTIONS 65536 // per thread
+#define MAXIMUM_REGISTRY_SHARDS 1024
 
 /*
  * This file contains all the logic related to the list of all running transactions:
@@ -9,64 +9,157 @@
  * - min active commit
  * - for OLCP transactions: propagation of items to all long running transactions
  * - etc.
+ *
+ * Transactions are registered in the shard of the thread that creates them, so that creating and ending transactions never takes a
+ * global lock. A shard has two rings: running transactions (with their snapshot) and transactions in a commit (with their ID on disk).
+ * - Only the thread that owns the shard adds entries at the tail of the rings. Ending a transaction only clears its entry, which can
+ *   be done from any thread; the owner frees the cleared entries at the head of the rings when it registers new transactions.
+ * - The oldest snapshot / commit is computed when asked (get_min_snapshot_id, get_min_in_commit): it is the first entry that has not
+ *   been cleared in each shard. Entries are added in timestamp order, so the first entry is the oldest of the shard.
+ * - Entries are published before their timestamp is taken, with a timestamp that is at most the final one (0 for snapshots, the
+ *   current timestamp for commits). So a transaction that takes its snapshot after a commit got its ID always sees that commit in
+ *   get_min_in_commit, and the GC never misses a snapshot being taken.
+ * Long running (OLCP) transactions go in a shared shard, protected by long_transactions_lock, because they stay at the head of their
+ * ring for a long time and would prevent the owner from reusing the ring. There are few of them.
+ * Shards of threads that exit are reused by new threads.
  */
 
-struct running_transaction {
-	uint64_t transaction_id;
-	uint64_t snapshot_id;
+struct registered_transaction {
+   volatile uint64_t transaction_id;   // snapshot ring: ID of the transaction; commit ring: ID on disk
+   volatile uint64_t snapshot_id;
+   volatile int running;
 };
-struct running_transaction_list {
-   struct running_transaction *transactions;
-   size_t head, tail;
-   size_t max_avail;
-   size_t max_recorded_parallel_transactions; // stats
-} running_transactions;
 
+struct registry_ring {
+   struct registered_transaction *entries;
+   volatile size_t head, tail;
+};
+
+struct registry_shard {
+   struct registry_ring running, in_commit;
+   volatile int owned;
+   size_t nb_started;                                    // written by the owner
+   volatile size_t nb_ended __attribute__((aligned(64))); // written by any thread
+   size_t max_recorded_parallel_transactions __attribute__((aligned(64))); // stats
+};
+
+static struct registry_shard *shards[MAXIMUM_REGISTRY_SHARDS];
+static volatile size_t nb_shards;
+static pthread_mutex_t shards_lock;
+static pthread_key_t shard_key;
+static __thread struct registry_shard *my_shard;
+
+static struct registry_shard *long_transactions_shard;
 static struct transaction *long_transactions_head, *long_transactions_tail;
+static pthread_mutex_t long_transactions_lock;
+
+#define ring_entry(r, i) (&(r).entries[(i) % MAXIMUM_CONCURRENT_TRANSACTIONS])
+
+static struct registry_shard *create_shard(void) {
+   struct registry_shard *s = calloc(1, sizeof(*s));
+   s->running.entries = calloc(MAXIMUM_CONCURRENT_TRANSACTIONS, sizeof(*s->running.entries));
+   s->in_commit.entries = calloc(MAXIMUM_CONCURRENT_TRANSACTIONS, sizeof(*s->in_commit.entries));
+   s->owned = 1;
+
+   pthread_mutex_lock(&shards_lock);
+   if(nb_shards == MAXIMUM_REGISTRY_SHARDS)
+      die("Too many threads creating transactions, increase MAXIMUM_REGISTRY_SHARDS\n");
+   shards[nb_shards] = s;
+   __sync_synchronize();
+   nb_shards++;
+   pthread_mutex_unlock(&shards_lock);
+   return s;
+}
 
-#define tail(r) ((r).tail % (r).max_avail)
-#define last(r) (((r).tail - 1)  % (r).max_avail)
-#define arr_idx(r, i) ((i)  % (r).max_avail)
-#define head(r) ((r).head % (r).max_avail)
-#define next(r, pos) ((pos + 1) % (r).max_avail)
-#define prev(r, pos) ( (pos == 0)?((r).max_avail - 1):(pos - 1) )
+/* Called when a thread exits */
+static void release_shard(void *data) {
+   struct registry_shard *s = data;
+   __sync_synchronize();
+   s->owned = 0;
+}
 
-static pthread_mutex_t running_lock;
+static struct registry_shard *get_my_shard(void) {
+   if(my_shard)
+      return my_shard;
+   for(size_t i = 0; i < nb_shards; i++) {
+      if(shards[i] != long_transactions_shard && !shards[i]->owned && __sync_bool_compare_and_swap(&shards[i]->owned, 0, 1)) {
+         my_shard = shards[i];
+         break;
+      }
+   }
+   if(!my_shard)
+      my_shard = create_shard();
+   pthread_setspecific(shard_key, my_shard);
+   return my_shard;
+}
+
+/* Add an entry at the tail of a ring, only called by the owner of the ring */
+static struct registered_transaction *ring_push(struct registry_ring *r, uint64_t transaction_id, uint64_t snapshot_id) {
+   while(r->head != r->tail && !ring_entry(*r, r->head)->running) // free the transactions that ended
+      r->head++;
+   if(r->tail - r->head == MAXIMUM_CONCURRENT_TRANSACTIONS)
+      die("Maximum number of parallel transactions exceeded\n");
+
+   struct registered_transaction *e = ring_entry(*r, r->tail);
+   e->transaction_id = transaction_id;
+   e->snapshot_id = snapshot_id;
+   e->running = 1;
+   __sync_synchronize(); // the entry is visible before the new tail
+   r->tail++;
+   return e;
+}
+
+/* First entry of the ring that did not end, or NULL */
+static struct registered_transaction *ring_first(struct registry_ring *r) {
+   for(size_t i = r->head; i < r->tail; i++) {
+      struct registered_transaction *e = ring_entry(*r, i);
+      if(e->running)
+         return e;
+   }
+   return NULL;
+}
 
 /*
  * New transaction
  */
 uint64_t register_new_transaction(struct transaction *t) {
    uint64_t rdt, snapshot;
-   struct running_transaction *r;
+   struct registry_shard *s;
+   struct registered_transaction *r;
+
+   if(get_map(t)) { // Long running transactions are registered in their own shard
+      pthread_mutex_lock(&long_transactions_lock);
+      s = long_transactions_shard;
+   } else {
+      s = get_my_shard();
+   }
 
-   pthread_mutex_lock(&running_lock);
+   /*
+    * 1/ Insert the transaction in the list of running transactions, the GC does not clean anything until the snapshot is known
+    */
+   r = ring_push(&s->running, 0, 0);
+   s->nb_started++;
 
    /*
-    * 1/ Get the snapshot timestamp of the transaction
+    * 2/ Get the snapshot timestamp of the transaction
     */
-   rdt = get_highest_rdt();         // current global timestamp of the KV
+   rdt = timestamp_read();          // current global timestamp of the KV (latest commit and the batches that followed it)
    snapshot = get_min_in_commit();  // Ignore every commit that is not yet fully committed
    if(snapshot == -1)               // If no transaction is in the process of committing
       snapshot = rdt;               // ... then still refuse reading anything more recent than our timestamp*/
 
-   r = &running_transactions.transactions[tail(running_transactions)];
    r->transaction_id = rdt;
    r->snapshot_id = snapshot;
+   transaction_get_registration(t)->shard = s;
+   transaction_get_registration(t)->running = r;
 
    set_transaction_id(t, rdt);
    set_snapshot_version(t, snapshot);
 
-   /*
-    * 2/ Insert the transaction in the list of running transactions
-    */
-   running_transactions.tail++;
-   if(tail(running_transactions) == head(running_transactions)) {
-      die("Maximum number of parallel transactions exceeded\n");
-   } else {
+   if(s->nb_started % 64 == 0) { // stats, sampled
       uint64_t pending = get_nb_running_transactions();
-      if(pending > running_transactions.max_recorded_parallel_transactions)
-         running_transactions.max_recorded_parallel_transactions = pending;
+      if(pending > s->max_recorded_parallel_transactions)
+         s->max_recorded_parallel_transactions = pending;
    }
 
    /*
@@ -84,54 +177,39 @@ uint64_t register_new_transaction(struct transaction *t) {
          long_transactions_head = t;
          long_transactions_tail = t;
       }
+      pthread_mutex_unlock(&long_transactions_lock);
    }
 
-   pthread_mutex_unlock(&running_lock);
-
-
    return rdt;
 }
 
 uint64_t get_max_recorded_parallel_transactions(void) {
-   return running_transactions.max_recorded_parallel_transactions;
+   uint64_t max = 0;
+   for(size_t i = 0; i < nb_shards; i++)
+      if(shards[i]->max_recorded_parallel_transactions > max)
+         max = shards[i]->max_recorded_parallel_transactions;
+   return max;
 }
 
 size_t get_nb_running_transactions(void) {
-   return running_transactions.tail - running_transactions.head;
+   size_t nb_started = 0, nb_ended = 0;
+   for(size_t i = 0; i < nb_shards; i++) {
+      nb_ended += shards[i]->nb_ended; // read before nb_started, so that ended transactions are counted as started
+      __sync_synchronize();
+      nb_started += shards[i]->nb_started;
+   }
+   return (nb_started > nb_ended)?(nb_started - nb_ended):0;
 }
 
 
 /*
- * End of a transaction (called after commit)
+ * End of a transaction (called after commit), from any thread
  */
-static void register_end_running_transaction(size_t id) {
-   size_t pos, start;
-   struct running_transaction *r;
-
-   pthread_mutex_lock(&running_lock);
-
-   // Find the transaction in the transaction array
-   start = head(running_transactions);
-   pos = start;
-   do {
-      r = &running_transactions.transactions[pos];
-      if(r->transaction_id == id)
-         break;
-      pos = next(running_transactions, pos);
-      assert(pos != start); // bug if we looped == didn't find the transaction
-   } while(1);
-
-   if(pos != start) { // Shift the array so that it only contains running transactions
-      while(pos != start) {
-         size_t _prev = prev(running_transactions, pos);
-         running_transactions.transactions[pos] = running_transactions.transactions[_prev];
-         pos = _prev;
-      }
-   }
-   memset(&running_transactions.transactions[start], 0, sizeof(running_transactions.transactions[start])); // clean the spot
-   running_transactions.head++;
-
-   pthread_mutex_unlock(&running_lock);
+static void register_end_running_transaction(struct transaction *t) {
+   struct transaction_registration *r = transaction_get_registration(t);
+   r->running->running = 0;
+   __sync_fetch_and_add(&r->shard->nb_ended, 1);
+   r->running = NULL;
 }
 
 /*
@@ -139,7 +217,7 @@ static void register_end_running_transaction(size_t id) {
  */
 void register_start_commit(struct transaction *t) {
    if(get_map(t)) {
-      pthread_mutex_lock(&running_lock);
+      pthread_mutex_lock(&long_transactions_lock);
       if(t == long_transactions_head)
          long_transactions_head = transaction_get_long_next(t);
       if(t == long_transactions_tail)
@@ -152,7 +230,7 @@ void register_start_commit(struct transaction *t) {
          struct transaction *prev = transaction_get_long_prev(t);
          transaction_set_long_next(prev, transaction_get_long_next(t));
       }
-      pthread_mutex_unlock(&running_lock);
+      pthread_mutex_unlock(&long_transactions_lock);
    }
 }
 
@@ -181,89 +259,62 @@ void forall_long_running_transaction(size_t min_rdt, size_t max_rdt, void *data)
 
 /*
  * Get the snapshot ID of the oldest transaction.
- * TODO: compute the min in register_new_transaction!
  */
 uint64_t get_min_snapshot_id(void) {
-   uint64_t snapshot_id;
-   //pthread_mutex_lock(&running_lock);
-   if(tail(running_transactions) == head(running_transactions)) {
-      snapshot_id = get_highest_rdt();
-   } else {
-      snapshot_id = running_transactions.transactions[head(running_transactions)].snapshot_id;
+   uint64_t now = timestamp_read(); // before looking at the shards: transactions that are not registered yet will have a snapshot >= now
+   uint64_t snapshot_id = -1;
+   for(size_t i = 0; i < nb_shards; i++) {
+      struct registered_transaction *r = ring_first(&shards[i]->running);
+      uint64_t snapshot = r?r->snapshot_id:-1;
+      if(snapshot < snapshot_id)
+         snapshot_id = snapshot;
    }
-   //pthread_mutex_unlock(&running_lock);
+   if(snapshot_id == -1)
+      snapshot_id = now;
    return snapshot_id;
 }
 
 /*
  * Helpers for transactions in a commit
  */
-static pthread_mutex_t in_commit_lock;
-static pqueue_t *in_commit;
-
-typedef struct node_t {
-   pqueue_pri_t transaction_id;
-   size_t pos;
-} node_t;
-
-
-static int cmp_pri(pqueue_pri_t next, pqueue_pri_t curr) {
-   return (next > curr);
-}
-
-static pqueue_pri_t get_pri(void *a) {
-   return ((node_t *) a)->transaction_id;
-}
-
-static void set_pri(void *a, pqueue_pri_t pri) {
-   ((node_t *) a)->transaction_id = pri;
-}
-
-static size_t get_pos(void *a) {
-   return ((node_t *) a)->pos;
-}
-
-static void set_pos(void *a, size_t pos) {
-   ((node_t *) a)->pos = pos;
-}
-
-size_t register_commit_transaction(size_t id) {
+size_t register_commit_transaction(struct transaction *t) {
    uint64_t rdt;
-   struct node_t *n = malloc(sizeof(*n));
-   pthread_mutex_lock(&in_commit_lock);
-   rdt = get_highest_rdt();
-   n->transaction_id = rdt;
-   pqueue_insert(in_commit, n);
-   pthread_mutex_unlock(&in_commit_lock);
+   struct registered_transaction *r;
+   r = ring_push(&get_my_shard()->in_commit, timestamp_read(), 0); // published before taking the ID, see above
+   rdt = timestamp_commit();
+   r->transaction_id = rdt;
+   transaction_get_registration(t)->in_commit = r;
    return rdt;
 }
 
 
 size_t get_min_in_commit(void) {
-   struct node_t *min;
-   pthread_mutex_lock(&in_commit_lock);
-   min = pqueue_peek(in_commit);
-   pthread_mutex_unlock(&in_commit_lock);
-   return min?min->transaction_id:-1;
+   uint64_t min = -1;
+   for(size_t i = 0; i < nb_shards; i++) {
+      struct registered_transaction *r = ring_first(&shards[i]->in_commit);
+      uint64_t id = r?r->transaction_id:-1;
+      if(id < min)
+         min = id;
+   }
+   return min;
 }
 
-void register_end_transaction(size_t id, size_t id_on_disk) {
-   if(id_on_disk) { // only true if the transaction didn't fail, otherwise it never registered itself as "committing"
-      pthread_mutex_lock(&in_commit_lock);
-      pqueue_find_and_remove(in_commit, id_on_disk);
-      pthread_mutex_unlock(&in_commit_lock);
+void register_end_transaction(struct transaction *t) {
+   struct transaction_registration *r = transaction_get_registration(t);
+   if(r->in_commit) { // only true if the transaction didn't fail, otherwise it never registered itself as "committing"
+      r->in_commit->running = 0;
+      r->in_commit = NULL;
    }
 
-   register_end_running_transaction(id);
+   register_end_running_transaction(t);
 }
 
 /*
  * Init function, must be called before creating transactions
  */
 void init_transaction_manager(void) {
-   pthread_mutex_init(&running_lock, NULL);
-   running_transactions.transactions = calloc(MAXIMUM_CONCURRENT_TRANSACTIONS, sizeof(*running_transactions.transactions));
-   running_transactions.max_avail = MAXIMUM_CONCURRENT_TRANSACTIONS;
-   pthread_mutex_init(&in_commit_lock, NULL);
-   in_commit = pqueue_init(200, cmp_pri, get_pri, set_pri, get_pos, set_pos);
+   pthread_mutex_init(&shards_lock, NULL);
+   pthread_mutex_init(&long_transactions_lock, NULL);
+   pthread_key_create(&shard_key, release_shard);
+   long_transactions_shard = create_shard();
 }
@@ -3,10 +3,17 @@
 
 void init_transaction_manager(void);
 
+/* Where a transaction is registered, stored in the transaction */
+struct transaction_registration {
+   struct registry_shard *shard;
+   struct registered_transaction *running;
+   struct registered_transaction *in_commit;
+};
+
 uint64_t register_new_transaction(struct transaction *t); // create a transaction
-size_t register_commit_transaction(size_t id);            // indicate that a transaction is committing - returns the ID on disk
+size_t register_commit_transaction(struct transaction *t); // indicate that a transaction is committing - returns the ID on disk
 void register_start_commit(struct transaction *t); // commit or abort is starting
-void register_end_transaction(size_t id, size_t id_on_disk); // commit or abort is complete
+void register_end_transaction(struct transaction *t); // commit or abort is complete
 
 size_t get_min_transaction_id(void);
 size_t get_min_in_commit(void);
@@ -3,16 +3,40 @@
 #define FLAG_READ 1
 #define FLAG_WRITE 2
 
+/*
+ * Items read or written by a transaction are cached in the transaction (its write set) until the commit.
+ * Most transactions only touch a few items: the first WRITE_SET_INLINE_ENTRIES entries live in the transaction and are searched
+ * linearly. Bigger write sets move to an array that doubles, indexed by an open-addressing hash table (hash of the key -> entry).
+ * The content of the items is copied in an arena of WRITE_SET_CHUNK_SIZE chunks that grows on demand (items bigger than a chunk get a
+ * chunk of their own). Items never move, so the item of an entry can be handed to the KV during the commit. Chunks are recycled
+ * through a pool with a per-thread cache (see pool.c).
+ */
+#define WRITE_SET_INLINE_ENTRIES 8
+#define WRITE_SET_CHUNK_SIZE (4*PAGE_SIZE)
+
+struct write_set_entry {
+   uint64_t hash;
+   char *item;
+   size_t flags;
+};
+
+struct arena_chunk {
+   struct arena_chunk *next;
+   size_t size, used;
+   char data[];
+};
+
 // TODO: prevent user to call more reads / write on an aborted transaction
 
 struct transaction {
    size_t transaction_id;
    size_t transaction_id_on_disk;
    size_t snapshot;
-   size_t size;
-   size_t used_size;
-   char *cached_data;
-   btree_t *index;
+   struct write_set_entry inline_entries[WRITE_SET_INLINE_ENTRIES];
+   struct write_set_entry *entries;      // inline_entries, or an array of max_entries entries
+   size_t max_entries;
+   struct openhash *entries_index;       // hash -> position in entries of the first key with that fingerprint, only for big write sets
+   struct arena_chunk *chunks;           // content of the items, most recent chunk first
    int failed;
    size_t nb_items;
    size_t nb_items_written_on_disk;
@@ -28,6 +52,7 @@ struct transaction {
    struct slab_callback *map;
    struct injector_queue *injector_queue;
    struct transaction *long_prev, *long_next;
+   struct transaction_registration registration;
 };
 
 size_t get_unique_key_for_transaction(struct transaction *t) {
@@ -102,13 +127,11 @@ void transaction_set_long_prev(struct transaction *t, struct transaction *prev)
    t->long_prev = prev;
 }
 
-
-static uint64_t get_prefix_for_item(char *item) {
-   struct item_metadata *meta = (struct item_metadata *)item;
-   char *item_key = &item[sizeof(*meta)];
-   return *(uint64_t*)item_key;
+struct transaction_registration *transaction_get_registration(struct transaction *t) {
+   return &t->registration;
 }
 
+
 int set_abort_flag(struct transaction *t, struct slab_callback *trans_callback) {
    if(trans_callback->failed) { // operation aborted by the KV because of conflicting transaction => abort
       t->failed = 1;
@@ -145,49 +168,125 @@ int action_allowed(index_entry_t *e, struct slab_callback *cb) {
       return 1;
    } else if(action == READ || action == READ_NEXT || action == READ_NEXT_BATCH) {
       if(get_rdt_value(e) > snapshot) { // Item is too recent ==> abort
-         //printf("Trans %lu Refusing to read %lu because %lu > %lu\n", transaction_id, get_prefix_for_item(cb->item), get_rdt_value(e), snapshot);
+         //printf("Trans %lu Refusing to read %lu because %lu > %lu\n", transaction_id, item_get_key_hash(cb->item), get_rdt_value(e), snapshot);
          return 0;
       }
       if(e->slab == NULL) { // Item has been reserved but has not been written yet ==> abort
-         //printf("Refusing to read %lu because slab is NULL\n", get_prefix_for_item(cb->item));
+         //printf("Refusing to read %lu because slab is NULL\n", item_get_key_hash(cb->item));
          return 0;
       }
       return 1;
    } else {
       if(get_locked_bit(e)) { // Item is locked ==> abort
-         //printf("Not allowed because of lock, action %d, item %lu\n", action, get_prefix_for_item(cb->item));
+         //printf("Not allowed because of lock, action %d, item %lu\n", action, item_get_key_hash(cb->item));
          return 0;
       }
       if(get_rdt_value(e) > snapshot) { // Item is too recent ==> abort
-         //printf("Not allowed because of snapshot %lu vs %lu, action %d, item %lu\n", get_rdt_value(e), snapshot, action, get_prefix_for_item(cb->item));
+         //printf("Not allowed because of snapshot %lu vs %lu, action %d, item %lu\n", get_rdt_value(e), snapshot, action, item_get_key_hash(cb->item));
          return 0;
       }
       return 1;
    }
 }
 
+/*
+ * Write set of the transaction
+ */
+static struct pool chunk_pool;
+__attribute__((constructor)) static void init_chunk_pool(void) {
+   pool_init(&chunk_pool, "transaction_chunk", sizeof(struct arena_chunk) + WRITE_SET_CHUNK_SIZE);
+}
+
+static void write_set_init(struct transaction *t) {
+   t->entries = t->inline_entries;
+   t->max_entries = WRITE_SET_INLINE_ENTRIES;
+}
+
+static void write_set_free(struct transaction *t) {
+   while(t->chunks) {
+      struct arena_chunk *c = t->chunks;
+      t->chunks = c->next;
+      if(c->size == WRITE_SET_CHUNK_SIZE)
+         pool_free(&chunk_pool, c);
+      else
+         free(c);
+   }
+   if(t->entries != t->inline_entries)
+      free(t->entries);
+   if(t->entries_index)
+      openhash_free(t->entries_index);
+   t->entries = NULL;
+   t->entries_index = NULL;
+}
+
+/* Space for an item in the arena */
+static char *arena_alloc(struct transaction *t, size_t size) {
+   struct arena_chunk *c = t->chunks;
+   if(!c || c->used + size > c->size) {
+      if(size > WRITE_SET_CHUNK_SIZE) {
+         c = malloc(sizeof(*c) + size);
+         c->size = size;
+      } else {
+         c = pool_alloc(&chunk_pool);
+         c->size = WRITE_SET_CHUNK_SIZE;
+      }
+      c->used = 0;
+      c->next = t->chunks;
+      t->chunks = c;
+   }
+   char *data = &c->data[c->used];
+   c->used += size;
+   return data;
+}
+
+/* Entries are full: double the array and rebuild the index */
+static void write_set_grow(struct transaction *t) {
+   size_t max_entries = 2*t->max_entries;
+   struct write_set_entry *entries = malloc(max_entries*sizeof(*entries));
+   memcpy(entries, t->entries, t->nb_items*sizeof(*entries));
+   if(t->entries != t->inline_entries)
+      free(t->entries);
+   t->entries = entries;
+   t->max_entries = max_entries;
+
+   if(t->entries_index)
+      openhash_free(t->entries_index);
+   t->entries_index = openhash_create(max_entries);
+   uint32_t pos;
+   for(size_t i = 0; i < t->nb_items; i++)
+      if(!openhash_lookup(t->entries_index, t->entries[i].hash, &pos))
+         openhash_insert(t->entries_index, t->entries[i].hash, i);
+}
+
 /*
  * Is an item in the transaction cache?
+ * Entries are found by fingerprint, and the full keys are compared because 2 keys of the write set can have the same fingerprint.
  */
-static index_entry_t *transaction_lookup(struct transaction *t, void *item) {
+static struct write_set_entry *transaction_lookup(struct transaction *t, void *item) {
    if(!item)
       return NULL;
 
-   index_entry_t *tmp_entry;
-   uint64_t hash = get_prefix_for_item(item);
-   int res = btree_find(t->index, (unsigned char*)&hash, sizeof(hash), &tmp_entry);
-   if(res)
-      return tmp_entry;
-   else
-      return NULL;
+   uint32_t pos = 0;
+   uint64_t hash = item_get_key_hash(item);
+   if(t->entries_index) {
+      if(!openhash_lookup(t->entries_index, hash, &pos))
+         return NULL;
+      if(item_keys_match(t->entries[pos].item, item))
+         return &t->entries[pos];
+      pos++; // the index only knows the first key of a fingerprint, the others come after it
+   }
+   for(size_t i = pos; i < t->nb_items; i++)
+      if(t->entries[i].hash == hash && item_keys_match(t->entries[i].item, item))
+         return &t->entries[i];
+   return NULL;
 }
 
 static void* transaction_cached_get(struct transaction *t, struct slab_callback *callback) {
-   index_entry_t *e = transaction_lookup(t, callback->item);
+   struct write_set_entry *e = transaction_lookup(t, callback->item);
    if(!e)
       return NULL;
    else
-      return &t->cached_data[e->cached_data_idx];
+      return e->item;
 }
 
 /*
@@ -197,30 +296,28 @@ static void transaction_cached_put(struct transaction *t, void *item, size_t fla
    if(!item)
       return;
 
-   uint64_t hash = get_prefix_for_item(item);
    uint64_t item_size = get_item_size(item);
-   index_entry_t *e = transaction_lookup(t, item);
+   struct write_set_entry *e = transaction_lookup(t, item);
    if(e) { // data is already cached in
-      uint64_t old_size = get_item_size(&t->cached_data[e->cached_data_idx]);
-      flags |= e->transaction_flags;
-      if(old_size != item_size || flags != e->transaction_flags) {
-         btree_delete(t->index, (unsigned char*)&hash, sizeof(hash));
-      } else {
-         memcpy(&t->cached_data[e->cached_data_idx], item, item_size);
-         return;
-      }
-   } else {
-      t->nb_items++;
+      e->flags |= flags;
+      if(get_item_size(e->item) != item_size) // the old copy stays in the arena until the end of the transaction
+         e->item = arena_alloc(t, item_size);
+      memcpy(e->item, item, item_size);
+      return;
    }
 
-   // Data is not cached (or size changed or flags changed)
-   index_entry_t tmp;
-   tmp.cached_data_idx = t->used_size;
-   t->used_size += item_size;
-   assert(t->used_size < t->size); //TODO: resize!
-   tmp.transaction_flags = flags;
-   memcpy(&t->cached_data[tmp.cached_data_idx], item, item_size);
-   btree_insert(t->index, (unsigned char*)&hash, sizeof(hash), &tmp);
+   // Data is not cached
+   if(t->nb_items == t->max_entries)
+      write_set_grow(t);
+   e = &t->entries[t->nb_items];
+   e->hash = item_get_key_hash(item);
+   e->flags = flags;
+   e->item = arena_alloc(t, item_size);
+   memcpy(e->item, item, item_size);
+   uint32_t pos;
+   if(t->entries_index && !openhash_lookup(t->entries_index, e->hash, &pos))
+      openhash_insert(t->entries_index, e->hash, t->nb_items);
+   t->nb_items++;
 }
 
 
@@ -233,7 +330,7 @@ static void complete_client_op(struct slab_callback *trans_callback, void *item)
    callback->next = NULL;
    if(callback->cb)
       callback->cb(callback, item); // direct call because always in good context
-   free(trans_callback);
+   free_slab_callback(trans_callback);
 }
 
 /*
@@ -263,7 +360,7 @@ void kv_trans_read(struct transaction *t, struct slab_callback *callback) {
       return;
    }
 
-   struct slab_callback *new_cb = calloc(1, sizeof(*new_cb));
+   struct slab_callback *new_cb = new_slab_callback();
    new_cb->transaction = t;
    new_cb->cb = kv_trans_read_cb;
    new_cb->payload = callback;
@@ -277,7 +374,7 @@ void kv_trans_read(struct transaction *t, struct slab_callback *callback) {
  */
 void kv_trans_write_cb(struct slab_callback *trans_callback, void *item) {
    struct transaction *t = trans_callback->transaction;
-   assert(t->cached_data);
+   assert(t->entries);
    set_abort_flag(t, trans_callback);
    if(!trans_callback->failed) // we check on the *callback* not on the transaction; the transaction might have failed due to a previous callback but *this* callback might have succeeded in locking the item
       transaction_cached_put(trans_callback->transaction, trans_callback->item, FLAG_WRITE); // if it succeeded, the item *must* be placed in the btree so that we unlock it when committing or aborting, otherwise the lock is never released
@@ -285,40 +382,84 @@ void kv_trans_write_cb(struct slab_callback *trans_callback, void *item) {
 }
 
 
-void kv_trans_write(struct transaction *t, struct slab_callback *callback) {
-   assert(t->cached_data);
+/* Returns the callback that locks the item in the in memory index, or NULL if the write has already been completed */
+static struct slab_callback *kv_trans_write_lock(struct transaction *t, struct slab_callback *callback) {
+   assert(t->entries);
    assert(callback->item);
    assert(callback->injector_queue); // Transactions are not thread safe and callbacks must be called within a thread context
-   assert(t->cached_data);
    callback->transaction = t;
    callback->action = READ_FOR_WRITE;
 
    if(has_failed(t)) {
       if(callback->cb)
          callback->cb(callback, NULL);
-      return;
+      return NULL;
    }
 
    t->has_write = 1;
 
-   index_entry_t *e = transaction_lookup(t, callback->item);
+   struct write_set_entry *e = transaction_lookup(t, callback->item);
    if(e) { // data is cached
-      if(e->transaction_flags & FLAG_WRITE) { // second update to the same item, ok, do the update in the cache (no need to propagate)
+      if(e->flags & FLAG_WRITE) { // second update to the same item, ok, do the update in the cache (no need to propagate)
          transaction_cached_put(t, callback->item, FLAG_WRITE);
          if(callback->cb)
             callback->cb(callback, NULL);
-         return;
+         return NULL;
       }
    }
 
    // Otherwise we need to lock the item in the in memory index, so call the main DB for that
-   struct slab_callback *new_cb = calloc(1, sizeof(*new_cb));
+   struct slab_callback *new_cb = new_slab_callback();
    new_cb->transaction = t;
    new_cb->cb = kv_trans_write_cb;
    new_cb->payload = callback;
    new_cb->item = callback->item;
    new_cb->injector_queue = callback->injector_queue;
-   kv_lock_async(new_cb);
+   return new_cb;
+}
+
+void kv_trans_write(struct transaction *t, struct slab_callback *callback) {
+   struct slab_callback *new_cb = kv_trans_write_lock(t, callback);
+   if(new_cb)
+      kv_lock_async(new_cb);
+}
+
+/*
+ * Per thread arrays of callbacks used to send the requests of a transaction together (same idea as the arrays of enqueue_many).
+ * Reservations are stacked because a user callback called by kv_trans_write_lock can send requests itself; the array might be reallocated
+ * by such a nested call, so it is always indexed from scratch_callbacks and never through a saved pointer.
+ */
+static __thread struct slab_callback **scratch_callbacks;
+static __thread size_t scratch_used, scratch_capacity;
+
+static size_t scratch_reserve(size_t nb) {
+   size_t base = scratch_used;
+   if(base + nb > scratch_capacity) {
+      scratch_capacity = (base + nb > 2*scratch_capacity)?(base + nb):2*scratch_capacity;
+      scratch_callbacks = realloc(scratch_callbacks, scratch_capacity * sizeof(*scratch_callbacks));
+   }
+   scratch_used = base + nb;
+   return base;
+}
+
+static void scratch_release(size_t base) {
+   scratch_used = base;
+}
+
+/*
+ * Same as calling kv_trans_write on all the callbacks, but the locks are sent as one multi-key request per worker (see kv_lock_many).
+ * The writes must be independent: the same item should not appear twice in callbacks.
+ */
+void kv_trans_write_many(struct transaction *t, struct slab_callback **callbacks, size_t nb) {
+   size_t base = scratch_reserve(nb), nb_locks = 0;
+   for(size_t i = 0; i < nb; i++) {
+      struct slab_callback *new_cb = kv_trans_write_lock(t, callbacks[i]);
+      if(new_cb)
+         scratch_callbacks[base + nb_locks++] = new_cb;
+   }
+   if(nb_locks)
+      kv_lock_many(&scratch_callbacks[base], nb_locks);
+   scratch_release(base);
 }
 
 /*
@@ -331,17 +472,16 @@ void kv_trans_write(struct transaction *t, struct slab_callback *callback) {
  */
 void kv_commit_cb(struct slab_callback *trans_callback, void *item) {
    struct transaction *t = trans_callback->transaction;
-   register_end_transaction(t->transaction_id, t->transaction_id_on_disk);
+   register_end_transaction(t);
 
-   btree_free(t->index);
+   write_set_free(t);
    free(t->delayed_work);
-   free(t->cached_data);
 
    struct slab_callback *user_callback = trans_callback->payload;
    if(user_callback->cb)
       user_callback->cb(user_callback, NULL);
    free(trans_callback->item);
-   free(trans_callback);
+   free_slab_callback(trans_callback);
 }
 
 /*
@@ -363,48 +503,47 @@ void write_items_to_disk_cb(struct slab_callback *callback, void *item) {
                         //    because we have the nb items as values ==> could use that in recovery
    }
    // do not free callback->item because it refers to cached data
-   free(callback);
+   free_slab_callback(callback);
 }
 
 
 /*
- * 2/ Slow path -- For each key in the transaction index, write the new value to disk
+ * 2/ Slow path -- For each key in the transaction index, prepare the write of the new value to disk
  * If the transaction crashes mid-way, these values will be ignored.
  * Items are still locked in the indexes
  * Called in injector context.
  */
-void write_items_to_disk(uint64_t hash, void *data) {
-   void *cached_data;
-   index_entry_t *tmp_entry;
-   struct slab_callback *callback = data;
+struct slab_callback *write_items_to_disk(struct write_set_entry *e, struct slab_callback *callback) {
    struct transaction *t = callback->transaction;
 
-   int res = btree_find(t->index, (unsigned char*)&hash, sizeof(hash), &tmp_entry);
-   assert(res);
-   cached_data = &t->cached_data[tmp_entry->cached_data_idx];
-
-   if(tmp_entry->transaction_flags & FLAG_WRITE) {
-      struct slab_callback *new_cb = calloc(1, sizeof(*new_cb));
+   if(e->flags & FLAG_WRITE) {
+      struct slab_callback *new_cb = new_slab_callback();
       new_cb->transaction = t;
       new_cb->cb = write_items_to_disk_cb;
       new_cb->payload = callback;
       new_cb->injector_queue = callback->injector_queue;
-      new_cb->item = cached_data;
-      kv_update_async(new_cb); // has to be done by injector!
+      new_cb->item = e->item;
+      return new_cb;
    } else { // read = no need to propagate, we are done!
       assert(0);
+      return NULL;
    }
 }
 
 /*
  * 1/ Slow path -- Transaction ID has been written in the transaction slab, now iterate over all keys to find out which ones to write
+ * The writes are sent as one multi-key request per worker (has to be done by injector!).
  * Called injector_queue context. User callback is in trans_callback->payload.
  */
 void kv_start_commit_cb(struct slab_callback *trans_callback, void *item) {
    struct transaction *t = trans_callback->transaction;
-   btree_forall_keys(t->index, write_items_to_disk, trans_callback->payload);
+   size_t base = scratch_reserve(t->nb_items);
+   for(size_t i = 0; i < t->nb_items; i++)
+      scratch_callbacks[base + i] = write_items_to_disk(&t->entries[i], trans_callback->payload);
+   kv_update_many(&scratch_callbacks[base], t->nb_items);
+   scratch_release(base);
    free(trans_callback->item);
-   free(trans_callback);
+   free_slab_callback(trans_callback);
 }
 
 /*
@@ -416,11 +555,9 @@ void kv_start_commit_cb(struct slab_callback *trans_callback, void *item) {
  * Called in injector context
  */
 void kv_end_commit_fast_path(struct transaction *t, struct slab_callback *user_callback) {
-   register_end_transaction(t->transaction_id, t->transaction_id_on_disk);
-   btree_free(t->index);
+   register_end_transaction(t);
+   write_set_free(t);
    free(t->delayed_work);
-   free(t->cached_data);
-   t->cached_data = NULL;
    if(user_callback->cb)
       user_callback->cb(user_callback, NULL);
 }
@@ -435,43 +572,41 @@ void kv_commit_fast_path_cb(struct slab_callback *trans_callback, void *item) {
    if(done == t->nb_items - 1) {
       kv_end_commit_fast_path(t, trans_callback->payload);
    }
-   free(trans_callback);
+   free_slab_callback(trans_callback);
 }
 
 /*
- * 2/ Fast path -- ask the DB to release all the locks taken by the transaction
+ * 2/ Fast path -- prepare the release of a lock taken by the transaction
  * Called in injector context
  */
-void release_transaction_locks(uint64_t hash, void *data) {
-   void *cached_data;
-   index_entry_t *tmp_entry;
-   struct slab_callback *callback = data;
+struct slab_callback *release_transaction_locks(struct write_set_entry *e, struct slab_callback *callback) {
    struct transaction *t = callback->transaction;
 
-   int res = btree_find(t->index, (unsigned char*)&hash, sizeof(hash), &tmp_entry);
-   assert(res);
-   cached_data = &t->cached_data[tmp_entry->cached_data_idx];
-
-   if(tmp_entry->transaction_flags & FLAG_WRITE) {
-      struct slab_callback *new_cb = calloc(1, sizeof(*new_cb));
+   if(e->flags & FLAG_WRITE) {
+      struct slab_callback *new_cb = new_slab_callback();
       new_cb->transaction = t;
       new_cb->cb = kv_commit_fast_path_cb;
       new_cb->payload = callback;
-      new_cb->item = cached_data;
+      new_cb->item = e->item;
       new_cb->injector_queue = callback->injector_queue;
-      kv_revert_update(new_cb);
+      return new_cb;
    } else { // read = no need to propagate, we are done!
       assert(0); // we don't cache reads anymore!
+      return NULL;
    }
 }
 
 /*
- * 1/ Fast path -- iterate on the index
+ * 1/ Fast path -- iterate on the index and ask the DB to release all the locks, one multi-key request per worker
  * Called in injector context
  */
 void commit_fast_path(struct transaction *t, struct slab_callback *callback) {
    if(t->has_write && t->nb_items) {
-      btree_forall_keys(t->index, release_transaction_locks, callback);
+      size_t base = scratch_reserve(t->nb_items);
+      for(size_t i = 0; i < t->nb_items; i++)
+         scratch_callbacks[base + i] = release_transaction_locks(&t->entries[i], callback);
+      kv_revert_many(&scratch_callbacks[base], t->nb_items);
+      scratch_release(base);
    } else {
       kv_end_commit_fast_path(t, callback);
    }
@@ -498,7 +633,7 @@ int kv_commit(struct transaction *t, struct slab_callback *callback) {
    assert(callback->injector_queue); // Transactions are not thread safe and callbacks must be called within a thread context
 
    /* From this point on, we know that the commit cannot abort, but it can crash! */
-   t->transaction_id_on_disk = register_commit_transaction(t->transaction_id);
+   t->transaction_id_on_disk = register_commit_transaction(t);
 
    /* First, write the transaction ID in the transaction slab, so that we can ignore it if it crashes mid-way */
    struct slab_callback *cb = new_slab_callback();
@@ -531,15 +666,7 @@ struct transaction *create_generic_transaction(struct slab_callback *map, void *
    }
 
    register_new_transaction(t);
-   size_t size = 2048*PAGE_SIZE;
-   t->size = size;
-   t->cached_data = malloc(t->size);
-   if(!t->cached_data) {
-      system("free");
-      die("Cannot allocate cached data!! Asked %lu %lu\n", t->size, size);
-   }
-   assert(t->cached_data);
-   t->index = btree_create();
+   write_set_init(t);
    rdtscll(t->rdt_start);
    return t;
 }
@@ -560,6 +687,8 @@ struct transaction *create_long_transaction(struct slab_callback *map, void *pay
 }
 
 void transaction_propagate(void *item, uint64_t max_snapshot_id) {
+   if(item_is_tombstone(item)) // the item did not exist in the snapshots of these transactions
+      return;
    forall_long_running_transaction(item_get_rdt(item), max_snapshot_id, item);
 }
 
@@ -652,7 +781,7 @@ static void scan_commit_cb2(struct slab_callback *cb, void *item) {
    free(p->per_worker);
    //free(p->seen);
    free(p);
-   free(cb);
+   free_slab_callback(cb);
 }
 
 static void scan_commit_cb1(struct slab_callback *cb, void *item) {
@@ -718,7 +847,7 @@ static void scan_cb(struct slab_callback *cb, void *item) {
       }
    }
    free(cb->item);
-   free(cb);
+   free_slab_callback(cb);
 }
 
 void kv_long_scan(struct slab_callback *_cb) {
@@ -7,6 +7,7 @@ struct transaction;
 struct transaction *create_transaction(void);
 void kv_trans_read(struct transaction *t, struct slab_callback *callback);
 void kv_trans_write(struct transaction *t, struct slab_callback *callback);
+void kv_trans_write_many(struct transaction *t, struct slab_callback **callbacks, size_t nb);
 int kv_commit(struct transaction *t, struct slab_callback *callback);
 int kv_abort(struct transaction *t, struct slab_callback *callback); // either commit or abort *have* to be called, even if transaction fails (to free memory)
 
@@ -39,6 +40,7 @@ struct transaction *transaction_get_long_next(struct transaction *t);
 struct transaction *transaction_get_long_prev(struct transaction *t);
 void transaction_set_long_next(struct transaction *t, struct transaction *next);
 void transaction_set_long_prev(struct transaction *t, struct transaction *prev);
+struct transaction_registration *transaction_get_registration(struct transaction *t);
 
 void register_next_batch(struct slab_callback *cb, size_t size, size_t *hashes);
 
@@ -0,0 +1,176 @@
+#include "headers.h"
+#include "uring.h"
+#include <errno.h>
+
+/*
+ * Raw io_uring helpers.
+ *
+ * Usage:
+ *    struct uring r;
+ *    uring_init(&r, 64, 0, 0);
+ *    struct io_uring_sqe *sqe = uring_get_sqe(&r);
+ *    sqe->opcode = IORING_OP_READ; ...
+ *    uring_submit(&r);
+ *    uring_wait_cqes(&r, 1);
+ *    struct io_uring_cqe *cqe = uring_peek_cqe(&r); ... uring_cqe_seen(&r);
+ *
+ * With SQPOLL, a kernel thread consumes the submission queue, so uring_submit only does a syscall when the kernel thread went to sleep.
+ */
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+   return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+   return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+   return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(struct uring *r, unsigned entries, int sqpoll, unsigned sqpoll_idle_ms) {
+   struct io_uring_params p;
+
+   memset(r, 0, sizeof(*r));
+   memset(&p, 0, sizeof(p));
+   if(sqpoll) {
+      p.flags |= IORING_SETUP_SQPOLL;
+      p.sq_thread_idle = sqpoll_idle_ms;
+   }
+
+   r->fd = io_uring_setup(entries, &p);
+   if(r->fd < 0)
+      return -errno;
+   r->setup_flags = p.flags;
+
+   r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   if(p.features & IORING_FEAT_SINGLE_MMAP) {
+      if(r->cq_ring_size > r->sq_ring_size)
+         r->sq_ring_size = r->cq_ring_size;
+      r->cq_ring_size = r->sq_ring_size;
+   }
+
+   r->sq_ring = (char*)mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+   if(r->sq_ring == (char*)MAP_FAILED)
+      goto err;
+   if(p.features & IORING_FEAT_SINGLE_MMAP) {
+      r->cq_ring = r->sq_ring;
+   } else {
+      r->cq_ring = (char*)mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+      if(r->cq_ring == (char*)MAP_FAILED)
+         goto err;
+   }
+
+   r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+   r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+   if(r->sqes == MAP_FAILED)
+      goto err;
+
+   r->sq_head = (void*)(r->sq_ring + p.sq_off.head);
+   r->sq_tail = (void*)(r->sq_ring + p.sq_off.tail);
+   r->sq_mask = (void*)(r->sq_ring + p.sq_off.ring_mask);
+   r->sq_flags = (void*)(r->sq_ring + p.sq_off.flags);
+   r->sq_array = (void*)(r->sq_ring + p.sq_off.array);
+   r->sq_entries = p.sq_entries;
+
+   r->cq_head = (void*)(r->cq_ring + p.cq_off.head);
+   r->cq_tail = (void*)(r->cq_ring + p.cq_off.tail);
+   r->cq_mask = (void*)(r->cq_ring + p.cq_off.ring_mask);
+   r->cqes = (void*)(r->cq_ring + p.cq_off.cqes);
+
+   return 0;
+
+err:
+   {
+      int err = -errno;
+      close(r->fd);
+      return err;
+   }
+}
+
+void uring_exit(struct uring *r) {
+   munmap(r->sqes, r->sqes_size);
+   if(r->cq_ring != r->sq_ring)
+      munmap(r->cq_ring, r->cq_ring_size);
+   munmap(r->sq_ring, r->sq_ring_size);
+   close(r->fd);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *r) {
+   unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+   if(r->sqe_tail - head >= r->sq_entries)
+      return NULL;
+   struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+   r->sqe_tail++;
+   memset(sqe, 0, sizeof(*sqe));
+   return sqe;
+}
+
+/* Make the filled sqes visible to the kernel */
+static unsigned uring_flush_sq(struct uring *r) {
+   unsigned tail = *r->sq_tail;
+   unsigned to_submit = r->sqe_tail - r->sqe_head;
+   for(unsigned i = 0; i < to_submit; i++) {
+      r->sq_array[tail & *r->sq_mask] = r->sqe_head & *r->sq_mask;
+      tail++;
+      r->sqe_head++;
+   }
+   __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+   return to_submit;
+}
+
+int uring_submit(struct uring *r) {
+   unsigned to_submit = uring_flush_sq(r);
+   if(r->setup_flags & IORING_SETUP_SQPOLL) {
+      __sync_synchronize(); // the tail store must be visible before we check if the kernel thread sleeps
+      if(__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+         if(io_uring_enter(r->fd, to_submit, 0, IORING_ENTER_SQ_WAKEUP) < 0)
+            return -errno;
+      }
+      return to_submit;
+   }
+   if(!to_submit)
+      return 0;
+   int ret = io_uring_enter(r->fd, to_submit, 0, 0);
+   return (ret < 0)?-errno:ret;
+}
+
+int uring_wait_cqes(struct uring *r, unsigned min_complete) {
+   int ret = io_uring_enter(r->fd, 0, min_complete, IORING_ENTER_GETEVENTS);
+   return (ret < 0)?-errno:ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *r) {
+   unsigned head = *r->cq_head;
+   if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+      return NULL;
+   return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r) {
+   __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Registered files and buffers: the kernel takes a reference on the file / pins the memory once, instead of once per IO.
+ */
+int uring_register_files(struct uring *r, int *fds, unsigned nb_fds) {
+   int ret = io_uring_register(r->fd, IORING_REGISTER_FILES, fds, nb_fds);
+   return (ret < 0)?-errno:ret;
+}
+
+int uring_update_file(struct uring *r, unsigned slot, int fd) {
+   struct io_uring_files_update up = {
+      .offset = slot,
+      .fds = (uint64_t)&fd,
+   };
+   int ret = io_uring_register(r->fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+   return (ret < 0)?-errno:ret;
+}
+
+int uring_register_buffers(struct uring *r, struct iovec *iovecs, unsigned nb_iovecs) {
+   int ret = io_uring_register(r->fd, IORING_REGISTER_BUFFERS, iovecs, nb_iovecs);
+   return (ret < 0)?-errno:ret;
+}
@@ -0,0 +1,49 @@
+#ifndef URING_H
+#define URING_H 1
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+/*
+ * Minimal io_uring wrapper (no dependency on liburing).
+ * Only what the IO engine and the microbenchmarks need: one ring, submission, completion, registration of files and buffers.
+ */
+struct uring {
+   int fd;
+   unsigned setup_flags;
+
+   /* Submission queue */
+   unsigned *sq_head;
+   unsigned *sq_tail;
+   unsigned *sq_mask;
+   unsigned *sq_flags;
+   unsigned *sq_array;
+   unsigned sq_entries;
+   unsigned sqe_head, sqe_tail;                       // sqes filled by the user but not yet published to the kernel
+   struct io_uring_sqe *sqes;
+
+   /* Completion queue */
+   unsigned *cq_head;
+   unsigned *cq_tail;
+   unsigned *cq_mask;
+   struct io_uring_cqe *cqes;
+
+   char *sq_ring, *cq_ring;
+   size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+int uring_init(struct uring *r, unsigned entries, int sqpoll, unsigned sqpoll_idle_ms); // returns 0 or -errno
+void uring_exit(struct uring *r);
+
+struct io_uring_sqe *uring_get_sqe(struct uring *r); // NULL if the submission queue is full
+int uring_submit(struct uring *r);                   // returns the number of sqes consumed by the kernel (or published, with SQPOLL)
+int uring_wait_cqes(struct uring *r, unsigned min_complete);
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+int uring_register_files(struct uring *r, int *fds, unsigned nb_fds);
+int uring_update_file(struct uring *r, unsigned slot, int fd);
+int uring_register_buffers(struct uring *r, struct iovec *iovecs, unsigned nb_iovecs);
+
+#endif
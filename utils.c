@@ -1,5 +1,7 @@
 #include "headers.h"
 #include "utils.h"
+#include <linux/futex.h>
+#include <errno.h>
 
 static uint64_t freq = 0;
 static uint64_t get_cpu_freq(void) {
@@ -62,3 +64,21 @@ void pin_me_on(int core) {
       die("Cannot pin thread on core %d\n", core);
 
 }
+
+/*
+ * Futex helpers, used to sleep on a counter without holding a lock.
+ * futex_wait only sleeps if *addr is still equal to val.
+ */
+void futex_wait(volatile int *addr, int val) {
+   syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/* Same, but gives up after timeout_us microseconds. Returns 0 on timeout. */
+int futex_wait_timeout(volatile int *addr, int val, uint64_t timeout_us) {
+   struct timespec timeout = { .tv_sec = timeout_us / 1000000, .tv_nsec = (timeout_us % 1000000) * 1000 };
+   return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &timeout, NULL, 0) == 0 || errno != ETIMEDOUT;
+}
+
+void futex_wake(volatile int *addr, int nb_threads) {
+   syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nb_threads, NULL, NULL, 0);
+}
@@ -318,3 +318,6 @@
 uint64_t cycles_to_us(uint64_t cycles);
 void shuffle(size_t *array, size_t n);
 void pin_me_on(int core);
+void futex_wait(volatile int *addr, int val);
+int futex_wait_timeout(volatile int *addr, int val, uint64_t timeout_us);
+void futex_wake(volatile int *addr, int nb_threads);
@@ -30,7 +30,7 @@ char *create_workload_item(struct workload *w) {
    size_t value_size = strlen(name) + 1;
 
    struct item_metadata *meta;
-   char *item = malloc(sizeof(*meta) + key_size + value_size);
+   char *item = calloc(1, sizeof(*meta) + key_size + value_size); // zeroed: the whole key is hashed
    meta = (struct item_metadata *)item;
    meta->key_size = key_size;
    meta->value_size = value_size;
@@ -47,7 +47,7 @@ char *create_workload_item(struct workload *w) {
  */
 static void add_in_tree(struct slab_callback *cb, void *item) {
    free(cb->item);
-   free(cb);
+   free_slab_callback(cb);
 }
 
 struct rebuild_pdata {
@@ -177,12 +177,12 @@ void print_item(size_t idx, void* _item) {
 void show_item(struct slab_callback *cb, void *item) {
    print_item(cb->slab_idx, item);
    free(cb->item);
-   free(cb);
+   free_slab_callback(cb);
 }
 
 void free_callback(struct slab_callback *cb, void *item) {
    free(cb->item);
-   free(cb);
+   free_slab_callback(cb);
 }
 
 void compute_stats(struct slab_callback *cb, void *item) {
@@ -206,7 +206,7 @@ void compute_stats(struct slab_callback *cb, void *item) {
       free(cb->item);
       if(DEBUG)
          free_payload(cb);
-      free(cb);
+      free_slab_callback(cb);
    } stop_debug_timer(5000, "Callback took more than 5ms???");
 }
 
@@ -37,7 +37,7 @@ static void commit_cb(struct slab_callback *cb, void *item) {
       __sync_fetch_and_add(&failed_prod, 1);
    free(get_payload(cb->transaction));
    free(cb->transaction);
-   free(cb);
+   free_slab_callback(cb);
 }
 
 
@@ -55,7 +55,7 @@ static void compute_stats_prod(struct slab_callback *cb, void *item) {
    }
 
    free(cb->item);
-   free(cb);
+   free_slab_callback(cb);
 }
 
 
@@ -143,7 +143,7 @@ static void do_injector_bg_work(struct workload *w, struct injector_queue *q, st
          p->nb_scans_done++;
          free(prod_cb->payload);
          free(prod_cb->item);
-         free(prod_cb);
+         free_slab_callback(prod_cb);
          p->prod_cbs[i] = NULL;
          __sync_add_and_fetch(&glob_nb_scans_done, 1);
       }
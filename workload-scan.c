@@ -48,7 +48,7 @@ static void commit_cb(struct slab_callback *cb, void *item) {
       __sync_fetch_and_add(&failed_scan, 1);
    free(get_payload(cb->transaction));
    free(cb->transaction);
-   free(cb);
+   free_slab_callback(cb);
 }
 
 
@@ -66,7 +66,7 @@ static void compute_stats_scan(struct slab_callback *cb, void *item) {
    }
 
    free(cb->item);
-   free(cb);
+   free_slab_callback(cb);
 }
 
 
@@ -154,7 +154,7 @@ static void do_injector_bg_work(struct workload *w, struct injector_queue *q, st
          p->nb_scans_done++;
          free(scan_cb->payload);
          free(scan_cb->item);
-         free(scan_cb);
+         free_slab_callback(scan_cb);
          p->scan_cbs[i] = NULL;
          __sync_add_and_fetch(&glob_nb_scans_done, 1);
       }
@@ -449,7 +449,7 @@ static void commit_cb(struct slab_callback *cb, void *item) {
       __sync_fetch_and_add(&failed_trans, 1);
 
    free(get_payload(cb->transaction));
-   free(cb);
+   free_slab_callback(cb);
 }
 
 struct transaction_payload {
@@ -478,7 +478,7 @@ static void compute_stats_sql_parser(struct slab_callback *cb, void *item) {
    }
 
    free(cb->item);
-   free(cb);
+   free_slab_callback(cb);
 }
 
 static struct transaction_payload *get_sql_parser_payload(struct transaction *t) {
@@ -669,7 +669,7 @@ static void do_injector_bg_work(struct workload *w, struct injector_queue *q, st
          end = p->scan_cb->max_next_key;
       free(p->scan_cb->payload);
       free(p->scan_cb->item);
-      free(p->scan_cb);
+      free_slab_callback(p->scan_cb);
       p->scan_cb = NULL;
       __sync_add_and_fetch(&glob_nb_scans_done, 1);
       if(p->nb_scans_done < NB_BG_SCANS) {
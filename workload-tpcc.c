@@ -453,7 +453,7 @@ static void commit_cb(struct slab_callback *cb, void *item) {
 
    struct transaction_payload *p = get_payload(cb->transaction);
    free(p);
-   free(cb);
+   free_slab_callback(cb);
 }
 
 static void compute_stats_tpcc(struct slab_callback *cb, void *item) {
@@ -476,7 +476,7 @@ static void compute_stats_tpcc(struct slab_callback *cb, void *item) {
    }
 
    free(cb->item);
-   free(cb);
+   free_slab_callback(cb);
 }
 
 static struct transaction_payload *get_tpcc_payload(struct transaction *t) {
@@ -848,11 +848,12 @@ static void _tpcc_new_order_2(struct slab_callback *cb, void *item) {
    char *order = tpcc_order(p->warehouse, p->district, p->customer, p->oid, p->ol_cnt);
    struct slab_callback *ncb = tpcc_cb(cb->injector_queue, cb->transaction, p, _tpcc_new_order_3);
    ncb->item = order;
-   kv_trans_write(cb->transaction, ncb);
 
    struct slab_callback *ncb2 = tpcc_cb(cb->injector_queue, cb->transaction, new_payload, _tpcc_new_order_3b);
    ncb2->item = create_key(get_key_order_index(new_payload->warehouse, new_payload->district, new_payload->customer));
-   kv_trans_write(cb->transaction, ncb2);
+
+   struct slab_callback *writes[] = { ncb, ncb2 };
+   kv_trans_write_many(cb->transaction, writes, 2);
 }
 
 // Update the last order id of the district
@@ -96,7 +96,7 @@ static void commit_cb(struct slab_callback *cb, void *item) {
       __sync_fetch_and_add(&failed_trans, 1);
 
    free(get_payload(cb->transaction));
-   free(cb);
+   free_slab_callback(cb);
 }
 
 /*
@@ -127,7 +127,7 @@ void _q2_1(struct slab_callback *cb, void *item) {
    kv_commit(cb->transaction, new_cb);
 
    free(cb->item);
-   free(cb);
+   free_slab_callback(cb);
 }
 
 void q2(struct injector_queue *q) {
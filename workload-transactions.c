@@ -47,7 +47,7 @@ static void commit_cb(struct slab_callback *cb, void *item) {
    if(has_failed(cb->transaction))
       __sync_fetch_and_add(&failed_trans, 1);
    free(get_payload(cb->transaction));
-   free(cb);
+   free_slab_callback(cb);
 }
 
 
@@ -68,7 +68,7 @@ static void compute_stats_trans(struct slab_callback *cb, void *item) {
    //__reads_from_snapshot++;
 
    free(cb->item);
-   free(cb);
+   free_slab_callback(cb);
 }
 
 
@@ -30,8 +30,39 @@ static int random_get_put(int test) {
    die("Not a valid test\n");
 }
 
+/* YCSB A (or D), B, C -- batched version, reads and updates are sent by groups of YCSB_BATCH_SIZE */
+static void _launch_ycsb_batched(int test, int nb_requests, int zipfian) {
+   declare_periodic_count;
+   struct slab_callback *reads[YCSB_BATCH_SIZE?YCSB_BATCH_SIZE:1], *updates[YCSB_BATCH_SIZE?YCSB_BATCH_SIZE:1];
+   size_t nb_reads = 0, nb_updates = 0;
+   for(size_t i = 0; i < nb_requests; i++) {
+      struct slab_callback *cb = bench_cb();
+      if(zipfian)
+         cb->item = _create_unique_item_ycsb(zipf_next());
+      else
+         cb->item = _create_unique_item_ycsb(uniform_next());
+      if(random_get_put(test)) {
+         updates[nb_updates++] = cb;
+      } else {
+         reads[nb_reads++] = cb;
+      }
+      if(nb_updates == YCSB_BATCH_SIZE || i == nb_requests - 1) {
+         kv_update_many(updates, nb_updates);
+         nb_updates = 0;
+      }
+      if(nb_reads == YCSB_BATCH_SIZE || i == nb_requests - 1) {
+         kv_read_many(reads, nb_reads);
+         nb_reads = 0;
+      }
+      periodic_count(1000, "YCSB Load Injector (batched) (%lu%%)", i*100LU/nb_requests);
+   }
+}
+
 /* YCSB A (or D), B, C */
 static void _launch_ycsb(int test, int nb_requests, int zipfian) {
+   if(YCSB_BATCH_SIZE)
+      return _launch_ycsb_batched(test, nb_requests, zipfian);
+
    declare_periodic_count;
    for(size_t i = 0; i < nb_requests; i++) {
       struct slab_callback *cb = bench_cb();